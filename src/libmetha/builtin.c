@@ -156,10 +156,12 @@ lm_extract_css_urls(uehandle_t *ue_h, char *p, size_t sz)
         if (!(s = memmem(p, e-p, t, strlen(t))))
             continue;
 
-        ue_add(ue_h, p, s-p);
+        ue_add_deferred(ue_h, p, s-p);
         p = s;
     }
 
+    ue_add_flush(ue_h);
+
     return M_OK;
 }
 
@@ -188,7 +190,7 @@ lm_extract_text_urls(uehandle_t *ue_h, char *p, size_t sz)
                     if (!isalnum(*s) && *s != '%' && *s != '?'
                         && *s != '=' && *s != '&' && *s != '/'
                         && *s != '.') {
-                        ue_add(ue_h, p-protocols[x].len, (s-p)+protocols[x].len);
+                        ue_add_deferred(ue_h, p-protocols[x].len, (s-p)+protocols[x].len);
                         break;
                     }
                 }
@@ -197,6 +199,8 @@ lm_extract_text_urls(uehandle_t *ue_h, char *p, size_t sz)
         }
     }
 
+    ue_add_flush(ue_h);
+
     return M_OK;
 }
 
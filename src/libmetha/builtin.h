@@ -31,6 +31,7 @@
 /* html.c */
 M_CODE lm_parser_html(struct worker *w, struct iobuf *buf, struct uehandle *ue_h, struct url *url, struct attr_list *al);
 M_CODE lm_parser_xmlconv(struct worker *w, struct iobuf *buf, struct uehandle *ue_h, struct url *url, struct attr_list *al);
+size_t lm_parser_html_stream(struct iostream *st, char *p, size_t sz, int eof);
 
 /* builtin.c */
 M_CODE lm_parser_css(struct worker *w, struct iobuf *buf, struct uehandle *ue_h, struct url *url, struct attr_list *al);
@@ -0,0 +1,780 @@
+/*-
+ * checkpoint.c
+ * This file is part of libmetha
+ *
+ * Copyright (c) 2008, Emil Romanus <emil.romanus@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ * http://bithack.se/projects/methabot/
+ */
+
+/**
+ * Saving and restoring the state of the URL engine, so that
+ * a stopped session can be continued by another process
+ * without crawling everything again.
+ *
+ * A checkpoint file contains, in this order:
+ *  - the names of all filetypes and crawlers, since URLs
+ *    and utable levels refer to them by position
+ *  - every host entry, with its seen-set and its list of
+ *    URLs not yet crawled, including those on disk
+ *  - the names of the hosts in the pending queue
+ *  - the utables of the workers that were stopped, see
+ *    ue_handle_park()
+ *
+ * Fingerprint sets, and the sorted fingerprints of retired
+ * hosts, are dumped as they are. The strings of an
+ * mtrie are written in sorted order with the length of the
+ * prefix shared with the previous string, which for most
+ * hosts leaves only a few bytes per URL.
+ *
+ * Numbers are written in the host's byte order, a checkpoint
+ * is meant to be resumed on the machine it was made on. The
+ * file is mapped into memory by lmetha_resume() and parsed
+ * in place.
+ **/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "metha.h"
+
+#define LM_CKPT_MAGIC     "LMCKPT\0\4"
+#define LM_CKPT_MAGIC_LEN 8
+#define LM_CKPT_NONE      0xffffffff
+
+/* host entry flags */
+#define LM_CKPT_HOST_FP   1 /* the seen-set is an fpset_t */
+#define LM_CKPT_HOST_RETIRED 2 /* sorted fingerprints, see ue_retire() */
+
+/* fields of a URL, followed by the string */
+struct ckpt_url {
+    uint16_t sz, file_o, ext_o;
+    uint8_t  host_o, host_l;
+    uint8_t  bind, protocol;
+    uint8_t  flags;
+};
+
+struct ckpt_out {
+    FILE     *fp;
+    int       err;
+    metha_t  *m;
+
+    /* previous string written by lm_ckpt_put_seen_cb() */
+    uint16_t  prev_len;
+    uint32_t  count;
+    char      prev[65536];
+};
+
+struct ckpt_in {
+    const char *p;
+    const char *e;
+    int         err;
+
+    uint8_t    *ftmap; /* new filetype id of each old one */
+    uint32_t    nft;
+    crawler_t **crawlers;
+    uint32_t    ncr;
+};
+
+static void lm_ckpt_put(struct ckpt_out *out, const void *p, size_t n);
+static void lm_ckpt_put_u32(struct ckpt_out *out, uint32_t v);
+static void lm_ckpt_put_str(struct ckpt_out *out, const char *s, size_t len);
+static void lm_ckpt_put_url(struct ckpt_out *out, url_t *u);
+static void lm_ckpt_put_list(struct ckpt_out *out, ulist_t *l);
+static void lm_ckpt_put_host(struct ckpt_out *out, struct host_ent *ent);
+static void lm_ckpt_put_handle(struct ckpt_out *out, uehandle_t *h);
+static void lm_ckpt_put_seen_cb(void *arg, const char *s, uint16_t len);
+static const void *lm_ckpt_get(struct ckpt_in *in, size_t n);
+static uint32_t lm_ckpt_get_u32(struct ckpt_in *in);
+static const char *lm_ckpt_get_str(struct ckpt_in *in, uint16_t *len);
+static M_CODE lm_ckpt_get_list(struct ckpt_in *in, ulist_t *l, size_t *cost);
+static M_CODE lm_ckpt_get_host(struct ckpt_in *in, uehandle_t *h);
+static M_CODE lm_ckpt_get_handle(struct ckpt_in *in, ue_t *ue);
+
+/**
+ * Save the state of the url engine to the given file. The
+ * file is written under a temporary name and then renamed,
+ * so an earlier checkpoint with the same name is only
+ * replaced once the new one is complete.
+ *
+ * Must not be called while a session is running. Workers
+ * that were stopped before they were done give their
+ * URLs to the url engine, see ue_handle_park(), so a
+ * checkpoint made after lmetha_exec() has returned
+ * contains everything needed to continue. A URL that was
+ * taken but not fetched when its worker stopped is put 
+ * back first, see lm_worker_putback().
+ **/
+M_CODE
+lmetha_checkpoint(metha_t *m, const char *file)
+{
+    struct ckpt_out   *out;
+    struct ue_hosttab *t;
+    struct host_ent   *p;
+    ue_t     *ue = &m->ue;
+    char     *tmp;
+    uint32_t  x, y, n;
+    M_CODE    ret = M_IO_ERROR;
+
+    if (m->state != LM_STATE_PREPARED)
+        return M_NOT_READY;
+
+    if (!(out = malloc(sizeof(struct ckpt_out))))
+        return M_OUT_OF_MEM;
+    if (!(tmp = malloc(strlen(file)+5))) {
+        free(out);
+        return M_OUT_OF_MEM;
+    }
+    sprintf(tmp, "%s.tmp", file);
+
+    if (!(out->fp = fopen(tmp, "w"))) {
+        LM_ERROR(m, "could not open '%s' for writing", tmp);
+        free(tmp);
+        free(out);
+        return M_COULD_NOT_OPEN;
+    }
+
+#ifdef DEBUG
+    fprintf(stderr, "* metha:(%p) writing checkpoint to '%s'\n", m, file);
+#endif
+
+    setvbuf(out->fp, 0, _IOFBF, 256*1024);
+    out->err = 0;
+    out->m   = m;
+
+    lm_ckpt_put(out, LM_CKPT_MAGIC, LM_CKPT_MAGIC_LEN);
+
+    lm_ckpt_put_u32(out, m->num_filetypes);
+    for (x=0; x<m->num_filetypes; x++)
+        lm_ckpt_put_str(out, m->filetypes[x]->name, strlen(m->filetypes[x]->name));
+    lm_ckpt_put_u32(out, m->num_crawlers);
+    for (x=0; x<m->num_crawlers; x++)
+        lm_ckpt_put_str(out, m->crawlers[x]->name, strlen(m->crawlers[x]->name));
+
+    /* host entries, both tables are walked since some
+     * entries might not have been moved yet */
+    lm_ckpt_put_u32(out, ue->hosts.count);
+    for (t = ue->hosts.cur; t; t = (t == ue->hosts.cur ? ue->hosts.old : 0))
+        for (x=0; x<=t->mask; x++)
+            for (p = t->buckets[x]; p; p = p->next)
+                lm_ckpt_put_host(out, p);
+
+    n = 0;
+    for (x=0; x<UE_PENDING_SHARDS; x++)
+        n += ue->pending.shards[x].sz;
+    lm_ckpt_put_u32(out, n);
+    for (x=0; x<UE_PENDING_SHARDS; x++) {
+        struct ue_pqueue *q = &ue->pending.shards[x];
+        for (y=0; y<q->sz; y++)
+            lm_ckpt_put_str(out, q->heap[y]->str, q->heap[y]->len);
+    }
+
+    lm_ckpt_put_u32(out, ue->parked.count);
+    for (x=0; x<ue->parked.count; x++)
+        lm_ckpt_put_handle(out, ue->parked.list[x]);
+
+    if (fflush(out->fp) != 0 || fsync(fileno(out->fp)) != 0)
+        out->err = 1;
+    if (fclose(out->fp) != 0)
+        out->err = 1;
+
+    if (out->err || rename(tmp, file) != 0) {
+        LM_ERROR(m, "writing checkpoint '%s' failed", file);
+        unlink(tmp);
+    } else
+        ret = M_OK;
+
+    free(tmp);
+    free(out);
+    return ret;
+}
+
+/**
+ * Load a checkpoint written by lmetha_checkpoint(). Must be
+ * called after lmetha_prepare(), and before the session is
+ * started. The loaded state is added to what the url engine
+ * already knows. The utables of the stopped workers are given
+ * to the workers of the next session, see start_worker_threads().
+ *
+ * URLs bound to filetypes that no longer exist are dropped,
+ * and utable levels of unknown crawlers continue with the
+ * initial crawler.
+ **/
+M_CODE
+lmetha_resume(metha_t *m, const char *file)
+{
+    struct ckpt_in  in;
+    struct stat     st;
+    uehandle_t     *h = 0;
+    filetype_t     *ft;
+    const char     *s;
+    void           *map;
+    uint32_t        x, n;
+    uint16_t        len;
+    int             fd;
+    char            name[256];
+    M_CODE          ret = M_SYNTAX_ERROR;
+
+    if (m->state != LM_STATE_PREPARED)
+        return M_NOT_READY;
+
+    if ((fd = open(file, O_RDONLY)) == -1) {
+        LM_ERROR(m, "could not open checkpoint '%s'", file);
+        return M_COULD_NOT_OPEN;
+    }
+    if (fstat(fd, &st) != 0 || !st.st_size) {
+        close(fd);
+        return M_IO_ERROR;
+    }
+    if ((map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        close(fd);
+        return M_IO_ERROR;
+    }
+    close(fd);
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+#ifdef DEBUG
+    fprintf(stderr, "* metha:(%p) resuming from '%s' (%lld bytes)\n", m, file, (long long)st.st_size);
+#endif
+
+    memset(&in, 0, sizeof(struct ckpt_in));
+    in.p = map;
+    in.e = (const char*)map+st.st_size;
+
+    if (!(s = lm_ckpt_get(&in, LM_CKPT_MAGIC_LEN))
+            || memcmp(s, LM_CKPT_MAGIC, LM_CKPT_MAGIC_LEN) != 0) {
+        LM_ERROR(m, "'%s' is not a checkpoint file", file);
+        goto done;
+    }
+
+    /* map the filetypes and crawlers of the checkpoint
+     * to the current ones */
+    in.nft = lm_ckpt_get_u32(&in);
+    if (in.err || in.nft > 255 || !(in.ftmap = calloc(in.nft+1, 1)))
+        goto done;
+    for (x=0; x<in.nft; x++) {
+        if (!(s = lm_ckpt_get_str(&in, &len)))
+            goto done;
+        if (len < sizeof(name)) {
+            memcpy(name, s, len);
+            name[len] = '\0';
+            if ((ft = lmetha_get_filetype(m, name)))
+                in.ftmap[x+1] = ft->id;
+        }
+    }
+
+    in.ncr = lm_ckpt_get_u32(&in);
+    if (in.err || in.ncr > (in.e-in.p)/2
+            || !(in.crawlers = calloc(in.ncr+1, sizeof(crawler_t*))))
+        goto done;
+    for (x=0; x<in.ncr; x++) {
+        if (!(s = lm_ckpt_get_str(&in, &len)))
+            goto done;
+        if (len < sizeof(name)) {
+            memcpy(name, s, len);
+            name[len] = '\0';
+            in.crawlers[x] = lmetha_get_crawler(m, name);
+        }
+        if (!in.crawlers[x])
+            in.crawlers[x] = m->crawlers[m->crawler];
+    }
+
+    if (!(h = ue_handle_obtain(&m->ue))) {
+        ret = M_OUT_OF_MEM;
+        goto done;
+    }
+
+    n = lm_ckpt_get_u32(&in);
+    for (x=0; x<n && !in.err; x++)
+        if ((ret = lm_ckpt_get_host(&in, h)) != M_OK)
+            goto done;
+
+    n = lm_ckpt_get_u32(&in);
+    for (x=0; x<n && !in.err; x++) {
+        struct host_ent *ent;
+        if (!(s = lm_ckpt_get_str(&in, &len)))
+            break;
+        if ((ent = ue_get_hostent(h, s, len, 0)) && !ent->pending)
+            ue_push_pending(h, ent);
+    }
+
+    n = lm_ckpt_get_u32(&in);
+    for (x=0; x<n && !in.err; x++)
+        if ((ret = lm_ckpt_get_handle(&in, &m->ue)) != M_OK)
+            goto done;
+
+    ret = in.err ? M_SYNTAX_ERROR : M_OK;
+
+done:
+    if (ret != M_OK)
+        LM_ERROR(m, "resuming from checkpoint '%s' failed", file);
+    if (h)
+        ue_handle_free(h);
+    free(in.ftmap);
+    free(in.crawlers);
+    munmap(map, st.st_size);
+    return ret;
+}
+
+static void
+lm_ckpt_put(struct ckpt_out *out, const void *p, size_t n)
+{
+    if (n && fwrite(p, n, 1, out->fp) != 1)
+        out->err = 1;
+}
+
+static void
+lm_ckpt_put_u32(struct ckpt_out *out, uint32_t v)
+{
+    lm_ckpt_put(out, &v, sizeof(uint32_t));
+}
+
+static void
+lm_ckpt_put_str(struct ckpt_out *out, const char *s, size_t len)
+{
+    uint16_t l = (uint16_t)len;
+
+    lm_ckpt_put(out, &l, sizeof(uint16_t));
+    lm_ckpt_put(out, s, l);
+}
+
+static void
+lm_ckpt_put_url(struct ckpt_out *out, url_t *u)
+{
+    struct ckpt_url r;
+
+    memset(&r, 0, sizeof(struct ckpt_url));
+    r.sz       = u->sz;
+    r.file_o   = u->file_o;
+    r.ext_o    = u->ext_o;
+    r.host_o   = u->host_o;
+    r.host_l   = u->host_l;
+    r.bind     = u->bind;
+    r.protocol = u->protocol;
+    r.flags    = u->flags;
+
+    lm_ckpt_put(out, &r, sizeof(struct ckpt_url));
+    lm_ckpt_put(out, u->str, u->sz);
+}
+
+/**
+ * Write the number of URLs in the list followed by the URLs,
+ * those on disk included. The list is read back as one, and
+ * URLs are popped from its end, while ue_next() takes the 
+ * URLs in memory first and then the runs on disk first to
+ * last. So the runs are written last to first, followed by
+ * the URLs in memory.
+ **/
+static void
+lm_ckpt_put_list(struct ckpt_out *out, ulist_t *l)
+{
+    spill_t    *disk = &out->m->ue.frontier.disk;
+    spillref_t *r, **runs = 0;
+    ulist_t     tmp;
+    uint32_t    n = 0, nruns = 0, y;
+    size_t      x;
+
+    for (x=0; x<l->sz; x++)
+        if (l->row[x].sz)
+            n ++;
+    for (r = l->spilled; r; r = r->next) {
+        n += r->count;
+        nruns ++;
+    }
+
+    if (nruns && !(runs = malloc(nruns*sizeof(spillref_t*)))) {
+        out->err = 1;
+        return;
+    }
+    for (r = l->spilled, y = 0; r; r = r->next)
+        runs[y++] = r;
+
+    lm_ckpt_put_u32(out, n);
+
+    for (y=nruns; y>0; y--) {
+        lm_ulist_init(&tmp, 0);
+        if (lm_spill_load(disk, runs[y-1], &tmp) != M_OK || tmp.sz != runs[y-1]->count)
+            out->err = 1;
+        for (x=0; x<tmp.sz; x++)
+            lm_ckpt_put_url(out, &tmp.row[x]);
+        lm_ulist_uninit(&tmp);
+    }
+
+    for (x=0; x<l->sz; x++)
+        if (l->row[x].sz)
+            lm_ckpt_put_url(out, &l->row[x]);
+
+    free(runs);
+}
+
+/**
+ * Called by mtrie_walk() for each string of a host's seen-set
+ **/
+static void
+lm_ckpt_put_seen_cb(void *arg, const char *s, uint16_t len)
+{
+    struct ckpt_out *out = arg;
+    uint16_t pre = 0, sfx;
+
+    while (pre < len && pre < out->prev_len && out->prev[pre] == s[pre])
+        pre ++;
+    sfx = len-pre;
+
+    lm_ckpt_put(out, &pre, sizeof(uint16_t));
+    lm_ckpt_put(out, &sfx, sizeof(uint16_t));
+    lm_ckpt_put(out, s+pre, sfx);
+
+    memcpy(out->prev+pre, s+pre, sfx);
+    out->prev_len = len;
+    out->count ++;
+}
+
+static void
+lm_ckpt_put_host(struct ckpt_out *out, struct host_ent *ent)
+{
+    uint8_t flags = (ent->use_fp ? LM_CKPT_HOST_FP : 0);
+    long    pos, end;
+
+    if (ent->retired)
+        flags = LM_CKPT_HOST_RETIRED;
+
+    lm_ckpt_put_str(out, ent->str, ent->len);
+    lm_ckpt_put(out, &flags, 1);
+    lm_ckpt_put_u32(out, ent->inlinks);
+
+    if (ent->retired) {
+        lm_ckpt_put_u32(out, ent->nretired);
+        lm_ckpt_put(out, ent->retired, (size_t)ent->nretired*sizeof(uint64_t));
+    } else if (ent->use_fp) {
+        lm_ckpt_put_u32(out, ent->fp.slots ? ent->fp.mask+1 : 0);
+        if (ent->fp.slots)
+            lm_ckpt_put(out, ent->fp.slots, (ent->fp.mask+1)*sizeof(uint64_t));
+    } else {
+        /* the number of strings is not known until the
+         * table has been walked */
+        pos = ftell(out->fp);
+        lm_ckpt_put_u32(out, 0);
+
+        out->prev_len = 0;
+        out->count    = 0;
+        if (mtrie_walk(&ent->cache, &lm_ckpt_put_seen_cb, out) != M_OK)
+            out->err = 1;
+
+        if (out->count) {
+            end = ftell(out->fp);
+            if (pos == -1 || end == -1 || fseek(out->fp, pos, SEEK_SET) != 0)
+                out->err = 1;
+            lm_ckpt_put_u32(out, out->count);
+            if (fseek(out->fp, end, SEEK_SET) != 0)
+                out->err = 1;
+        }
+    }
+
+    lm_ckpt_put_list(out, &ent->list);
+}
+
+static void
+lm_ckpt_put_handle(struct ckpt_out *out, uehandle_t *h)
+{
+    uint32_t x, y, cr;
+
+    if (h->host_ent)
+        lm_ckpt_put_str(out, h->host_ent->str, h->host_ent->len);
+    else
+        lm_ckpt_put_str(out, "", 0);
+    if (h->is_peeking && h->host_ent_bk)
+        lm_ckpt_put_str(out, h->host_ent_bk->str, h->host_ent_bk->len);
+    else
+        lm_ckpt_put_str(out, "", 0);
+
+    lm_ckpt_put_u32(out, h->is_peeking);
+    lm_ckpt_put_u32(out, h->depth_counter);
+    lm_ckpt_put_u32(out, h->depth_counter_bk);
+    lm_ckpt_put_u32(out, h->depth_limit_bk);
+
+    lm_ckpt_put_u32(out, h->primary.sz);
+    for (x=0; x<h->primary.sz; x++) {
+        /* the private pointer of a level is its crawler,
+         * see ue_set_state_info() */
+        cr = LM_CKPT_NONE;
+        for (y=0; y<out->m->num_crawlers; y++)
+            if (h->primary.row[x].private == out->m->crawlers[y])
+                cr = y;
+        lm_ckpt_put_u32(out, cr);
+        lm_ckpt_put_list(out, &h->primary.row[x]);
+    }
+}
+
+/**
+ * Return a pointer to the next n bytes of the checkpoint,
+ * or 0 if the file ends before that
+ **/
+static const void *
+lm_ckpt_get(struct ckpt_in *in, size_t n)
+{
+    const char *p = in->p;
+
+    if (in->err || (size_t)(in->e-in->p) < n) {
+        in->err = 1;
+        return 0;
+    }
+
+    in->p += n;
+    return p;
+}
+
+static uint32_t
+lm_ckpt_get_u32(struct ckpt_in *in)
+{
+    const void *p;
+    uint32_t    v = 0;
+
+    if ((p = lm_ckpt_get(in, sizeof(uint32_t))))
+        memcpy(&v, p, sizeof(uint32_t));
+
+    return v;
+}
+
+static const char *
+lm_ckpt_get_str(struct ckpt_in *in, uint16_t *len)
+{
+    const void *p;
+
+    if (!(p = lm_ckpt_get(in, sizeof(uint16_t))))
+        return 0;
+    memcpy(len, p, sizeof(uint16_t));
+
+    return lm_ckpt_get(in, *len);
+}
+
+/**
+ * Append the URLs written by lm_ckpt_put_list() to l, the
+ * memory they use is added to *cost if it is set
+ **/
+static M_CODE
+lm_ckpt_get_list(struct ckpt_in *in, ulist_t *l, size_t *cost)
+{
+    struct ckpt_url r;
+    const void *p;
+    url_t       tmp, *t;
+    uint32_t    x, n;
+
+    n = lm_ckpt_get_u32(in);
+
+    for (x=0; x<n; x++) {
+        if (!(p = lm_ckpt_get(in, sizeof(struct ckpt_url))))
+            return M_SYNTAX_ERROR;
+        memcpy(&r, p, sizeof(struct ckpt_url));
+        if (!(p = lm_ckpt_get(in, r.sz)))
+            return M_SYNTAX_ERROR;
+
+        /* the URL's filetype is gone */
+        if (r.bind && (r.bind > in->nft || !in->ftmap[r.bind]))
+            continue;
+
+        tmp.str      = (char*)p;
+        tmp.allocsz  = r.sz+1;
+        tmp.sz       = r.sz;
+        tmp.file_o   = r.file_o;
+        tmp.ext_o    = r.ext_o;
+        tmp.host_o   = r.host_o;
+        tmp.host_l   = r.host_l;
+        tmp.bind     = r.bind ? in->ftmap[r.bind] : 0;
+        tmp.protocol = r.protocol;
+        tmp.flags    = r.flags;
+
+        if (!(t = lm_ulist_inc(l)))
+            return M_OUT_OF_MEM;
+        if (lm_url_dup(t, &tmp) != M_OK) {
+            lm_ulist_dec(l);
+            return M_OUT_OF_MEM;
+        }
+        t->str[t->sz] = '\0';
+
+        if (cost)
+            *cost += sizeof(url_t)+t->allocsz;
+    }
+
+    return M_OK;
+}
+
+/**
+ * Read a host entry written by lm_ckpt_put_host(). The
+ * entry is created if the url engine does not know the
+ * host already, otherwise the seen-sets and lists are
+ * merged.
+ **/
+static M_CODE
+lm_ckpt_get_host(struct ckpt_in *in, uehandle_t *h)
+{
+    struct host_ent *ent;
+    const char *s;
+    const void *p;
+    uint16_t    len, pre, sfx;
+    uint32_t    x, n;
+    uint64_t    fp;
+    uint8_t     flags;
+    size_t      cost = 0;
+    url_t       tmp;
+    char        buf[65536];
+    M_CODE      ret;
+
+    if (!(s = lm_ckpt_get_str(in, &len)) || !(p = lm_ckpt_get(in, 1)))
+        return M_SYNTAX_ERROR;
+    flags = *(const uint8_t*)p;
+
+    h->fingerprints = (flags & (LM_CKPT_HOST_FP|LM_CKPT_HOST_RETIRED));
+    if (!(ent = ue_get_hostent(h, s, len, 0)))
+        return M_OUT_OF_MEM;
+    __sync_fetch_and_add(&ent->inlinks, lm_ckpt_get_u32(in));
+
+    n = lm_ckpt_get_u32(in);
+
+    if (flags & LM_CKPT_HOST_RETIRED) {
+        if (!(p = lm_ckpt_get(in, (size_t)n*sizeof(uint64_t))))
+            return M_SYNTAX_ERROR;
+
+        if (ent->use_fp && !ent->fp.slots && !ent->retired && n) {
+            /* a new entry, it stays retired */
+            if (!(ent->retired = malloc((size_t)n*sizeof(uint64_t))))
+                return M_OUT_OF_MEM;
+            memcpy(ent->retired, p, (size_t)n*sizeof(uint64_t));
+            ent->nretired = n;
+        } else if (ent->use_fp && !ent->retired) {
+            for (x=0; x<n; x++) {
+                memcpy(&fp, (const char*)p+x*sizeof(uint64_t), sizeof(uint64_t));
+                lm_fpset_tryadd_hash(&ent->fp, fp);
+            }
+        }
+    } else if (flags & LM_CKPT_HOST_FP) {
+        if (n & (n-1) || !(p = lm_ckpt_get(in, (size_t)n*sizeof(uint64_t))))
+            return M_SYNTAX_ERROR;
+
+        if (ent->use_fp && !ent->fp.slots && n) {
+            /* a new entry, the set is used as it is */
+            if (!(ent->fp.slots = malloc((size_t)n*sizeof(uint64_t))))
+                return M_OUT_OF_MEM;
+            memcpy(ent->fp.slots, p, (size_t)n*sizeof(uint64_t));
+            ent->fp.mask  = n-1;
+            ent->fp.count = 0;
+            for (x=0; x<n; x++)
+                if (ent->fp.slots[x])
+                    ent->fp.count ++;
+        } else if (ent->use_fp) {
+            for (x=0; x<n; x++) {
+                memcpy(&fp, (const char*)p+x*sizeof(uint64_t), sizeof(uint64_t));
+                if (fp)
+                    lm_fpset_tryadd_hash(&ent->fp, fp);
+            }
+        }
+        /* an existing host with an mtrie can not use
+         * the fingerprints, its URLs might be crawled again */
+    } else {
+        tmp.str    = buf;
+        tmp.host_o = 0;
+
+        for (x=0; x<n; x++) {
+            if (!(p = lm_ckpt_get(in, 2*sizeof(uint16_t))))
+                return M_SYNTAX_ERROR;
+            memcpy(&pre, p, sizeof(uint16_t));
+            memcpy(&sfx, (const char*)p+sizeof(uint16_t), sizeof(uint16_t));
+            if ((size_t)pre+sfx >= sizeof(buf) || !(p = lm_ckpt_get(in, sfx)))
+                return M_SYNTAX_ERROR;
+            memcpy(buf+pre, p, sfx);
+            tmp.sz = pre+sfx;
+
+            if (ent->use_fp)
+                lm_fpset_tryadd_hash(&ent->fp, lm_fpset_hash(buf, tmp.sz));
+            else
+                mtrie_tryadd(&ent->cache, &tmp);
+        }
+    }
+
+    pthread_mutex_lock(&ent->lock);
+    n = ent->list.sz;
+    ret = lm_ckpt_get_list(in, &ent->list, &cost);
+    ent->backlog += ent->list.sz-n;
+    pthread_mutex_unlock(&ent->lock);
+    __sync_fetch_and_add(&h->parent->frontier.lists, cost);
+
+    return ret;
+}
+
+/**
+ * Read the utable of a stopped worker and park it, so that a
+ * worker of the next session will continue with it
+ **/
+static M_CODE
+lm_ckpt_get_handle(struct ckpt_in *in, ue_t *ue)
+{
+    uehandle_t *h;
+    ulist_t    *l;
+    const char *s;
+    uint16_t    len;
+    uint32_t    x, n, cr;
+    M_CODE      ret = M_SYNTAX_ERROR;
+
+    if (!(h = ue_handle_obtain(ue)))
+        return M_OUT_OF_MEM;
+
+    if (!(s = lm_ckpt_get_str(in, &len)))
+        goto fail;
+    if (len) {
+        h->host_ent = ue_get_hostent(h, s, len, 0);
+        ue_host_hold(h->host_ent);
+    }
+    if (!(s = lm_ckpt_get_str(in, &len)))
+        goto fail;
+    if (len)
+        h->host_ent_bk = ue_get_hostent(h, s, len, 0);
+
+    h->is_peeking       = lm_ckpt_get_u32(in);
+    h->depth_counter    = lm_ckpt_get_u32(in);
+    h->depth_counter_bk = lm_ckpt_get_u32(in);
+    h->depth_limit_bk   = lm_ckpt_get_u32(in);
+    if (h->is_peeking && !h->host_ent_bk)
+        h->is_peeking = 0;
+    if (h->is_peeking)
+        ue_host_hold(h->host_ent_bk);
+
+    n = lm_ckpt_get_u32(in);
+    if (in->err)
+        goto fail;
+
+    for (x=0; x<n; x++) {
+        if (x && lm_utable_inc(&h->primary) != M_OK) {
+            ret = M_OUT_OF_MEM;
+            goto fail;
+        }
+        l  = lm_utable_top(&h->primary);
+        cr = lm_ckpt_get_u32(in);
+        l->private = (cr < in->ncr ? in->crawlers[cr] : 0);
+
+        if ((ret = lm_ckpt_get_list(in, l, 0)) != M_OK)
+            goto fail;
+    }
+
+    ue_handle_park(h);
+    return M_OK;
+
+fail:
+    ue_handle_free(h);
+    return ret;
+}
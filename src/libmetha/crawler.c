@@ -103,6 +103,17 @@ lm_crawler_dup(crawler_t *dest, crawler_t *source)
     }
 
     dest->peek_limit = source->peek_limit;
+    dest->max_body_size = source->max_body_size;
+
+    if (source->canon.num_strip) {
+        if (!(dest->canon.strip = malloc(source->canon.num_strip*sizeof(char *))))
+            return M_OUT_OF_MEM;
+
+        for (x=0; x<source->canon.num_strip; x++)
+            dest->canon.strip[x] = strdup(source->canon.strip[x]);
+    }
+    dest->canon.num_strip = source->canon.num_strip;
+    dest->canon.sort = source->canon.sort;
 
     return M_OK;
 }
@@ -134,9 +145,19 @@ lm_crawler_clear(crawler_t *c)
         }
     }
 
+    if (c->canon.num_strip) {
+        for (x=0; x<c->canon.num_strip; x++)
+            free(c->canon.strip[x]);
+        free(c->canon.strip);
+        c->canon.strip = 0;
+        c->canon.num_strip = 0;
+    }
+
     c->flags = 0;
     c->peek_limit = 0;
     c->depth_limit = 1;
+    c->max_body_size = 0;
+    c->canon.sort = 0;
 }
 
 /** 
@@ -186,3 +207,27 @@ lm_crawler_set_filetypes(crawler_t *cr, char **filetypes, int num_filetypes)
     return M_OK;
 }
 
+
+/** 
+ * Set the names of the query and path parameters removed 
+ * from found URLs, see lm_url_canonicalize()
+ *
+ * Used by lmetha_load_config() when parsing configuration
+ * files.
+ **/
+M_CODE
+lm_crawler_set_strip_params(crawler_t *cr, char **params, int num_params)
+{
+    int x;
+
+    if (cr->canon.num_strip) {
+        for (x=0; x<cr->canon.num_strip; x++)
+            free(cr->canon.strip[x]);
+        free(cr->canon.strip);
+    }
+
+    cr->canon.strip = params;
+    cr->canon.num_strip = num_params;
+
+    return M_OK;
+}
@@ -42,6 +42,8 @@ enum {
     LM_CRFLAG_SPREAD_WORKERS = 1<<3, 
     LM_CRFLAG_JAIL           = 1<<4, 
     LM_CRFLAG_ROBOTSTXT      = 1<<5, 
+    LM_CRFLAG_GET_LOOKUP     = 1<<6, /* GET instead of HEAD for type lookups */
+    LM_CRFLAG_FINGERPRINTS   = 1<<7, /* remember URLs by fingerprint, see fpset.c */
 };
 
 typedef struct crawler {
@@ -61,18 +63,21 @@ typedef struct crawler {
     /* options */
     unsigned int  depth_limit;
     unsigned int  peek_limit;   /* when external peek is used */
+    unsigned int  max_body_size; /* in bytes, 0 means no limit */
     char         *init;         /* init function for this crawler */
     union {
         char       *name;
         filetype_t *ptr;
     } initial_filetype; /* type of the initial URLs */
     uint8_t       flags;
+    lm_canon_t    canon;        /* strip_params and sort_params */
 } crawler_t;
 
 crawler_t *lm_crawler_create(const char *name, uint32_t nlen);
 void       lm_crawler_destroy(crawler_t *c);
 M_CODE     lm_crawler_add_filetype(crawler_t *cr, const char *name);
 M_CODE     lm_crawler_set_filetypes(crawler_t *cr, char **filetypes, int num_filetypes);
+M_CODE     lm_crawler_set_strip_params(crawler_t *cr, char **params, int num_params);
 void       lm_crawler_clear(crawler_t *c);
 M_CODE     lm_crawler_dup(crawler_t *dest, crawler_t *source);
 
@@ -111,6 +111,7 @@ lm_filetype_clear(filetype_t *ft)
 
     ft->switch_to.name = 0;
     ft->flags = 0;
+    ft->max_body_size = 0;
 }
 
 M_CODE
@@ -159,6 +160,7 @@ lm_filetype_dup(filetype_t *dest, filetype_t *source)
     }
     dest->handler = source->handler;
     dest->flags = source->flags;
+    dest->max_body_size = source->max_body_size;
 
     return M_OK;
 }
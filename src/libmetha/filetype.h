@@ -31,6 +31,7 @@
 #define FT_FLAG_HAS_PARSER    1
 #define FT_FLAG_HAS_HANDLER   2
 #define FT_FLAG_IGNORE_HOST   4
+#define FT_FLAG_STREAMING     8
 
 #define FT_FLAG_ISSET(ft, x) ((ft)->flags & (x))
 #define FT_ID_NULL ((FT_ID)-1)
@@ -94,6 +95,10 @@ typedef struct filetype {
         char        *name;
     } handler;
 
+    /* max size in bytes of a downloaded body, 0 means that
+     * the crawler's max_body_size is used */
+    unsigned int         max_body_size;
+
     /* counter for how many URLs that matches this filetype */
     volatile uint32_t    counter;
 #if HAVE_BUILTIN_ATOMIC == 0
@@ -0,0 +1,235 @@
+/*-
+ * fpset.c
+ * This file is part of libmetha
+ *
+ * Copyright (c) 2008, Emil Romanus <emil.romanus@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ * 
+ * http://bithack.se/projects/methabot/
+ */
+
+/**
+ * Set of 64-bit URL fingerprints, an alternative to the 
+ * mtrie for remembering which URLs of a host have been 
+ * seen, see the crawler option url_fingerprints.
+ *
+ * Only a hash of each URL is stored, in an open addressing
+ * table with linear probing that is kept between 3/8 and 
+ * 3/4 full. This costs 11 to 21 bytes per URL no matter 
+ * how long the URLs are, while the mtrie needs several 
+ * times that for the long unique paths typical of big 
+ * sites.
+ *
+ * The price is that two different URLs might get the same 
+ * fingerprint, the second one is then never crawled. With n
+ * URLs in the set, a new URL is mistaken for a seen one with
+ * a probability of about n/2^64, less than one in 10^12 for 
+ * a host with 10 million URLs.
+ *
+ * URLs are compared the way the mtrie compares them, case-
+ * insensitively and with the few other characters it folds,
+ * so that the strings of an mtrie can be turned into 
+ * fingerprints, see ue_retire().
+ *
+ * A set that will not grow any more can be turned into a 
+ * sorted array with lm_fpset_compact(), which takes 8 bytes
+ * per URL and is searched with lm_fpset_find_sorted().
+ **/
+
+#include <stdlib.h>
+
+#include "fpset.h"
+#include "mtrie.h"
+
+#define FPSET_INIT_SIZE 16
+
+static int lm_fpset_grow(fpset_t *s);
+static int lm_fpset_cmp(const void *a, const void *b);
+
+/** 
+ * 64-bit FNV-1a of the string as the mtrie stores it, see 
+ * MTRIE_FOLD(), followed by the MurmurHash3 finalizer so 
+ * that the low bits can be used as the table index directly.
+ * Never returns 0.
+ **/
+uint64_t
+lm_fpset_hash(const char *s, size_t len)
+{
+    const char *e = s+len;
+    uint64_t    h = 0xcbf29ce484222325ULL;
+
+    for (; s<e; s++) {
+        h ^= (uint8_t)MTRIE_FOLD(*s);
+        h *= 0x100000001b3ULL;
+    }
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+
+    return h ? h : 1;
+}
+
+/** 
+ * Add a URL to the set. Like mtrie_tryadd(), returns 1 if 
+ * the URL was added and 0 if it was there already, or if 
+ * we ran out of memory.
+ **/
+int
+lm_fpset_tryadd(fpset_t *s, url_t *url)
+{
+    return lm_fpset_tryadd_hash(s, lm_fpset_hash(url->str+url->host_o,
+                                                 url->sz-url->host_o));
+}
+
+/** 
+ * Add a fingerprint already computed by lm_fpset_hash()
+ **/
+int
+lm_fpset_tryadd_hash(fpset_t *s, uint64_t fp)
+{
+    uint32_t x;
+
+    if ((s->count+1)*4 > (s->slots ? (s->mask+1)*3 : 0)
+            && !lm_fpset_grow(s))
+        return 0;
+
+    for (x = fp & s->mask; s->slots[x]; x = (x+1) & s->mask) {
+        if (s->slots[x] == fp)
+            return 0;
+    }
+
+    s->slots[x] = fp;
+    s->count ++;
+
+    return 1;
+}
+
+/** 
+ * Double the size of the table, returns 0 if out of memory
+ **/
+static int
+lm_fpset_grow(fpset_t *s)
+{
+    uint64_t *slots;
+    uint32_t  size, mask, x, y;
+
+    size = s->slots ? (s->mask+1)*2 : FPSET_INIT_SIZE;
+    mask = size-1;
+
+    if (!(slots = calloc(size, sizeof(uint64_t))))
+        return 0;
+
+    if (s->slots) {
+        for (x=0; x<=s->mask; x++) {
+            if (!s->slots[x])
+                continue;
+            for (y = s->slots[x] & mask; slots[y]; y = (y+1) & mask)
+                ;
+            slots[y] = s->slots[x];
+        }
+        free(s->slots);
+    }
+
+    s->slots = slots;
+    s->mask  = mask;
+
+    return 1;
+}
+
+void
+lm_fpset_uninit(fpset_t *s)
+{
+    free(s->slots);
+    s->slots = 0;
+    s->mask  = 0;
+    s->count = 0;
+}
+
+static int
+lm_fpset_cmp(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Sort an array of n fingerprints and remove duplicates, 
+ * returns the number left
+ **/
+uint32_t
+lm_fpset_sort(uint64_t *a, uint32_t n)
+{
+    uint32_t x, y;
+
+    if (n < 2)
+        return n;
+
+    qsort(a, n, sizeof(uint64_t), &lm_fpset_cmp);
+    for (x=1, y=1; x<n; x++)
+        if (a[x] != a[y-1])
+            a[y++] = a[x];
+
+    return y;
+}
+
+/**
+ * Look for a fingerprint in an array sorted by 
+ * lm_fpset_sort(), returns 1 if it is there
+ **/
+int
+lm_fpset_find_sorted(const uint64_t *a, uint32_t n, uint64_t fp)
+{
+    uint32_t lo = 0, hi = n, mid;
+
+    while (lo < hi) {
+        mid = lo+(hi-lo)/2;
+        if (a[mid] < fp)
+            lo = mid+1;
+        else if (a[mid] > fp)
+            hi = mid;
+        else
+            return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Move the fingerprints of the set to a sorted array of 
+ * their own and empty the set. The array is malloc()'d and
+ * *n is set to its length. Returns 0 if the set is empty 
+ * or if we ran out of memory, the set is then left as it 
+ * was.
+ **/
+uint64_t *
+lm_fpset_compact(fpset_t *s, uint32_t *n)
+{
+    uint64_t *a;
+    uint32_t  x, y;
+
+    if (!s->count || !(a = malloc((size_t)s->count*sizeof(uint64_t))))
+        return 0;
+
+    for (x=0, y=0; x<=s->mask; x++)
+        if (s->slots[x])
+            a[y++] = s->slots[x];
+
+    *n = lm_fpset_sort(a, y);
+    lm_fpset_uninit(s);
+
+    return a;
+}
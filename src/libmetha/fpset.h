@@ -0,0 +1,46 @@
+/*-
+ * fpset.h
+ * This file is part of libmetha
+ *
+ * Copyright (c) 2008, Emil Romanus <emil.romanus@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ * 
+ * http://bithack.se/projects/methabot/
+ */
+
+/* see comments in fpset.c */
+
+#ifndef _FPSET__H_
+#define _FPSET__H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "url.h"
+
+typedef struct fpset {
+    uint64_t *slots; /* 0 marks an empty slot */
+    uint32_t  mask;  /* number of slots - 1 */
+    uint32_t  count;
+} fpset_t;
+
+uint64_t lm_fpset_hash(const char *s, size_t len);
+int      lm_fpset_tryadd(fpset_t *s, url_t *url);
+int      lm_fpset_tryadd_hash(fpset_t *s, uint64_t fp);
+void     lm_fpset_uninit(fpset_t *s);
+uint32_t lm_fpset_sort(uint64_t *a, uint32_t n);
+int      lm_fpset_find_sorted(const uint64_t *a, uint32_t n, uint64_t fp);
+uint64_t *lm_fpset_compact(fpset_t *s, uint32_t *n);
+
+#endif
@@ -144,7 +144,10 @@ lm_ftindex_match_by_url(ftindex_t *i, url_t *url)
     int x;
     filetype_t *ft;
 
-    if (url->protocol == LM_PROTOCOL_FTP) {
+    /* local directories are listed like FTP directories, 
+     * see lm_io_file_list() */
+    if (LM_PROTOCOL_IS_FTP(url->protocol)
+            || url->protocol == LM_PROTOCOL_FILE) {
         if (url->file_o == url->sz-1) {
             if (i->flags & LM_FTIFLAG_BIND_FTP_DIR_URL)
                 return (filetype_t*)i->ftp_dir_url;
@@ -46,8 +46,12 @@ typedef struct curie_prefix {
 typedef struct info {
     curie_prefix_t *curies;
     int         num_curies;
+    int         own; /* curies are copies and not pointers into the buffer,
+                        set when streaming since the buffer is reused */
 } info_t;
 
+static char *html_scan(uehandle_t *ue_h, info_t *info, char *p, char *e, int eof);
+static void html_info_cleanup(info_t *info);
 static void parse_textarea(uehandle_t *ue_h, char *p, size_t sz);
 static void parse_script(uehandle_t *ue_h, char *p, size_t sz);
 static inline int parse_tag(uehandle_t *ue_h, info_t *info, char *p, size_t sz);
@@ -103,17 +107,85 @@ lm_parser_html(struct worker *w, struct iobuf *buf,
                struct uehandle *ue_h, struct url *url,
                struct attr_list *al)
 {
-    int ret;
-    char *p   = buf->ptr,
-         *e   = buf->ptr+buf->sz,
-         *tb  = 0,
-         *te  = 0,
-         q, *s;
-    int type;
     info_t info;
 
     info.curies = 0;
     info.num_curies = 0;
+    info.own = 0;
+
+    html_scan(ue_h, &info, buf->ptr, buf->ptr+buf->sz, 1);
+    ue_add_flush(ue_h);
+
+    /* set the attribute 'html' if the
+     * target filetype has it */
+    lm_attribute_set(al, "html", buf->ptr, buf->sz);
+
+    html_info_cleanup(&info);
+
+    return M_OK;
+}
+
+/** 
+ * Streaming version of the default HTML parser, see 
+ * iostream_t in io.h. Links are extracted while the 
+ * page is being downloaded. Since the data is not kept,
+ * the 'html' attribute is never set.
+ **/
+size_t
+lm_parser_html_stream(struct iostream *st, char *p,
+                      size_t sz, int eof)
+{
+    worker_t *w = (worker_t*)st->data;
+    info_t   *info;
+    char     *e;
+
+    if (!(info = st->state)) {
+        if (!(info = st->state = calloc(1, sizeof(info_t))))
+            return sz;
+        info->own = 1;
+    }
+
+    e = html_scan(w->ue_h, info, p, p+sz, eof);
+    /* links point into this chunk, add them before it is reused */
+    ue_add_flush(w->ue_h);
+
+    if (eof) {
+        html_info_cleanup(info);
+        free(info);
+        st->state = 0;
+        return sz;
+    }
+
+    return e-p;
+}
+
+static void
+html_info_cleanup(info_t *info)
+{
+    int x;
+
+    if (info->own)
+        for (x=0; x<info->num_curies; x++)
+            free(info->curies[x].prefix);
+    if (info->num_curies)
+        free(info->curies);
+}
+
+/** 
+ * Extract URLs from the HTML between p and e. If 'eof' is 0,
+ * more data will follow, and the scan stops at a tag or
+ * element that is cut off at e. A pointer to where the scan 
+ * stopped is returned, the caller should give the data 
+ * from there on again together with the following data.
+ **/
+static char *
+html_scan(uehandle_t *ue_h, info_t *info,
+          char *p, char *e, int eof)
+{
+    char *tb  = 0,
+         *te  = 0,
+         q, *s;
+    int type;
 
     for (;p<e;p++) {
         tb = e;
@@ -147,15 +219,20 @@ lm_parser_html(struct worker *w, struct iobuf *buf,
                         break;
                     }
                 }
+                if (s >= e && !eof)
+                    return tb; /* the tag continues in the next chunk */
             }
             p++;
             /* TODO: extract plain text links */
         } while (p<tb);
-        if ((type = parse_tag(ue_h, &info, tb, te-tb)) != -1) {
+        if (tb < e && te > tb
+                && (type = parse_tag(ue_h, info, tb, te-tb)) != -1) {
             do {
                 if ((p = memchr(p, '<', e-p))) {
                     if (*(p+1) == '/') {
                         if (e-p < 8) {
+                            if (!eof)
+                                return tb;
                             p=e;
                             break;
                         }
@@ -169,6 +246,8 @@ lm_parser_html(struct worker *w, struct iobuf *buf,
                     } else
                         p++;
                 } else {
+                    if (!eof)
+                        return tb; /* wait for the end of the element */
                     p=e; /* break out of outer loop */
                     break;
                 }
@@ -176,14 +255,7 @@ lm_parser_html(struct worker *w, struct iobuf *buf,
         }
     }
 
-    /* set the attribute 'html' if the
-     * target filetype has it */
-    lm_attribute_set(al, "html", buf->ptr, buf->sz);
-
-    if (info.num_curies)
-        free(info.curies);
-
-    return ret;
+    return e;
 }
 
 /** 
@@ -299,7 +371,15 @@ parse_tag(uehandle_t *h, info_t *i,
                 if (!(i->curies = realloc(i->curies,
                         (i->num_curies+1)*sizeof(curie_prefix_t))))
                     return -1;
-                i->curies[i->num_curies].prefix = attr+6;
+                char *prefix = attr+6;
+                if (i->own) {
+                    if (!(prefix = malloc(attr_len-6+val_len+1)))
+                        return -1;
+                    memcpy(prefix, attr+6, attr_len-6);
+                    memcpy(prefix+attr_len-6, val, val_len);
+                    val = prefix+attr_len-6;
+                }
+                i->curies[i->num_curies].prefix = prefix;
                 i->curies[i->num_curies].prefix_len = attr_len-6;
                 i->curies[i->num_curies].url = val;
                 i->curies[i->num_curies].url_len = val_len;
@@ -331,7 +411,7 @@ parse_tag(uehandle_t *h, info_t *i,
                         }
                     }
                 } else if (*val != '#') /* skip references to anchors */
-                    ue_add(h, val, val_len);
+                    ue_add_deferred(h, val, val_len);
                 return -1; /* should we really return here? pretty sure
                               no one would put more than one href attribute 
                               in a tag */
@@ -733,7 +813,8 @@ restart:
     *(np++) = '\0';
 
     free(est);
-    free(buf->ptr);
+    if (buf->cap) /* not a mapped file */
+        free(buf->ptr);
 
     buf->ptr = n;
     buf->cap = n_cap;
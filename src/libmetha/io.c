@@ -23,44 +23,96 @@
 #include <string.h>
 #include <pthread.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <stdint.h>
 #include <errno.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "metha.h"
 #include "default.h"
 
 #define BUF_INIT_SIZE 1024
+#define BUF_KEEP_SIZE (64*1024) /* larger buffers are given back after use */
+#define BUF_PREALLOC_MAX (16*1024*1024) /* max to preallocate from Content-Length */
 #define QUEUE_INIT_SIZE 8
+#define POOL_INIT_SIZE 16
+#define RING_SIZE_THREAD 1024 /* pending transfers per IO-thread */
+#define RING_SIZE_HANDLE 256  /* finished transfers per iohandle */
+#define EPOLL_EVENTS 128      /* socket events handled per epoll_wait() */
 #define LM_IO_MAX_RETRIES 3
 
+/* whether a transfer that failed with c should be tried again. 
+ * With timeouts set from the host's health, a host that timed 
+ * out or could not be resolved is not asked again at once, 
+ * ue_host_check() decides when it is tried next */
+#define LM_IO_RETRY(h, c, retries) \
+    ((retries) < LM_IO_MAX_RETRIES \
+     && !((h)->timeout && ((c) == CURLE_OPERATION_TIMEDOUT \
+                           || (c) == CURLE_COULDNT_RESOLVE_HOST)))
+
 #ifdef WIN32
  #include <windows.h>
- #define sec_sleep(x) Sleep(x*1000)
 #else
  #include <unistd.h>
- #define sec_sleep(x) sleep(x)
 #endif
 
-static void *lm_iothr_main(io_t *io);
+static void  lm_io_set_timeouts(iohandle_t *h);
+static void  lm_io_set_ttfb(iohandle_t *h);
+static void *lm_iothr_main(iothr_t *t);
 static int   lm_iothr_socket_cb(CURL *h, curl_socket_t s, int action, void *userp, void *socketp);
-static int   lm_iothr_set_timer_cb(CURLM *m, long timeout, io_t *io);
-static void  lm_iothr_check_completed(io_t *io);
+static int   lm_iothr_set_timer_cb(CURLM *m, long timeout, iothr_t *t);
+static void  lm_iothr_check_completed(iothr_t *t);
 static size_t lm_iothr_data_cb(void *ptr, size_t size, size_t nmemb, void *s);
-static M_CODE lm_iothr_check_pending(io_t *io);
-static void  lm_iothr_wait(io_t *io, int mp);
+static M_CODE lm_iothr_check_pending(iothr_t *t);
+static M_CODE lm_iothr_init(iothr_t *t, io_t *io);
+static void   lm_iothr_uninit(iothr_t *t);
 static M_CODE lm_io_perform_http(iohandle_t *h, url_t *url);
 static M_CODE lm_io_perform_ftp(iohandle_t *h, url_t *url);
+static M_CODE lm_io_perform_file(iohandle_t *h, url_t *url);
 static M_CODE lm_io_no_perform(iohandle_t *h, url_t *url);
+static int    lm_io_file_path(url_t *url, char *out);
+static M_CODE lm_io_file_read(iohandle_t *h, url_t *url, int fd, size_t sz);
+static M_CODE lm_io_file_map(iohandle_t *h, url_t *url, int fd, size_t sz);
+static M_CODE lm_io_file_list(iohandle_t *h, url_t *url, const char *path);
+static size_t lm_io_file_escape(char *out, const char *s, size_t len);
+static void   lm_io_unmap(iohandle_t *h);
+static void   lm_io_http_info(iohandle_t *h, CURL *c);
+static void   lm_io_setup_handle(io_t *io, CURL *h);
+static M_CODE lm_io_enqueue(iothr_t *t, ioprivate_t *info);
+static void   lm_iothr_finish(ioprivate_t *info);
+static int    lm_iohandle_drain(iohandle_t *ioh, int type);
+static int    lm_iohandle_wait(iohandle_t *ioh, int type, int block);
+static M_CODE lm_io_notify(iothr_t *t);
+static iothr_t *lm_io_shard(io_t *io, url_t *url);
+static M_CODE lm_io_collect(iohandle_t *h, url_t *url);
+static iopipe_t *lm_io_find_slot(iohandle_t *h, url_t *url);
+static size_t lm_io_stream_cb(char *ptr, size_t size, size_t nmemb, void *s);
+static M_CODE lm_iohandle_init_pipeline(iohandle_t *ioh, int num);
+static int    lm_multiget_wait(iohandle_t *ioh, int block);
+static ioprivate_t *lm_io_pool_get(io_t *io);
+static size_t lm_io_sink_cb(char *ptr, size_t size, size_t nmemb, void *s);
+static size_t lm_io_sink_write(iosink_t *s, char *ptr, size_t sz, int prealloc);
+static void   lm_io_sink_reset(iosink_t *s, size_t max);
+static int    lm_io_buf_class(size_t cap);
+static char  *lm_io_buf_acquire(io_t *io, size_t need, size_t *cap);
+static void   lm_io_buf_release(io_t *io, char *p, size_t cap);
+static int    lm_io_buf_reserve(io_t *io, iobuf_t *b, size_t need);
 
 static void lm_iothr_lock_shared_cb(CURL *h, curl_lock_data data, curl_lock_access access, void *ptr);
 static void lm_iothr_unlock_shared_cb(CURL *h, curl_lock_data data, void *ptr);
 
 /* keep in sync with LM_PROTOCOL_* in url.h */
 static M_CODE (*__perform[])(iohandle_t *, url_t *) = {
-    &lm_io_perform_http,
-    &lm_io_perform_ftp,
-    &lm_io_no_perform,
-    &lm_io_no_perform,
-    &lm_io_no_perform,
+    &lm_io_perform_http, /* http */
+    &lm_io_perform_ftp,  /* ftp */
+    &lm_io_perform_file, /* file */
+    &lm_io_perform_http, /* https */
+    &lm_io_perform_ftp,  /* ftps */
     &lm_io_no_perform,
 };
 
@@ -71,78 +123,165 @@ static M_CODE (*__perform[])(iohandle_t *, url_t *) = {
 M_CODE
 lm_init_io(io_t *io, metha_t *m)
 {
+    int    x;
+    M_CODE r;
+
     io->m = m;
 #ifdef WIN32
     io->synchronous = 1;
 #endif
 
+    /* the buffer pool is used in synchronous mode too */
+    pthread_mutex_init(&io->bufpool_mtx, 0);
+
     if (io->synchronous)
         return M_OK;
 
-    if (!(io->multi_h = curl_multi_init())) {
-        LM_ERROR(m, "could not create CURL multi interface");
-        return M_FAILED;
-    }
     if (!(io->share_h = curl_share_init())) {
         LM_ERROR(m, "could not create CURL share interface");
         return M_ERROR;
     }
 
-    if (pipe(io->msg_fd) != 0) {
-        LM_ERROR(m, "pipe() failed: %s", strerror(errno));
-        return M_FAILED;
-    }
-
-    if (!(io->queue.pos = malloc(QUEUE_INIT_SIZE*sizeof(ioqp_t))))
+    if (!(io->pool.list = malloc(POOL_INIT_SIZE*sizeof(ioprivate_t*))))
         return M_OUT_OF_MEM;
 
-    io->queue.allocsz = QUEUE_INIT_SIZE;
-    io->queue.size = 0;
+    io->pool.allocsz = POOL_INIT_SIZE;
+    io->pool.size = 0;
 
     io->started = 0;
 
-    pthread_mutex_init(&io->queue_mtx, 0);
+    pthread_mutex_init(&io->pool_mtx, 0);
     pthread_rwlock_init(&io->cookies_mtx, 0);
     pthread_rwlock_init(&io->dns_mtx, 0);
+    pthread_rwlock_init(&io->ssl_mtx, 0);
+    pthread_rwlock_init(&io->connect_mtx, 0);
     pthread_rwlock_init(&io->share_mtx, 0);
 
     if (io->cookies)
         curl_share_setopt(io->share_h, CURLSHOPT_SHARE, CURL_LOCK_DATA_COOKIE);
     curl_share_setopt(io->share_h, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    /* resume TLS sessions across workers and IO-threads, so 
+     * that only the first connection to a host needs a full 
+     * handshake */
+    curl_share_setopt(io->share_h, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900
+    /* keep-alive connections, including their TLS state, can
+     * be picked up by any handle */
+    curl_share_setopt(io->share_h, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
     curl_share_setopt(io->share_h, CURLSHOPT_LOCKFUNC, &lm_iothr_lock_shared_cb);
     curl_share_setopt(io->share_h, CURLSHOPT_UNLOCKFUNC, &lm_iothr_unlock_shared_cb);
     curl_share_setopt(io->share_h, CURLSHOPT_USERDATA, io);
 
-    curl_multi_setopt(io->multi_h, CURLMOPT_SOCKETFUNCTION, &lm_iothr_socket_cb);
-    curl_multi_setopt(io->multi_h, CURLMOPT_SOCKETDATA, io);
-    curl_multi_setopt(io->multi_h, CURLMOPT_TIMERFUNCTION, &lm_iothr_set_timer_cb);
-    curl_multi_setopt(io->multi_h, CURLMOPT_TIMERDATA, io);
-    /*curl_multi_setopt(io->multi_h, CURLMOPT_PIPELINING, 1);*/
+    if (io->num_threads < 1)
+        io->num_threads = 1;
+    if (!(io->threads = calloc(io->num_threads, sizeof(iothr_t))))
+        return M_OUT_OF_MEM;
+
+    for (x=0; x<io->num_threads; x++)
+        if ((r = lm_iothr_init(&io->threads[x], io)) != M_OK)
+            return r;
+
+    return M_OK;
+}
+
+/** 
+ * Set up the multi handle, message pipe and pending queue 
+ * of one IO-thread
+ **/
+static M_CODE
+lm_iothr_init(iothr_t *t, io_t *io)
+{
+    t->io = io;
+    t->ev_fd = -1;
+    pthread_mutex_init(&t->queue_mtx, 0);
+
+    if (!(t->multi_h = curl_multi_init())) {
+        LM_ERROR(io->m, "could not create CURL multi interface");
+        return M_FAILED;
+    }
+
+    if ((t->ev_fd = eventfd(0, 0)) < 0) {
+        LM_ERROR(io->m, "eventfd() failed: %s", strerror(errno));
+        return M_FAILED;
+    }
+
+    if (lm_ring_init(&t->ring, RING_SIZE_THREAD) != M_OK)
+        return M_OUT_OF_MEM;
+
+    if (!(t->queue.pos = malloc(QUEUE_INIT_SIZE*sizeof(ioprivate_t*))))
+        return M_OUT_OF_MEM;
+
+    t->queue.allocsz = QUEUE_INIT_SIZE;
+    t->queue.size = 0;
+
+    curl_multi_setopt(t->multi_h, CURLMOPT_SOCKETFUNCTION, &lm_iothr_socket_cb);
+    curl_multi_setopt(t->multi_h, CURLMOPT_SOCKETDATA, t);
+    curl_multi_setopt(t->multi_h, CURLMOPT_TIMERFUNCTION, &lm_iothr_set_timer_cb);
+    curl_multi_setopt(t->multi_h, CURLMOPT_TIMERDATA, t);
+    /*curl_multi_setopt(t->multi_h, CURLMOPT_PIPELINING, 1);*/
 
     return M_OK;
 }
 
+/** 
+ * Clean up after lm_iothr_init(), the thread must not 
+ * be running
+ **/
+static void
+lm_iothr_uninit(iothr_t *t)
+{
+    if (!t->io)
+        return;
+
+    if (t->multi_h)
+        curl_multi_cleanup(t->multi_h);
+    if (t->queue.pos)
+        free(t->queue.pos);
+    lm_ring_uninit(&t->ring);
+
+    pthread_mutex_destroy(&t->queue_mtx);
+
+    if (t->ev_fd >= 0)
+        close(t->ev_fd);
+}
+
 /** 
  * clean up input/output module
  **/
 void
 lm_uninit_io(io_t *io)
 {
+    int x, y;
+
+    for (x=0; x<LM_IO_POOL_CLASSES; x++)
+        for (y=0; y<io->bufpool[x].count; y++)
+            free(io->bufpool[x].ptr[y]);
+    pthread_mutex_destroy(&io->bufpool_mtx);
+
     if (!io->synchronous) {
-        if (io->multi_h)
-            curl_multi_cleanup(io->multi_h);
+        if (io->pool.list) {
+            for (x=0; x<io->pool.size; x++) {
+                curl_easy_cleanup(io->pool.list[x]->handle);
+                free(io->pool.list[x]);
+            }
+            free(io->pool.list);
+        }
+        if (io->threads) {
+            /* the easy handles must go before the multi handles */
+            for (x=0; x<io->num_threads; x++)
+                lm_iothr_uninit(&io->threads[x]);
+            free(io->threads);
+        }
         if (io->share_h)
             curl_share_cleanup(io->share_h);
-        if (io->queue.pos)
-            free(io->queue.pos);
 
-        pthread_mutex_destroy(&io->queue_mtx);
+        pthread_mutex_destroy(&io->pool_mtx);
         pthread_rwlock_destroy(&io->cookies_mtx);
         pthread_rwlock_destroy(&io->dns_mtx);
+        pthread_rwlock_destroy(&io->ssl_mtx);
+        pthread_rwlock_destroy(&io->connect_mtx);
         pthread_rwlock_destroy(&io->share_mtx);
-
-        close(io->msg_fd[0]);
-        close(io->msg_fd[1]);
     }
 }
 
@@ -174,46 +313,132 @@ lm_iohandle_obtain(io_t *io)
                 return 0;
             ioh->done.allocsz = 24;
 
-            pthread_mutex_init(&ioh->dcond_mtx, 0);
-            pthread_cond_init(&ioh->dcond, 0);
+            if (lm_ring_init(&ioh->ring, RING_SIZE_HANDLE) != M_OK)
+                return 0;
+            if ((ioh->ev_fd = eventfd(0, 0)) < 0)
+                return 0;
+            pthread_mutex_init(&ioh->overflow_mtx, 0);
 
-            curl_easy_setopt(ioh->primary, CURLOPT_SHARE, io->share_h);
             curl_easy_setopt(ioh->primary, CURLOPT_WRITEFUNCTION, (curl_write_callback)&lm_io_data_cb);
         }
 
-        if (io->proxy)
-            curl_easy_setopt(ioh->primary, CURLOPT_PROXY, io->proxy);
-        if (io->verbose)
-            curl_easy_setopt(ioh->primary, CURLOPT_VERBOSE, 1);
-        if (io->cookies)
-            curl_easy_setopt(ioh->primary, CURLOPT_COOKIEFILE, "");
-
-        curl_easy_setopt(ioh->primary, CURLOPT_USERAGENT, io->user_agent);
-        curl_easy_setopt(ioh->primary, CURLOPT_ENCODING, "");
+        lm_io_setup_handle(io, ioh->primary);
 
         if (!(ioh->buf.ptr = malloc(BUF_INIT_SIZE)))
             return 0;
         ioh->buf.cap = BUF_INIT_SIZE;
 
+        ioh->sink.buf = &ioh->buf;
+        ioh->sink.h   = ioh->primary;
+        ioh->sink.io  = io;
+
         ioh->transfer.headers.content_type = "";
+
+        if (!io->synchronous && io->num_pipelines > 1
+                && lm_iohandle_init_pipeline(ioh, io->num_pipelines) != M_OK)
+            return 0;
     }
     return ioh;
 }
 
+/** 
+ * Set the options common to all transfer handles 
+ * derived from the given io object
+ **/
+static void
+lm_io_setup_handle(io_t *io, CURL *h)
+{
+    if (!io->synchronous)
+        curl_easy_setopt(h, CURLOPT_SHARE, io->share_h);
+    if (io->proxy)
+        curl_easy_setopt(h, CURLOPT_PROXY, io->proxy);
+    if (io->verbose)
+        curl_easy_setopt(h, CURLOPT_VERBOSE, 1);
+    if (io->cookies)
+        curl_easy_setopt(h, CURLOPT_COOKIEFILE, "");
+
+    curl_easy_setopt(h, CURLOPT_USERAGENT, io->user_agent);
+    curl_easy_setopt(h, CURLOPT_ENCODING, "");
+}
+
+/** 
+ * Set up 'num' pipeline slots for the given iohandle. Each 
+ * slot gets its own CURL handle and buffer, so that the 
+ * IO-thread can download pages for the worker while the 
+ * worker is busy parsing, see lm_multiget_add()
+ **/
+static M_CODE
+lm_iohandle_init_pipeline(iohandle_t *ioh, int num)
+{
+    iopipe_t *p;
+    int       x;
+
+    if (!(ioh->pipeline.slots = calloc(num, sizeof(iopipe_t))))
+        return M_OUT_OF_MEM;
+
+    ioh->pipeline.count = num;
+
+    for (x=0; x<num; x++) {
+        p = &ioh->pipeline.slots[x];
+        if (!(p->h = curl_easy_init()))
+            return M_FAILED;
+        if (!(p->buf.ptr = malloc(BUF_INIT_SIZE)))
+            return M_OUT_OF_MEM;
+        p->buf.cap = BUF_INIT_SIZE;
+        p->sink.buf = &p->buf;
+        p->sink.h   = p->h;
+        p->sink.io  = ioh->io;
+        p->info.identifier = x;
+        p->info.type = LM_IOPRIV_GET;
+        p->info.handle = p->h;
+
+        lm_io_setup_handle(ioh->io, p->h);
+        curl_easy_setopt(p->h, CURLOPT_PRIVATE, &p->info);
+        curl_easy_setopt(p->h, CURLOPT_WRITEFUNCTION, &lm_io_sink_cb);
+        curl_easy_setopt(p->h, CURLOPT_WRITEDATA, &p->sink);
+#if LIBCURL_VERSION_NUM < 0x71202
+        curl_easy_setopt(p->h, CURLOPT_FOLLOWLOCATION, 1);
+#endif
+    }
+
+    return M_OK;
+}
+
 /** 
  * Destroy the given iohandle and free its member blah
  **/
 void
 lm_iohandle_destroy(iohandle_t *ioh)
 {
+    int x;
+
+    if (ioh->pipeline.count) {
+        /* the IO-thread might still be using our slots */
+        while (lm_multiget_wait(ioh, 1))
+            ;
+        for (x=0; x<ioh->pipeline.count; x++) {
+            if (ioh->pipeline.slots[x].h)
+                curl_easy_cleanup(ioh->pipeline.slots[x].h);
+            if (ioh->pipeline.slots[x].buf.ptr)
+                free(ioh->pipeline.slots[x].buf.ptr);
+            if (ioh->pipeline.slots[x].url)
+                free(ioh->pipeline.slots[x].url);
+        }
+        free(ioh->pipeline.slots);
+    }
+
     if (!ioh->io->synchronous) {
-        pthread_mutex_destroy(&ioh->dcond_mtx);
-        pthread_cond_destroy(&ioh->dcond);
+        pthread_mutex_destroy(&ioh->overflow_mtx);
+        lm_ring_uninit(&ioh->ring);
+        close(ioh->ev_fd);
 
+        if (ioh->overflow.list)
+            free(ioh->overflow.list);
         if (ioh->done.list)
             free(ioh->done.list);
     }
 
+    lm_io_unmap(ioh);
     if (ioh->buf.ptr)
         free(ioh->buf.ptr);
 
@@ -240,6 +465,10 @@ lm_iothr_lock_shared_cb(CURL *h,
         case CURL_LOCK_DATA_SHARE:    m = &io->share_mtx; break;
         case CURL_LOCK_DATA_DNS:      m = &io->dns_mtx; break;
         case CURL_LOCK_DATA_COOKIE:   m = &io->cookies_mtx; break;
+        case CURL_LOCK_DATA_SSL_SESSION: m = &io->ssl_mtx; break;
+#if LIBCURL_VERSION_NUM >= 0x073900
+        case CURL_LOCK_DATA_CONNECT:  m = &io->connect_mtx; break;
+#endif
         default:                      LM_WARNING(io->m, "something borked! :("); return;
     }
 
@@ -266,6 +495,10 @@ lm_iothr_unlock_shared_cb(CURL *h,
         case CURL_LOCK_DATA_SHARE:    pthread_rwlock_unlock(&io->share_mtx); return;
         case CURL_LOCK_DATA_DNS:      pthread_rwlock_unlock(&io->dns_mtx); return;
         case CURL_LOCK_DATA_COOKIE:   pthread_rwlock_unlock(&io->cookies_mtx); return;
+        case CURL_LOCK_DATA_SSL_SESSION: pthread_rwlock_unlock(&io->ssl_mtx); return;
+#if LIBCURL_VERSION_NUM >= 0x073900
+        case CURL_LOCK_DATA_CONNECT:  pthread_rwlock_unlock(&io->connect_mtx); return;
+#endif
         default:                      LM_WARNING(io->m, "something borked! :("); return;
     }
 
@@ -282,10 +515,11 @@ lm_io_data_cb(char *ptr, size_t size,
     iobuf_t *b = (iobuf_t*)s;
     size_t  sz = nmemb*size;
 
-    if (b->sz+sz > b->cap) {
+    /* always leave room for a terminating '\0' */
+    if (b->sz+sz >= b->cap) {
         do {
             b->cap *= 2;
-        } while (b->cap < b->sz+sz);
+        } while (b->cap <= b->sz+sz);
 
         if (!(b->ptr = realloc(b->ptr, b->cap)))
             return !sz;
@@ -296,6 +530,238 @@ lm_io_data_cb(char *ptr, size_t size,
 
     return sz;
 }
+
+/** 
+ * Used by transfers into an iosink_t, such as the PRIMARY 
+ * transfer handle of an iohandle_t and the GET pipeline
+ **/
+static size_t
+lm_io_sink_cb(char *ptr, size_t size, size_t nmemb, void *s)
+{
+    return lm_io_sink_write((iosink_t*)s, ptr, size*nmemb, 1);
+}
+
+/** 
+ * Prepare a sink for a new transfer
+ **/
+static void
+lm_io_sink_reset(iosink_t *s, size_t max)
+{
+    s->buf->sz = 0;
+    s->buf->ptr[0] = '\0';
+    s->max = max;
+    s->received = 0;
+    s->too_big = 0;
+    s->rejected = 0;
+}
+
+/** 
+ * Append data to the buffer of a sink. The transfer is aborted
+ * by returning 0 if the body grows beyond the sink's max size,
+ * or if the Content-Length says it will. If 'prealloc' is set,
+ * the buffer is sized from the Content-Length on the first
+ * write, instead of growing in steps.
+ **/
+static size_t
+lm_io_sink_write(iosink_t *s, char *ptr, size_t sz, int prealloc)
+{
+    iobuf_t *b = s->buf;
+#if LIBCURL_VERSION_NUM >= 0x073700
+    curl_off_t len;
+#else
+    double   len;
+#endif
+    long     status;
+    char    *type;
+
+    if (!s->received && s->accept
+            && curl_easy_getinfo(s->h, CURLINFO_RESPONSE_CODE, &status) == CURLE_OK
+            && status >= 200 && status < 300) {
+        if (curl_easy_getinfo(s->h, CURLINFO_CONTENT_TYPE, &type) != CURLE_OK)
+            type = 0;
+        if (!s->accept(s, type ? type : "")) {
+            s->rejected = 1;
+            return 0;
+        }
+    }
+
+    if (!s->received
+#if LIBCURL_VERSION_NUM >= 0x073700
+            && curl_easy_getinfo(s->h, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &len) == CURLE_OK
+#else
+            && curl_easy_getinfo(s->h, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &len) == CURLE_OK
+#endif
+            && len > 0) {
+        if (s->max && len > s->max) {
+            s->too_big = 1;
+            return 0;
+        }
+        if (prealloc && len < BUF_PREALLOC_MAX
+                && !lm_io_buf_reserve(s->io, b, (size_t)len+1))
+            return 0;
+    }
+
+    s->received += sz;
+    if (s->max && s->received > s->max) {
+        s->too_big = 1;
+        return 0;
+    }
+
+    if (!lm_io_buf_reserve(s->io, b, b->sz+sz+1))
+        return 0;
+
+    memcpy(b->ptr+b->sz, ptr, sz);
+    b->sz += sz;
+    b->ptr[b->sz] = '\0';
+
+    return sz;
+}
+
+/** 
+ * Size class of a buffer with the given capacity, a buffer 
+ * in class n has a capacity of at least BUF_INIT_SIZE<<n. 
+ * Returns -1 if the buffer is smaller than BUF_INIT_SIZE.
+ **/
+static int
+lm_io_buf_class(size_t cap)
+{
+    int n = -1;
+
+    while (cap >= BUF_INIT_SIZE) {
+        cap >>= 1;
+        n++;
+    }
+
+    return n;
+}
+
+/** 
+ * Get a buffer with room for at least 'need' bytes from the 
+ * buffer pool, or allocate a new one. The capacity of the 
+ * returned buffer is stored in 'cap'.
+ **/
+static char *
+lm_io_buf_acquire(io_t *io, size_t need, size_t *cap)
+{
+    char  *p  = 0;
+    size_t sz = BUF_INIT_SIZE;
+    int    c, x, n;
+
+    while (sz < need)
+        sz <<= 1;
+
+    if ((c = lm_io_buf_class(sz)) < LM_IO_POOL_CLASSES) {
+        pthread_mutex_lock(&io->bufpool_mtx);
+        /* try the matching class and the one above it */
+        for (x=c; x<c+2 && x<LM_IO_POOL_CLASSES; x++) {
+            if ((n = io->bufpool[x].count)) {
+                p    = io->bufpool[x].ptr[n-1];
+                *cap = io->bufpool[x].cap[n-1];
+                io->bufpool[x].count--;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&io->bufpool_mtx);
+    }
+
+    if (!p && (p = malloc(sz)))
+        *cap = sz;
+
+    return p;
+}
+
+/** 
+ * Give a buffer back to the buffer pool. It is freed if its
+ * size class is full or if it is too large to be kept.
+ **/
+static void
+lm_io_buf_release(io_t *io, char *p, size_t cap)
+{
+    int c, n;
+
+    if ((c = lm_io_buf_class(cap)) >= 0 && c < LM_IO_POOL_CLASSES) {
+        pthread_mutex_lock(&io->bufpool_mtx);
+        if ((n = io->bufpool[c].count) < LM_IO_POOL_DEPTH) {
+            io->bufpool[c].ptr[n] = p;
+            io->bufpool[c].cap[n] = cap;
+            io->bufpool[c].count++;
+            pthread_mutex_unlock(&io->bufpool_mtx);
+            return;
+        }
+        pthread_mutex_unlock(&io->bufpool_mtx);
+    }
+
+    free(p);
+}
+
+/** 
+ * Make room for at least 'need' bytes in the given buffer. An 
+ * empty buffer is swapped for one from the pool, while a buffer
+ * with data in it is grown with realloc(). Returns 0 if out
+ * of memory.
+ **/
+static int
+lm_io_buf_reserve(io_t *io, iobuf_t *b, size_t need)
+{
+    char  *p;
+    size_t cap;
+
+    if (need <= b->cap)
+        return 1;
+
+    if (!b->sz) {
+        if (!(p = lm_io_buf_acquire(io, need, &cap)))
+            return 0;
+        lm_io_buf_release(io, b->ptr, b->cap);
+    } else {
+        cap = b->cap;
+        do cap *= 2; while (cap < need);
+        if (!(p = realloc(b->ptr, cap)))
+            return 0;
+    }
+
+    b->ptr = p;
+    b->cap = cap;
+    return 1;
+}
+
+/** 
+ * Called when the data in a buffer is no longer needed. If the
+ * buffer has grown larger than BUF_KEEP_SIZE, it is given back
+ * to the buffer pool and replaced with a small one, so that a 
+ * single huge page does not stay pinned in a worker.
+ **/
+void
+lm_io_buf_shrink(io_t *io, iobuf_t *b)
+{
+    char  *p;
+    size_t cap;
+
+    if (b->cap <= BUF_KEEP_SIZE)
+        return;
+
+    if (!(p = lm_io_buf_acquire(io, BUF_INIT_SIZE, &cap)))
+        return;
+
+    lm_io_buf_release(io, b->ptr, b->cap);
+
+    b->ptr = p;
+    b->cap = cap;
+    b->sz  = 0;
+    p[0]   = '\0';
+}
+
+/** 
+ * Called by a worker when it is done with the data of the 
+ * last transfer. Unmaps a file mapped by lm_io_get() and 
+ * shrinks the buffer, see lm_io_buf_shrink().
+ **/
+void
+lm_io_done(iohandle_t *h)
+{
+    lm_io_unmap(h);
+    lm_io_buf_shrink(h->io, &h->buf);
+}
 /** 
  * Used by the PRIMARY transfer handle of an iohandle_t,
  * write the data to a file instead of to memory
@@ -314,14 +780,12 @@ lm_io_data_save_cb(char *ptr, size_t size,
 M_CODE
 lm_io_head(iohandle_t *h, url_t *url)
 {
-    if (h->io->synchronous)
-        lm_iothr_wait(h->io, 1);
-
     memset(&h->transfer, 0, sizeof(iostat_t));
+    h->sink.too_big = 0;
+    h->sink.rejected = 0;
 
-    /* head is supported for HTTP and HTTPS only
-     * XXX: https is disabled for now */
-    if (url->protocol != LM_PROTOCOL_HTTP)
+    /* head is supported for HTTP and HTTPS only */
+    if (!LM_PROTOCOL_IS_HTTP(url->protocol))
         return M_OK;
 
     curl_easy_setopt(h->primary, CURLOPT_URL, url->str);
@@ -341,6 +805,7 @@ lm_io_head(iohandle_t *h, url_t *url)
 M_CODE
 lm_io_provide(iohandle_t *h, const char *buf, size_t len)
 {
+    lm_io_unmap(h);
     h->buf.sz = 0;
     h->buf.ptr[0] = '\0';
 
@@ -362,17 +827,29 @@ lm_io_save(iohandle_t *h, url_t *url,
     M_CODE r;
     /* TODO: support provided data by writing
      *       it to the file */
-    if (h->io->synchronous)
-        lm_iothr_wait(h->io, 0);
-
+    lm_io_unmap(h);
     h->buf.sz = 0;
     h->buf.ptr[0] = '\0';
 
     memset(&h->transfer, 0, sizeof(iostat_t));
+    h->sink.too_big = 0;
+    h->sink.rejected = 0;
 
     if (!(fp = fopen(name, "w+"))) 
         return M_COULD_NOT_OPEN;
 
+    if (url->protocol == LM_PROTOCOL_FILE) {
+        /* the file is read or mapped into h->buf, copy it from there */
+        if ((r = lm_io_perform_file(h, url)) == M_OK
+                && fwrite(h->buf.ptr, 1, h->buf.sz, fp) != h->buf.sz)
+            r = M_FAILED;
+        lm_io_unmap(h);
+        h->buf.sz = 0;
+        h->buf.ptr[0] = '\0';
+        fclose(fp);
+        return r;
+    }
+
     curl_easy_setopt(h->primary, CURLOPT_WRITEDATA, fp);
     curl_easy_setopt(h->primary, CURLOPT_WRITEFUNCTION, &lm_io_data_save_cb);
     curl_easy_setopt(h->primary, CURLOPT_NOBODY, 0);
@@ -391,21 +868,31 @@ lm_io_save(iohandle_t *h, url_t *url,
 M_CODE
 lm_io_get(iohandle_t *h, url_t *url)
 {
+    M_CODE r;
+
     if (h->provided) {
+        /* nothing went over the network, leave nothing behind
+         * for lm_worker_host_release() to charge the host with */
         h->provided = 0;
+        h->transfer.unreachable = 0;
+        h->transfer.ttfb        = 0;
         return M_OK;
     }
 
-    if (h->io->synchronous)
-        lm_iothr_wait(h->io, 0);
-
+    lm_io_unmap(h);
     h->buf.sz = 0;
     h->buf.ptr[0] = '\0';
 
     memset(&h->transfer, 0, sizeof(iostat_t));
 
-    curl_easy_setopt(h->primary, CURLOPT_WRITEDATA, &h->buf);
-    curl_easy_setopt(h->primary, CURLOPT_WRITEFUNCTION, &lm_io_data_cb);
+    /* the page might already have been downloaded by the IO-thread */
+    if (h->pipeline.count && (r = lm_io_collect(h, url)) != M_FAILED)
+        return r;
+
+    lm_io_sink_reset(&h->sink, h->max_body);
+
+    curl_easy_setopt(h->primary, CURLOPT_WRITEDATA, &h->sink);
+    curl_easy_setopt(h->primary, CURLOPT_WRITEFUNCTION, &lm_io_sink_cb);
     curl_easy_setopt(h->primary, CURLOPT_NOBODY, 0);
     curl_easy_setopt(h->primary, CURLOPT_URL, url->str);
 
@@ -413,57 +900,438 @@ lm_io_get(iohandle_t *h, url_t *url)
 }
 
 /** 
- * Function called when perform is done on a URL with 
- * an unsupported protocol.
+ * Download the given URL and pass the data on to st->cb
+ * while it arrives, see iostream_t. Only the part of the 
+ * body not yet consumed by st->cb is kept in h->buf.
+ *
+ * If the data was provided or is already in the GET 
+ * pipeline, or the protocol is not HTTP(S), the whole body is
+ * downloaded first and then given to st->cb in one go.
  **/
-static M_CODE
-lm_io_no_perform(iohandle_t *h, url_t *url)
+M_CODE
+lm_io_get_stream(iohandle_t *h, url_t *url, iostream_t *st)
 {
-    return M_FAILED;
+    M_CODE r;
+
+    if (h->provided || !LM_PROTOCOL_IS_HTTP(url->protocol)
+            || lm_io_find_slot(h, url)) {
+        if ((r = lm_io_get(h, url)) == M_OK
+                && (h->transfer.status_code < 300 || h->transfer.status_code >= 400))
+            st->cb(st, h->buf.ptr, h->buf.sz, 1);
+        return r;
+    }
+
+    lm_io_unmap(h);
+    lm_io_sink_reset(&h->sink, h->max_body);
+
+    memset(&h->transfer, 0, sizeof(iostat_t));
+
+    st->ioh = h;
+    st->status = LM_IOSTREAM_INIT;
+
+    curl_easy_setopt(h->primary, CURLOPT_WRITEDATA, st);
+    curl_easy_setopt(h->primary, CURLOPT_WRITEFUNCTION, &lm_io_stream_cb);
+    curl_easy_setopt(h->primary, CURLOPT_NOBODY, 0);
+    curl_easy_setopt(h->primary, CURLOPT_URL, url->str);
+
+    r = __perform[url->protocol](h, url);
+
+    if (st->status != LM_IOSTREAM_DISCARD)
+        st->cb(st, h->buf.ptr, h->buf.sz, 1);
+    h->buf.sz = 0;
+
+    return r;
 }
 
 /** 
- * Perform over FTP
+ * Write callback used by lm_io_get_stream()
  **/
-static M_CODE
-lm_io_perform_ftp(iohandle_t *h, url_t *url)
+static size_t
+lm_io_stream_cb(char *ptr, size_t size, size_t nmemb, void *s)
 {
-    CURLcode c;
-    int retries = 0;
-    int done = 0;
-    
-    do {
-        c = curl_easy_perform(h->primary);
-        switch (c) {
-            case CURLE_OK:
-                done = 1;
-                break;
+    iostream_t *st = (iostream_t*)s;
+    iobuf_t    *b  = &st->ioh->buf;
+    size_t      sz = nmemb*size;
+    size_t      n;
+    long        status;
+
+    if (st->status == LM_IOSTREAM_INIT) {
+        /* the headers are done, don't parse the body of redirects */
+        st->status = LM_IOSTREAM_ACTIVE;
+        if (curl_easy_getinfo(st->ioh->primary, CURLINFO_RESPONSE_CODE, &status) == CURLE_OK
+                && status >= 300 && status < 400)
+            st->status = LM_IOSTREAM_DISCARD;
+    }
 
-            case CURLE_FTP_CANT_GET_HOST:
-            case CURLE_COULDNT_RESOLVE_HOST:
-            case CURLE_COULDNT_CONNECT:
-            case CURLE_OPERATION_TIMEDOUT:
-            case CURLE_GOT_NOTHING:
-                if (retries < LM_IO_MAX_RETRIES) {
-                    retries ++;
-                    LM_WARNING(h->io->m, "retry %d of %d (%s)", retries, LM_IO_MAX_RETRIES, url->str);
-                    done = 0;
-                    break;
-                }
+    if (st->status == LM_IOSTREAM_DISCARD)
+        return sz;
 
-            default:
-                LM_WARNING(h->io->m, "%s (%s)", curl_easy_strerror(c), url->str);
-                done = 1;
-                return M_FAILED;
-        }
-    } while (!done);
+    /* no preallocation, the buffer only holds what 
+     * st->cb has not consumed yet */
+    if (lm_io_sink_write(&st->ioh->sink, ptr, sz, 0) != sz)
+        return 0;
 
-    return M_OK;
+    if ((n = st->cb(st, b->ptr, b->sz, 0))) {
+        memmove(b->ptr, b->ptr+n, b->sz-n);
+        b->sz -= n;
+        b->ptr[b->sz] = '\0';
+    }
+
+    return sz;
 }
 
 /** 
- * Perform a transfer over HTTP and handle return data 
- * such as content-type.
+ * Read a file from the local file system into h->buf. Regular
+ * files larger than BUF_KEEP_SIZE are mapped and handed out 
+ * without being copied, see lm_io_file_map(). Directories are
+ * listed so that the FTP parser can follow them, see 
+ * lm_io_file_list().
+ **/
+static M_CODE
+lm_io_perform_file(iohandle_t *h, url_t *url)
+{
+    char        path[PATH_MAX];
+    struct stat st;
+    int         fd;
+    M_CODE      r;
+
+    switch (lm_io_file_path(url, path)) {
+        case 0:
+            LM_WARNING(h->io->m, "path too long (%s)", url->str);
+            return M_FAILED;
+        case -1:
+            LM_WARNING(h->io->m, "not a local file (%s)", url->str);
+            return M_FAILED;
+    }
+
+    if ((fd = open(path, O_RDONLY)) == -1) {
+        LM_WARNING(h->io->m, "%s (%s)", strerror(errno), url->str);
+        return M_COULD_NOT_OPEN;
+    }
+
+    if (fstat(fd, &st) == -1) {
+        LM_WARNING(h->io->m, "%s (%s)", strerror(errno), url->str);
+        r = M_FAILED;
+    } else if (S_ISDIR(st.st_mode))
+        r = lm_io_file_list(h, url, path);
+    else if (!S_ISREG(st.st_mode)) {
+        LM_WARNING(h->io->m, "not a regular file (%s)", url->str);
+        r = M_FAILED;
+    } else if (h->max_body && (size_t)st.st_size > h->max_body) {
+        LM_WARNING(h->io->m, "body exceeds max_body_size (%s)", url->str);
+        r = M_TOO_BIG;
+    } else if (st.st_size > BUF_KEEP_SIZE)
+        r = lm_io_file_map(h, url, fd, (size_t)st.st_size);
+    else
+        r = lm_io_file_read(h, url, fd, (size_t)st.st_size);
+
+    close(fd);
+    return r;
+}
+
+/** 
+ * Decode the local path of a file URL into 'out', which must
+ * have room for PATH_MAX bytes. "file:///a/b" gives "/a/b" 
+ * and "file://./a" gives "./a", see lm_strtourl(). An empty
+ * or "localhost" authority is skipped, "file://localhost/a"
+ * gives "/a". Returns 0 if the path is too long and -1 if the
+ * URL names another host.
+ **/
+#define HEXVAL(c) (isdigit(c) ? (c)-'0' : tolower(c)-'a'+10)
+static int
+lm_io_file_path(url_t *url, char *out)
+{
+    char *s = url->str+sizeof("file:")-1;
+    char *e = url->str+url->sz;
+    char *o = out;
+    char *a;
+
+    if (e-s >= 2 && s[0] == '/' && s[1] == '/') {
+        s += 2;
+        for (a = s; a<e && *a != '/' && *a != '?' && *a != '#'; a++)
+            ;
+        if (a-s == sizeof("localhost")-1 && strncasecmp(s, "localhost", a-s) == 0)
+            s = a;
+        else if (a != s && !(*s == '.' && (a-s == 1 || (a-s == 2 && s[1] == '.'))))
+            return -1;
+    }
+
+    for (; s<e && *s != '?' && *s != '#'; s++) {
+        if (o-out >= PATH_MAX-1)
+            return 0;
+        if (*s == '%' && e-s > 2 && isxdigit(s[1]) && isxdigit(s[2])) {
+            *(o++) = (char)(HEXVAL(s[1])<<4 | HEXVAL(s[2]));
+            s += 2;
+        } else
+            *(o++) = *s;
+    }
+
+    /* "file://localhost" is the root */
+    if (o == out)
+        *(o++) = '/';
+
+    *o = '\0';
+    return 1;
+}
+#undef HEXVAL
+
+/** 
+ * Read 'sz' bytes of the given file into h->buf
+ **/
+static M_CODE
+lm_io_file_read(iohandle_t *h, url_t *url, int fd, size_t sz)
+{
+    ssize_t n;
+
+    if (!lm_io_buf_reserve(h->io, &h->buf, sz+1))
+        return M_OUT_OF_MEM;
+
+    while (h->buf.sz < sz) {
+        if ((n = read(fd, h->buf.ptr+h->buf.sz, sz-h->buf.sz)) == -1) {
+            if (errno == EINTR)
+                continue;
+            LM_WARNING(h->io->m, "%s (%s)", strerror(errno), url->str);
+            return M_FAILED;
+        }
+        if (!n)
+            break; /* truncated since the fstat() */
+        h->buf.sz += n;
+    }
+
+    h->buf.ptr[h->buf.sz] = '\0';
+    return M_OK;
+}
+
+/** 
+ * Map the given file and let h->buf point at it. The mapping
+ * is private and writable, so parsers that modify the data in
+ * place work as usual. The worker's own buffer is kept in 
+ * h->map until lm_io_unmap() is called by the next transfer
+ * or by lm_io_done().
+ *
+ * Room for a terminating '\0' is reserved by first mapping 
+ * anonymous memory one byte larger than the file, and then 
+ * mapping the file over the beginning of it. Both the tail of 
+ * the file's last page and the anonymous memory are zero filled.
+ *
+ * Falls back to lm_io_file_read() if the file can't be mapped.
+ **/
+static M_CODE
+lm_io_file_map(iohandle_t *h, url_t *url, int fd, size_t sz)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t len  = (sz+page) & ~(page-1);
+    char  *p;
+
+    if ((p = mmap(0, len, PROT_READ|PROT_WRITE,
+                  MAP_PRIVATE|MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+        return lm_io_file_read(h, url, fd, sz);
+
+    if (mmap(p, sz, PROT_READ|PROT_WRITE,
+             MAP_PRIVATE|MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(p, len);
+        return lm_io_file_read(h, url, fd, sz);
+    }
+
+    /* parsers scan the data from the beginning to the end */
+    madvise(p, sz, MADV_SEQUENTIAL);
+
+#ifdef IO_DEBUG
+    fprintf(stderr, "* iohandle:(%p) mapped %lu bytes (%s)\n", h, (unsigned long)sz, url->str);
+#endif
+
+    h->map.addr  = p;
+    h->map.len   = len;
+    h->map.saved = h->buf;
+
+    h->buf.ptr = p;
+    h->buf.sz  = sz;
+    h->buf.cap = 0;
+
+    return M_OK;
+}
+
+/** 
+ * Give h->buf its own buffer back after lm_io_file_map(). If
+ * a parser has replaced the mapped data with a buffer of its
+ * own, that buffer is kept and the saved one is released.
+ **/
+static void
+lm_io_unmap(iohandle_t *h)
+{
+    if (!h->map.addr)
+        return;
+
+    munmap(h->map.addr, h->map.len);
+
+    if (!h->buf.cap)
+        h->buf = h->map.saved;
+    else
+        lm_io_buf_release(h->io, h->map.saved.ptr, h->map.saved.cap);
+
+    h->map.addr = 0;
+}
+
+/** 
+ * List a directory into h->buf, one entry per line in EPLF, 
+ * the format understood by lm_parser_ftp(). If the URL does
+ * not end with a slash, the entries are prefixed with the
+ * name of the directory so that they are resolved relative 
+ * to the right place.
+ **/
+static M_CODE
+lm_io_file_list(iohandle_t *h, url_t *url, const char *path)
+{
+    DIR           *d;
+    struct dirent *e;
+    struct stat    st;
+    const char    *base = "";
+    size_t         blen = 0;
+    int            isdir;
+    char          *o;
+
+    if (!(d = opendir(path))) {
+        LM_WARNING(h->io->m, "%s (%s)", strerror(errno), url->str);
+        return M_COULD_NOT_OPEN;
+    }
+
+    if (url->str[url->sz-1] != '/') {
+        base = (base = strrchr(path, '/')) ? base+1 : path;
+        blen = strlen(base);
+    }
+
+    while ((e = readdir(d))) {
+        if (e->d_name[0] == '.'
+                && (!e->d_name[1] || (e->d_name[1] == '.' && !e->d_name[2])))
+            continue;
+
+        if (e->d_type == DT_DIR)
+            isdir = 1;
+        else if (e->d_type == DT_UNKNOWN || e->d_type == DT_LNK) {
+            if (fstatat(dirfd(d), e->d_name, &st, 0) == -1)
+                continue;
+            isdir = S_ISDIR(st.st_mode);
+        } else
+            isdir = 0;
+
+        /* "+/,\t<name>\n" for directories, "+r,\t<name>\n" for files,
+         * the name is percent-encoded and takes at most three
+         * times its length */
+        if (!lm_io_buf_reserve(h->io, &h->buf,
+                               h->buf.sz+3*(blen+strlen(e->d_name))+7)) {
+            closedir(d);
+            return M_OUT_OF_MEM;
+        }
+
+        o = h->buf.ptr+h->buf.sz;
+        *(o++) = '+';
+        *(o++) = isdir ? '/' : 'r';
+        *(o++) = ',';
+        *(o++) = '\t';
+        if (blen) {
+            o += lm_io_file_escape(o, base, blen);
+            *(o++) = '/';
+        }
+        o += lm_io_file_escape(o, e->d_name, strlen(e->d_name));
+        *(o++) = '\n';
+        h->buf.sz = o-h->buf.ptr;
+    }
+
+    closedir(d);
+    return M_OK;
+}
+
+/** 
+ * Percent-encode the file name 's' into 'out', which must have
+ * room for 3*len bytes. '%', '?' and '#' are encoded so that 
+ * the name reads back as a path, and so is any byte that may
+ * not appear in a URL. Returns the number of bytes written.
+ **/
+static size_t
+lm_io_file_escape(char *out, const char *s, size_t len)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    char *o = out;
+    size_t x;
+
+    for (x=0; x<len; x++) {
+        unsigned char c = (unsigned char)s[x];
+
+        if (c <= ' ' || c >= 0x7f || strchr("%?#\"<>\\^`{|}", c)) {
+            *(o++) = '%';
+            *(o++) = hex[c >> 4];
+            *(o++) = hex[c & 0xf];
+        } else
+            *(o++) = (char)c;
+    }
+
+    return o-out;
+}
+
+/** 
+ * Function called when perform is done on a URL with 
+ * an unsupported protocol.
+ **/
+static M_CODE
+lm_io_no_perform(iohandle_t *h, url_t *url)
+{
+    return M_FAILED;
+}
+
+/** 
+ * Perform over FTP
+ **/
+static M_CODE
+lm_io_perform_ftp(iohandle_t *h, url_t *url)
+{
+    CURLcode c;
+    int retries = 0;
+    int done = 0;
+
+    lm_io_set_timeouts(h);
+    
+    do {
+        c = curl_easy_perform(h->primary);
+        switch (c) {
+            case CURLE_OK:
+                lm_io_set_ttfb(h);
+                done = 1;
+                break;
+
+            case CURLE_WRITE_ERROR:
+                if (h->sink.too_big) {
+                    LM_WARNING(h->io->m, "body exceeds max_body_size (%s)", url->str);
+                    return M_TOO_BIG;
+                }
+                LM_WARNING(h->io->m, "%s (%s)", curl_easy_strerror(c), url->str);
+                return M_FAILED;
+
+            case CURLE_FTP_CANT_GET_HOST:
+            case CURLE_COULDNT_RESOLVE_HOST:
+            case CURLE_COULDNT_CONNECT:
+            case CURLE_OPERATION_TIMEDOUT:
+            case CURLE_GOT_NOTHING:
+                if (LM_IO_RETRY(h, c, retries)) {
+                    retries ++;
+                    LM_WARNING(h->io->m, "retry %d of %d (%s)", retries, LM_IO_MAX_RETRIES, url->str);
+                    done = 0;
+                    break;
+                }
+                h->transfer.unreachable = 1;
+
+            default:
+                LM_WARNING(h->io->m, "%s (%s)", curl_easy_strerror(c), url->str);
+                done = 1;
+                return M_FAILED;
+        }
+    } while (!done);
+
+    return M_OK;
+}
+
+/** 
+ * Perform a transfer over HTTP and handle return data 
+ * such as content-type.
  **/
 static M_CODE
 lm_io_perform_http(iohandle_t *h, url_t *url)
@@ -471,48 +1339,48 @@ lm_io_perform_http(iohandle_t *h, url_t *url)
     CURLcode c;
     int retries = 0;
     int done = 0;
-    long status;
 
 #if LIBCURL_VERSION_NUM < 0x71202
     curl_easy_setopt(h->primary, CURLOPT_FOLLOWLOCATION, 1);
 #endif
 
+    lm_io_set_timeouts(h);
+
     do {
         c = curl_easy_perform(h->primary);
         switch (c) {
             case CURLE_OK:
-                /**
-                 * Everything went just like it should, but we should
-                 * check for possible redirects
-                 **/
-                if (curl_easy_getinfo(h->primary, CURLINFO_RESPONSE_CODE, &status) == CURLE_OK) {
-                    h->transfer.status_code = status;
-                    if (status >= 300 && status < 400) {
-                        /**
-                         * We got a redirect, and we add it to the list of headers so 
-                         * the worker can read it later
-                         **/
-                        const char *new_url;
-                        if (curl_easy_getinfo(h->primary, CURLINFO_REDIRECT_URL, &new_url) == CURLE_OK)
-                            h->transfer.headers.location = (char*)new_url;
-                    }
-                    curl_easy_getinfo(h->primary, CURLINFO_CONTENT_TYPE, &h->transfer.headers.content_type);
-                    if (!h->transfer.headers.content_type)
-                        h->transfer.headers.content_type = "";
-                }
+                lm_io_http_info(h, h->primary);
+                lm_io_set_ttfb(h);
                 done = 1;
                 break;
 
+            case CURLE_WRITE_ERROR:
+                if (h->sink.rejected) {
+                    /* aborted on purpose after the headers */
+                    lm_io_http_info(h, h->primary);
+                    lm_io_set_ttfb(h);
+                    done = 1;
+                    break;
+                }
+                if (h->sink.too_big) {
+                    LM_WARNING(h->io->m, "body exceeds max_body_size (%s)", url->str);
+                    return M_TOO_BIG;
+                }
+                LM_WARNING(h->io->m, "%s (%s)", curl_easy_strerror(c), url->str);
+                return M_FAILED;
+
             case CURLE_COULDNT_RESOLVE_HOST:
             case CURLE_COULDNT_CONNECT:
             case CURLE_OPERATION_TIMEDOUT:
             case CURLE_GOT_NOTHING:
-                if (retries < LM_IO_MAX_RETRIES) {
+                if (LM_IO_RETRY(h, c, retries)) {
                     retries ++;
                     LM_WARNING(h->io->m, "retry %d of %d (%s)", retries, LM_IO_MAX_RETRIES, url->str);
                     done = 0;
                     break;
                 }
+                h->transfer.unreachable = 1;
 
             default:
                 LM_WARNING(h->io->m, "%s (%s)", curl_easy_strerror(c), url->str);
@@ -523,6 +1391,116 @@ lm_io_perform_http(iohandle_t *h, url_t *url)
     return M_OK;
 }
 
+/** 
+ * Set the timeouts of h->primary for the next transfer, 
+ * given by the worker from the health of the host. 0 gives
+ * curl's defaults back.
+ **/
+static void
+lm_io_set_timeouts(iohandle_t *h)
+{
+    curl_easy_setopt(h->primary, CURLOPT_CONNECTTIMEOUT_MS, h->connect_timeout);
+    curl_easy_setopt(h->primary, CURLOPT_TIMEOUT_MS, h->timeout);
+}
+
+/** 
+ * Store the time to the first byte of the finished transfer
+ * on h->primary in h->transfer.ttfb
+ **/
+static void
+lm_io_set_ttfb(iohandle_t *h)
+{
+    double t;
+
+    if (curl_easy_getinfo(h->primary, CURLINFO_STARTTRANSFER_TIME, &t) == CURLE_OK
+            && t > 0)
+        h->transfer.ttfb = (unsigned int)(t*1000.0)+1;
+}
+
+/** 
+ * Everything went just like it should, but we should
+ * check for possible redirects. Fill in h->transfer using 
+ * the finished HTTP transfer on 'c'.
+ **/
+static void
+lm_io_http_info(iohandle_t *h, CURL *c)
+{
+    long status;
+
+    if (curl_easy_getinfo(c, CURLINFO_RESPONSE_CODE, &status) == CURLE_OK) {
+        h->transfer.status_code = status;
+        if (status >= 300 && status < 400) {
+            /**
+             * We got a redirect, and we add it to the list of headers so 
+             * the worker can read it later
+             **/
+            const char *new_url;
+            if (curl_easy_getinfo(c, CURLINFO_REDIRECT_URL, &new_url) == CURLE_OK)
+                h->transfer.headers.location = (char*)new_url;
+        }
+        curl_easy_getinfo(c, CURLINFO_CONTENT_TYPE, &h->transfer.headers.content_type);
+        if (!h->transfer.headers.content_type)
+            h->transfer.headers.content_type = "";
+    }
+}
+
+/** 
+ * Pick up the given URL from the GET pipeline, waiting for 
+ * the IO-thread to finish it if needed. The downloaded data
+ * is swapped into h->buf. Returns M_FAILED if the URL is not 
+ * in the pipeline or if the pipelined transfer failed, in which
+ * case the caller should perform the transfer itself.
+ **/
+static M_CODE
+lm_io_collect(iohandle_t *h, url_t *url)
+{
+    iopipe_t *p;
+    iobuf_t   tmp;
+
+    if (!(p = lm_io_find_slot(h, url)))
+        return M_FAILED;
+
+    while (p->state == LM_IOPIPE_RUNNING)
+        if (!lm_multiget_wait(h, 1))
+            return M_FAILED;
+
+#ifdef IO_DEBUG
+    fprintf(stderr, "* iohandle:(%p) collected '%s' from slot %d\n", h, p->url, p->info.identifier);
+#endif
+
+    p->state = LM_IOPIPE_FREE;
+    if (p->info.result != CURLE_OK) {
+        if (p->sink.too_big) {
+            LM_WARNING(h->io->m, "body exceeds max_body_size (%s)", url->str);
+            return M_TOO_BIG;
+        }
+        return M_FAILED;
+    }
+
+    tmp = h->buf;
+    h->buf = p->buf;
+    p->buf = tmp;
+
+    lm_io_http_info(h, p->h);
+    return M_OK;
+}
+
+/** 
+ * Find the pipeline slot used for the given URL, if any
+ **/
+static iopipe_t *
+lm_io_find_slot(iohandle_t *h, url_t *url)
+{
+    int x;
+
+    for (x=0; x<h->pipeline.count; x++)
+        if (h->pipeline.slots[x].state != LM_IOPIPE_FREE
+                && strcmp(h->pipeline.slots[x].url, url->str) == 0)
+            return &h->pipeline.slots[x];
+
+    return 0;
+}
+
 /** 
  * Wait for any transfer to finish, return the used CURL 
  * interface, from which we will later extract information from
@@ -534,47 +1512,170 @@ lm_multipeek_wait(iohandle_t *ioh)
 {
     ioprivate_t *ret;
 
-    pthread_mutex_lock(&ioh->dcond_mtx);
-
 #ifdef IO_DEBUG
     fprintf(stderr, "* iohandle:(%p) lm_multipeek_wait, total = %d\n", ioh, ioh->total);
 #endif
 
-    if (!ioh->total) {
-        pthread_mutex_unlock(&ioh->dcond_mtx);
+    if (!ioh->total)
         return 0; /* done transfers will decrease the total amount each by one,
                      when total reaches 0, it means all transfers are finished */
-    }
-    if (!ioh->done.count) {
-        ioh->waiting = 1;
-        /* no done transfers, wait for the io-thread to send a condition */
-        pthread_cond_wait(&ioh->dcond, &ioh->dcond_mtx);
-        ioh->waiting = 0;
-    }
+
+    /* no done transfers, wait for the io-thread to finish one */
+    if (!ioh->done.count
+            && !lm_iohandle_wait(ioh, LM_IOPRIV_PEEK, 1))
+        return 0; /* reading the eventfd failed */
+
     ret = ioh->done.list[ioh->done.count-1];
     ioh->done.count--;
     ioh->total--;
-    pthread_mutex_unlock(&ioh->dcond_mtx);
 
     return ret;
 }
 
 /** 
- * If the mode option was set, we need to sleep some
- * time between transfers.
+ * Move finished transfers of this iohandle out of the ring 
+ * and the overflow list. HEAD lookups are put in ioh->done,
+ * and pipeline slots of finished GETs are marked as done. 
+ * Returns the number of transfers of the given type that 
+ * were picked up.
  **/
-static void
-lm_iothr_wait(io_t *io, int mp)
+static int
+lm_iohandle_drain(iohandle_t *ioh, int type)
 {
-    clock_t now = clock();
-    clock_t done;
-    if (mp)
-        done = io->timer_last+io->timer_wait_mp;
-    else 
-        done = io->timer_last+io->timer_wait;
+    ioprivate_t *info;
+    int          n = 0, x = 0;
 
-    if (now < done && done-now > CLOCKS_PER_SEC)
-        sec_sleep((done-now)/CLOCKS_PER_SEC);
+    for (;;) {
+        if (!(info = lm_ring_pop(&ioh->ring))) {
+            /* the overflow list is rarely used, so peek at its 
+             * size before taking the lock */
+            if (!ioh->overflow.size)
+                break;
+            pthread_mutex_lock(&ioh->overflow_mtx);
+            info = (ioh->overflow.size ? ioh->overflow.list[--ioh->overflow.size] : 0);
+            pthread_mutex_unlock(&ioh->overflow_mtx);
+            if (!info)
+                break;
+        }
+
+        if (info->type == LM_IOPRIV_GET) {
+            ioh->pipeline.slots[info->identifier].state = LM_IOPIPE_DONE;
+            ioh->pipeline.running--;
+        } else {
+            if (ioh->done.count+1 >= ioh->done.allocsz) {
+                ioh->done.allocsz *= 2;
+                if (!(ioh->done.list = realloc(ioh->done.list, ioh->done.allocsz*sizeof(ioprivate_t*)))) {
+                    LM_ERROR(ioh->io->m, "out of mem");
+                    abort();
+                }
+            }
+            ioh->done.list[ioh->done.count] = info;
+            ioh->done.count++;
+        }
+
+        if (info->type == type)
+            n++;
+        x++;
+    }
+
+#ifdef IO_DEBUG
+    if (x)
+        fprintf(stderr, "* iohandle:(%p) picked up %d finished transfers\n", ioh, x);
+#endif
+
+    return n;
+}
+
+/** 
+ * Pick up finished transfers, see lm_iohandle_drain(). If 
+ * 'block' is set and no transfer of the given type has 
+ * finished, sleep on the eventfd until an IO-thread wakes 
+ * us up.
+ **/
+static int
+lm_iohandle_wait(iohandle_t *ioh, int type, int block)
+{
+    uint64_t v;
+    int      n;
+
+    if ((n = lm_iohandle_drain(ioh, type)) || !block)
+        return n;
+
+    for (;;) {
+        ioh->waiting = 1;
+        /* 'waiting' must be visible to the IO-threads before we
+         * look at the ring a last time */
+        __sync_synchronize();
+        if ((n = lm_iohandle_drain(ioh, type)))
+            break;
+        if (read(ioh->ev_fd, &v, sizeof(uint64_t)) < 0 && errno != EINTR)
+            break;
+    }
+    ioh->waiting = 0;
+
+    return n;
+}
+
+/** 
+ * Give a HEAD lookup returned by lm_multipeek_wait() back to
+ * the pool once the worker has read what it needs from it.
+ * The CURL handle is kept alive so that its connections can
+ * be reused by the next lookup.
+ **/
+void
+lm_multipeek_release(iohandle_t *ioh, ioprivate_t *info)
+{
+    io_t *io = ioh->io;
+
+    pthread_mutex_lock(&io->pool_mtx);
+    if (io->pool.size >= io->pool.allocsz) {
+        ioprivate_t **list = realloc(io->pool.list, io->pool.allocsz*2*sizeof(ioprivate_t*));
+        if (!list) {
+            pthread_mutex_unlock(&io->pool_mtx);
+            curl_easy_cleanup(info->handle);
+            free(info);
+            return;
+        }
+        io->pool.list = list;
+        io->pool.allocsz *= 2;
+    }
+    io->pool.list[io->pool.size++] = info;
+    pthread_mutex_unlock(&io->pool_mtx);
+}
+
+/** 
+ * Get a HEAD lookup handle from the pool, or create a new
+ * one if the pool is empty. Only the URL is set per transfer,
+ * everything else is set up once here.
+ **/
+static ioprivate_t *
+lm_io_pool_get(io_t *io)
+{
+    ioprivate_t *info = 0;
+
+    pthread_mutex_lock(&io->pool_mtx);
+    if (io->pool.size)
+        info = io->pool.list[--io->pool.size];
+    pthread_mutex_unlock(&io->pool_mtx);
+
+    if (info)
+        return info;
+
+    if (!(info = malloc(sizeof(ioprivate_t))))
+        return 0;
+    if (!(info->handle = curl_easy_init())) {
+        free(info);
+        return 0;
+    }
+    info->type = LM_IOPRIV_PEEK;
+
+    lm_io_setup_handle(io, info->handle);
+    curl_easy_setopt(info->handle, CURLOPT_PRIVATE, info);
+    curl_easy_setopt(info->handle, CURLOPT_NOBODY, 1);
+    curl_easy_setopt(info->handle, CURLOPT_WRITEFUNCTION, &lm_iothr_data_cb);
+    curl_easy_setopt(info->handle, CURLOPT_FOLLOWLOCATION, 1);
+
+    return info;
 }
 
 /** 
@@ -588,52 +1689,263 @@ lm_iothr_wait(io_t *io, int mp)
 M_CODE
 lm_multipeek_add(iohandle_t *ioh, url_t *url, int id)
 {
-    int msg;
+    ioprivate_t *info;
+    M_CODE       r;
 #ifdef IO_DEBUG
     fprintf(stderr, "* iohandle:(%p) lm_multipeek_add: '%s'\n", ioh, url->str);
 #endif
 
-    io_t *io = ioh->io;
-
     /* XXX: temporary fix to prevent dead locks */
-    if (url->protocol != LM_PROTOCOL_HTTP)
+    if (!LM_PROTOCOL_IS_HTTP(url->protocol))
         return M_FAILED;
 
-    pthread_mutex_lock(&io->queue_mtx);
-    /* add this url to the queue */
-    if (io->queue.size+1 >= io->queue.allocsz) {
-        io->queue.allocsz *= 2;
-        io->queue.pos = realloc(io->queue.pos, sizeof(ioqp_t)*io->queue.allocsz);
-        if (!io->queue.pos) {
-            pthread_mutex_unlock(&io->queue_mtx);
+    if (!(info = lm_io_pool_get(ioh->io)))
+        return M_OUT_OF_MEM;
+
+    info->ioh = ioh;
+    info->identifier = id;
+    info->result = CURLE_OK;
+    curl_easy_setopt(info->handle, CURLOPT_URL, url->str);
+
+    iothr_t *t = lm_io_shard(ioh->io, url);
+
+    if ((r = lm_io_enqueue(t, info)) != M_OK) {
+        lm_multipeek_release(ioh, info);
+        return r;
+    }
+    ioh->total++;
+
+    return lm_io_notify(t);
+}
+
+/** 
+ * Queue a GET of the given URL in the iohandle's pipeline. The 
+ * IO-thread will download it in the background, and the result 
+ * is picked up by a later call to lm_io_get() with the same URL.
+ * Returns M_FAILED if pipelining is disabled, the protocol is 
+ * not supported or no pipeline slot is free.
+ *
+ * XXX: This function must NOT be called when running synchronously.
+ **/
+M_CODE
+lm_multiget_add(iohandle_t *ioh, url_t *url, size_t max_body)
+{
+    iopipe_t *p = 0;
+    int       x;
+    M_CODE    r;
+
+    if (!ioh->pipeline.count || !LM_PROTOCOL_IS_HTTP(url->protocol))
+        return M_FAILED;
+
+    for (x=0; x<ioh->pipeline.count; x++) {
+        if (ioh->pipeline.slots[x].state == LM_IOPIPE_FREE) {
+            if (!p)
+                p = &ioh->pipeline.slots[x];
+        } else if (strcmp(ioh->pipeline.slots[x].url, url->str) == 0)
+            return M_OK; /* already in the pipeline */
+    }
+
+    if (!p)
+        return M_FAILED;
+
+    if (p->url_cap < url->sz+1) {
+        if (!(p->url = realloc(p->url, url->sz+1))) {
+            p->url_cap = 0;
             return M_OUT_OF_MEM;
         }
+        p->url_cap = url->sz+1;
     }
-    io->queue.pos[io->queue.size].url = url->str;
-    io->queue.pos[io->queue.size].ioh = ioh;
-    io->queue.pos[io->queue.size].identifier = id;
-    io->queue.size++;
-    pthread_mutex_unlock(&io->queue_mtx);
-    ioh->total++;
-    /* inform our event loop, a new url was added */
-    msg = LM_IOMSG_ADD;
+    memcpy(p->url, url->str, url->sz);
+    p->url[url->sz] = '\0';
+
+#ifdef IO_DEBUG
+    fprintf(stderr, "* iohandle:(%p) lm_multiget_add: '%s', slot %d\n", ioh, p->url, p->info.identifier);
+#endif
+
+    /* the slot might hold a big buffer swapped in from lm_io_get() */
+    lm_io_buf_shrink(ioh->io, &p->buf);
+    lm_io_sink_reset(&p->sink, max_body);
+    p->info.ioh = ioh;
+    p->info.result = CURLE_OK;
+    curl_easy_setopt(p->h, CURLOPT_URL, p->url);
+
+    iothr_t *t = lm_io_shard(ioh->io, url);
+
+    if ((r = lm_io_enqueue(t, &p->info)) != M_OK)
+        return r;
+    p->state = LM_IOPIPE_RUNNING;
+    ioh->pipeline.running++;
+
+    return lm_io_notify(t);
+}
+
+/** 
+ * Move finished pipelined GETs from the IO-thread's done 
+ * list into their slots. If 'block' is set, wait until at 
+ * least one transfer has finished. Returns the number of 
+ * transfers picked up, 0 if none were running.
+ **/
+static int
+lm_multiget_wait(iohandle_t *ioh, int block)
+{
+    return lm_iohandle_wait(ioh, LM_IOPRIV_GET,
+                            block && ioh->pipeline.running);
+}
+
+/** 
+ * Release finished pipeline slots whose URL is not among 
+ * 'urls', so that lm_multiget_add() can reuse them. Running 
+ * transfers are left alone.
+ **/
+void
+lm_multiget_retain(iohandle_t *ioh, url_t **urls, int num)
+{
+    iopipe_t *p;
+    int       x, y;
+
+    if (!ioh->pipeline.count)
+        return;
+
+    lm_multiget_wait(ioh, 0);
+
+    for (x=0; x<ioh->pipeline.count; x++) {
+        p = &ioh->pipeline.slots[x];
+        if (p->state != LM_IOPIPE_DONE)
+            continue;
+        for (y=0; y<num; y++)
+            if (strcmp(p->url, urls[y]->str) == 0)
+                break;
+        if (y == num)
+            p->state = LM_IOPIPE_FREE;
+    }
+}
+
+/** 
+ * Pick the IO-thread that transfers to the host of the given
+ * URL should go through, using an FNV-1a hash of the host name
+ **/
+static iothr_t *
+lm_io_shard(io_t *io, url_t *url)
+{
+    uint32_t hash = 2166136261u;
+    int      x;
+
+    if (io->num_threads == 1)
+        return &io->threads[0];
+
+    for (x=0; x<url->host_l; x++) {
+        hash ^= (uint8_t)tolower(url->str[url->host_o+x]);
+        hash *= 16777619u;
+    }
+
+    return &io->threads[hash % io->num_threads];
+}
+
+/** 
+ * Add a transfer with a fully set up CURL handle to the 
+ * pending transfers of an IO-thread. The IO-thread must be 
+ * notified through lm_io_notify().
+ **/
+static M_CODE
+lm_io_enqueue(iothr_t *t, ioprivate_t *info)
+{
+    if (lm_ring_push(&t->ring, info))
+        return M_OK;
+
+    /* the ring is full, fall back to the locked queue */
+    pthread_mutex_lock(&t->queue_mtx);
+    if (t->queue.size+1 >= t->queue.allocsz) {
+        t->queue.allocsz *= 2;
+        t->queue.pos = realloc(t->queue.pos, sizeof(ioprivate_t*)*t->queue.allocsz);
+        if (!t->queue.pos) {
+            pthread_mutex_unlock(&t->queue_mtx);
+            return M_OUT_OF_MEM;
+        }
+    }
+    t->queue.pos[t->queue.size] = info;
+    t->queue.size++;
+    pthread_mutex_unlock(&t->queue_mtx);
+
+    return M_OK;
+}
+
+/** 
+ * inform the event loop of an IO-thread, a new url was added.
+ * Only the first call after the IO-thread has last woken up 
+ * writes to the eventfd, so a burst of added URLs costs one 
+ * system call.
+ **/
+static M_CODE
+lm_io_notify(iothr_t *t)
+{
+    uint64_t v = 1;
+
+    /* full barrier, the transfer must be visible to the 
+     * IO-thread before it can see 'signalled' */
+    if (__sync_fetch_and_or(&t->signalled, 1))
+        return M_OK;
 
-    if (write(io->msg_fd[1], &msg, sizeof(int)) <= 0)
+    if (write(t->ev_fd, &v, sizeof(uint64_t)) != sizeof(uint64_t)) {
+        t->signalled = 0;
         return M_IO_ERROR;
+    }
     return M_OK;
 }
 
+/** 
+ * Hand a finished transfer back to its iohandle, waking up
+ * the worker if it is sleeping in lm_iohandle_wait()
+ **/
+static void
+lm_iothr_finish(ioprivate_t *info)
+{
+    iohandle_t *ioh = info->ioh;
+    uint64_t    v = 1;
+
+    if (!lm_ring_push(&ioh->ring, info)) {
+        pthread_mutex_lock(&ioh->overflow_mtx);
+        if (ioh->overflow.size >= ioh->overflow.allocsz) {
+            ioh->overflow.allocsz = (ioh->overflow.allocsz ? ioh->overflow.allocsz*2 : 16);
+            if (!(ioh->overflow.list = realloc(ioh->overflow.list, ioh->overflow.allocsz*sizeof(ioprivate_t*)))) {
+                LM_ERROR(ioh->io->m, "out of mem");
+                abort();
+            }
+        }
+        ioh->overflow.list[ioh->overflow.size++] = info;
+        pthread_mutex_unlock(&ioh->overflow_mtx);
+    }
+
+    __sync_synchronize();
+    if (ioh->waiting && __sync_bool_compare_and_swap(&ioh->waiting, 1, 0)) {
+        while (write(ioh->ev_fd, &v, sizeof(uint64_t)) != sizeof(uint64_t)) {
+            if (errno != EINTR) {
+                LM_ERROR(ioh->io->m, "waking up worker failed: %s", strerror(errno));
+                break;
+            }
+        }
+    }
+}
+
 M_CODE
 lm_iothr_stop(io_t *io)
 {
-    int msg = LM_IOMSG_STOP;
-    if (!io->synchronous && io->started) {
+    uint64_t v = 1;
+    int x;
+
+    if (io->synchronous)
+        return M_OK;
+
+    for (x=0; x<io->started; x++) {
         /* signal the event loop to exit */
-        if (write(io->msg_fd[1], &msg, sizeof(int)) <= 0)
+        io->threads[x].stop = 1;
+        __sync_synchronize();
+        if (write(io->threads[x].ev_fd, &v, sizeof(uint64_t)) != sizeof(uint64_t))
             return M_IO_ERROR;
-        /* wait for the thread to exit */
-        pthread_join(io->thr, 0);
     }
+    /* wait for the threads to exit */
+    for (x=0; x<io->started; x++)
+        pthread_join(io->threads[x].thr, 0);
+    io->started = 0;
 
     return M_OK;
 }
@@ -654,21 +1966,21 @@ lm_iothr_data_cb(void *ptr, size_t size, size_t nmemb, void *s)
  * called when the epoll() timer has been reached
  **/
 static M_CODE
-lm_iothr_timer_reached(io_t *io)
+lm_iothr_timer_reached(iothr_t *t)
 {
 #ifdef IO_DEBUG
-    fprintf(stderr, "* io:(%p) timer reached\n", io);
+    fprintf(stderr, "* io:(%p) timer reached\n", t);
 #endif
 
-    while (curl_multi_socket_action(io->multi_h,
-                CURL_SOCKET_TIMEOUT, 0, &io->nrunning)
+    while (curl_multi_socket_action(t->multi_h,
+                CURL_SOCKET_TIMEOUT, 0, &t->nrunning)
             == CURLM_CALL_MULTI_PERFORM)
         ;
 
-    lm_iothr_check_completed(io);
+    lm_iothr_check_completed(t);
 
-    if (!io->nrunning)
-        io->e_timeout = 20000;
+    if (!t->nrunning)
+        t->e_timeout = 20000;
 
     return M_OK;
 }
@@ -677,13 +1989,13 @@ lm_iothr_timer_reached(io_t *io)
  * Called by libcurl to set a timeout
  **/
 static int 
-lm_iothr_set_timer_cb(CURLM *m, long timeout, io_t *io)
+lm_iothr_set_timer_cb(CURLM *m, long timeout, iothr_t *t)
 {
 #ifdef IO_DEBUG
     fprintf(stderr, "* io:(%p) set timer to %d ms\n",
-              io, (int)timeout);
+              t, (int)timeout);
 #endif
-    io->e_timeout = (int)timeout;
+    t->e_timeout = (int)timeout;
     return 0;
 }
 /** 
@@ -693,60 +2005,40 @@ lm_iothr_set_timer_cb(CURLM *m, long timeout, io_t *io)
  * queue
  **/
 static void
-lm_iothr_check_completed(io_t *io)
+lm_iothr_check_completed(iothr_t *t)
 {
     int      n_msgs;
     CURL    *h;
     CURLMsg *msg;
+    CURLcode result;
     ioprivate_t *info;
-    iohandle_t  *ioh;
 
 #ifdef IO_DEBUG
     fprintf(stderr, "* io:(%p) lm_iothr_check_completed(), prev = %d, curr = %d\n", 
-            io, io->prev_running, io->nrunning);
+            t, t->prev_running, t->nrunning);
 #endif
 
-    if (io->prev_running > io->nrunning) {
-        while ((msg = curl_multi_info_read(io->multi_h, &n_msgs))) {
+    if (t->prev_running > t->nrunning) {
+        while ((msg = curl_multi_info_read(t->multi_h, &n_msgs))) {
             if (msg->msg == CURLMSG_DONE) {
                 h = msg->easy_handle;
+                result = msg->data.result; /* msg is invalid after removal */
                 curl_easy_getinfo(h, CURLINFO_PRIVATE, &info);
-                curl_multi_remove_handle(io->multi_h, h);
+                curl_multi_remove_handle(t->multi_h, h);
 #ifdef IO_DEBUG
-                fprintf(stderr, "* io:(%p) remove handle %p, id = '%d'\n", io, h, info->identifier);
+                fprintf(stderr, "* io:(%p) remove handle %p, id = '%d'\n", t, h, info->identifier);
 #endif
 
-                ioh = info->ioh;
-
                 /* dont waste time gathering further information here,
                  * let the iohandle do that in its own thread. Hence, 
                  * we simply mark the transfer as done and remove the 
                  * handle from the multi stack */
-
-                /* TODO: use trylock to avoid blocking, we should 
-                 * put blocking operations in a temporary queue and
-                 * attempt them later until the operation doesnt block
-                 * or max retries have been reached */
-                pthread_mutex_lock(&ioh->dcond_mtx);
-                if (ioh->done.count+1 >= ioh->done.allocsz) {
-                    ioh->done.allocsz *= 2;
-                    if (!(ioh->done.list = realloc(ioh->done.list, ioh->done.allocsz*sizeof(ioprivate_t*)))) {
-                        LM_ERROR(ioh->io->m, "out of mem");
-                        abort();
-                    }
-                }
-                /* set the info->handle to the CURL handle used, so the 
-                 * worker will be able to fetch information about it */
-                info->handle = h;
-                ioh->done.list[ioh->done.count] = info;
-                ioh->done.count++;
-                if (ioh->waiting) 
-                    pthread_cond_signal(&ioh->dcond);
-                pthread_mutex_unlock(&ioh->dcond_mtx);
+                info->result = result;
+                lm_iothr_finish(info);
             }
         }
     }
-    io->prev_running = io->nrunning;
+    t->prev_running = t->nrunning;
 }
 
 /**
@@ -757,15 +2049,15 @@ static int
 lm_iothr_socket_cb(CURL *h, curl_socket_t s, int action,
                    void *userp, void *socketp)
 {
-    io_t *io = (io_t*)userp;
-    int e_fd = io->e_fd;
+    iothr_t *t = (iothr_t*)userp;
+    int e_fd = t->e_fd;
 
     struct epoll_event ev;
 #ifdef IO_DEBUG
     const char *what[] = {"none", "IN", "OUT", "INOUT", "REMOVE"};
     fprintf(stderr,
             "* io:(%p) lm_iothr_socket_cb(), action '%s' on%s socket %d, handle %p\n",
-            io, what[action], (socketp?"":" NEW"), s, h);
+            t, what[action], (socketp?"":" NEW"), s, h);
 #endif
 
     if (action == CURL_POLL_REMOVE)
@@ -776,7 +2068,7 @@ lm_iothr_socket_cb(CURL *h, curl_socket_t s, int action,
                    |((action & CURL_POLL_OUT) ? EPOLLOUT : 0);
         if (!socketp) {
             epoll_ctl(e_fd, EPOLL_CTL_ADD, s, &ev);
-            curl_multi_assign(io->multi_h, s, (void*)1);
+            curl_multi_assign(t->multi_h, s, (void*)1);
         } else
             epoll_ctl(e_fd, EPOLL_CTL_MOD, s, &ev);
     }
@@ -788,14 +2080,14 @@ lm_iothr_socket_cb(CURL *h, curl_socket_t s, int action,
  * data is available for read/write on the given file descriptor
  **/
 static M_CODE
-lm_iothr_fd_event(io_t *io, int fd, int events)
+lm_iothr_fd_event(iothr_t *t, int fd, int events)
 {
     CURLMcode  c;
     int        ev_bitmask; /* events to libcurl */
 #ifdef IO_DEBUG
     fprintf(stderr,
             "* io:(%p) lm_iothr_fd_event(), events = '%s%s%s', socket %d\n",
-            io, 
+            t, 
             ((events & EPOLLIN) ? "READ":""),
             ((events & EPOLLOUT) ? "WRITE":""),
             ((events & EPOLLERR) ? "ERROR":""),
@@ -804,16 +2096,16 @@ lm_iothr_fd_event(io_t *io, int fd, int events)
 
     if (events & EPOLLERR) {
         /* an error occurred */
-        curl_multi_socket_action(io->multi_h, fd,
-                CURL_CSELECT_ERR, &io->nrunning);
+        curl_multi_socket_action(t->multi_h, fd,
+                CURL_CSELECT_ERR, &t->nrunning);
 
         return M_SOCKET_ERROR;
     } else {
         ev_bitmask = ((events & EPOLLIN) ? CURL_CSELECT_IN : 0)
                      | ((events & EPOLLOUT) ? CURL_CSELECT_OUT : 0);
 
-        while ((c = curl_multi_socket_action(io->multi_h, fd,
-                        ev_bitmask, &io->nrunning))
+        while ((c = curl_multi_socket_action(t->multi_h, fd,
+                        ev_bitmask, &t->nrunning))
                 ==  CURLM_CALL_MULTI_PERFORM)
             ;
 
@@ -821,7 +2113,7 @@ lm_iothr_fd_event(io_t *io, int fd, int events)
             return M_SOCKET_ERROR;
     }
 
-    lm_iothr_check_completed(io);
+    lm_iothr_check_completed(t);
     return M_OK;
 }
 
@@ -831,66 +2123,50 @@ lm_iothr_fd_event(io_t *io, int fd, int events)
  * will be added.
  **/
 static M_CODE
-lm_iothr_check_pending(io_t *io)
+lm_iothr_check_pending(iothr_t *t)
 {
-    CURL *h;
-    int   x;
-
-    pthread_mutex_lock(&io->queue_mtx);
-    for (x=0; x<io->queue.size; x++) {
-#ifdef IO_DEBUG
-        fprintf(stderr, "* io:(%p) lm_iothr_check_pending: '%s', id: '%d'\n",
-                io,
-                io->queue.pos[x].url, io->queue.pos[x].identifier);
-#endif
-        ioprivate_t *tmp = malloc(sizeof(ioprivate_t));
-        if (!tmp)
-            break;
+    ioprivate_t *info;
+    int          x;
 
-        tmp->ioh = io->queue.pos[x].ioh;
-        tmp->identifier = io->queue.pos[x].identifier;
-
-        h = curl_easy_init();
-        curl_easy_setopt(h, CURLOPT_URL, io->queue.pos[x].url);
-        curl_easy_setopt(h, CURLOPT_PRIVATE, tmp);
-        curl_easy_setopt(h, CURLOPT_NOBODY, 1);
-        curl_easy_setopt(h, CURLOPT_WRITEFUNCTION, &lm_iothr_data_cb);
-        curl_easy_setopt(h, CURLOPT_USERAGENT, io->user_agent);
-        curl_easy_setopt(h, CURLOPT_ENCODING, "");
-        curl_easy_setopt(h, CURLOPT_FOLLOWLOCATION, 1);
-        if (io->proxy)
-            curl_easy_setopt(h, CURLOPT_PROXY, io->proxy);
-        if (io->verbose)
-            curl_easy_setopt(h, CURLOPT_VERBOSE, 1);
-        if (io->cookies)
-            curl_easy_setopt(h, CURLOPT_COOKIEFILE, "");
+    while ((info = lm_ring_pop(&t->ring))) {
 #ifdef IO_DEBUG
         fprintf(stderr, "* io:(%p) add handle %p, id: '%d'\n",
-                io, h, io->queue.pos[x].identifier);
+                t, info->handle, info->identifier);
 #endif
-        curl_multi_add_handle(io->multi_h, h);
+        curl_multi_add_handle(t->multi_h, info->handle);
+    }
+
+    if (t->queue.size) {
+        pthread_mutex_lock(&t->queue_mtx);
+        for (x=0; x<t->queue.size; x++)
+            curl_multi_add_handle(t->multi_h, t->queue.pos[x]->handle);
+        t->queue.size=0;
+        pthread_mutex_unlock(&t->queue_mtx);
     }
-    io->queue.size=0;
-    pthread_mutex_unlock(&io->queue_mtx);
 
     return M_OK;
 }
 
 /** 
- * Launch the I/O thread used for the multipeek loop. Note that
- * the i/o thread is not launched if running synchronously.
+ * Launch the I/O threads used for the multipeek loop. Note that
+ * no i/o thread is launched if running synchronously.
  **/
 M_CODE
 lm_iothr_launch(io_t *io)
 {
+    int x;
+
     if (!io->synchronous) {
-        if (pthread_create(&io->thr, 0, (void *(*)(void*))&lm_iothr_main, io) != 0)
-            return M_FAILED;
-        io->started = 1;
+        for (x=0; x<io->num_threads; x++) {
+            if (pthread_create(&io->threads[x].thr, 0,
+                        (void *(*)(void*))&lm_iothr_main, &io->threads[x]) != 0)
+                return M_FAILED;
+            io->started++;
+        }
     }
 
 #ifdef DEBUG
-    else fprintf(stderr, "* io:(%p) timer enabled, no I/O thread launched\n", io);
+    else fprintf(stderr, "* io:(%p) synchronous, no I/O thread launched\n", io);
 #endif
 
     return M_OK;
@@ -902,45 +2178,45 @@ lm_iothr_launch(io_t *io)
  * thread
  **/
 static void *
-lm_iothr_main(io_t *io)
+lm_iothr_main(iothr_t *t)
 {
     struct epoll_event msg_ev;
-    struct epoll_event events[8];
+    struct epoll_event events[EPOLL_EVENTS];
 
     int stop = 0;
     int n; /* num fds */
     int x;
-    int msg;
+    uint64_t v;
 
-    io->e_timeout = 10000;
+    t->e_timeout = 10000;
 
 #ifdef DEBUG
-    fprintf(stderr, "* io:(%p) started\n", io);
+    fprintf(stderr, "* io:(%p) started\n", t);
 #endif
-    io->prev_running = 0;
+    t->prev_running = 0;
 #ifdef IO_DEBUG
-    fprintf(stderr, "* io:(%p) waiting for events\n", io);
+    fprintf(stderr, "* io:(%p) waiting for events\n", t);
 #endif
 
-    if ((io->e_fd = epoll_create(1024)) < 0) {
-        LM_ERROR(io->m, "epoll_create failed");
+    if ((t->e_fd = epoll_create(1024)) < 0) {
+        LM_ERROR(t->io->m, "epoll_create failed");
         return 0;
     }
 
     /* add our messaging fd so we can start listening for messages
      * from the main thread*/
-    msg_ev.data.fd = io->msg_fd[0];
+    msg_ev.data.fd = t->ev_fd;
     msg_ev.events  = EPOLLIN;
-    if (epoll_ctl(io->e_fd, EPOLL_CTL_ADD, io->msg_fd[0], &msg_ev) != 0) {
-        LM_ERROR(io->m, "epoll_ctl failed");
+    if (epoll_ctl(t->e_fd, EPOLL_CTL_ADD, t->ev_fd, &msg_ev) != 0) {
+        LM_ERROR(t->io->m, "epoll_ctl failed");
         return 0;
     }
 
     while (!stop) {
-        n = epoll_wait(io->e_fd, events, 8, io->e_timeout);
+        n = epoll_wait(t->e_fd, events, EPOLL_EVENTS, t->e_timeout);
         
         if (n == 0) {
-            lm_iothr_timer_reached(io);
+            lm_iothr_timer_reached(t);
             continue;
         }
         if (n < 0) {
@@ -949,22 +2225,26 @@ lm_iothr_main(io_t *io)
             break;
         }
         for (x=0; x<n; x++) {
-            if (events[x].data.fd == io->msg_fd[0]) {
-                /* message received */
-                if ((read(events[x].data.fd, &msg, sizeof(int))) != sizeof(int)
-                        || msg == LM_IOMSG_STOP) {
+            if (events[x].data.fd == t->ev_fd) {
+                /* woken up by a worker or by lm_iothr_stop() */
+                if (read(t->ev_fd, &v, sizeof(uint64_t)) != sizeof(uint64_t)
+                        || t->stop) {
                     stop = 1;
                     break;
                 }
-                if (msg == LM_IOMSG_ADD)
-                    lm_iothr_check_pending(io);
+                /* clear the flag before looking at the ring, so that 
+                 * anything added after this point signals again */
+                t->signalled = 0;
+                __sync_synchronize();
+                lm_iothr_check_pending(t);
             } else
-                lm_iothr_fd_event(io, events[x].data.fd, events[x].events);
+                lm_iothr_fd_event(t, events[x].data.fd, events[x].events);
         }
     }
 
+    close(t->e_fd);
 #ifdef DEBUG
-    fprintf(stderr, "* io:(%p) stopped\n", io);
+    fprintf(stderr, "* io:(%p) stopped\n", t);
 #endif
     return 0;
 }
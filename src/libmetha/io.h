@@ -37,10 +37,26 @@
 #include <pthread.h>
 #include "errors.h"
 #include "url.h"
+#include "ring.h"
 
+/* ioprivate_t types */
 enum {
-    LM_IOMSG_ADD,
-    LM_IOMSG_STOP,
+    LM_IOPRIV_PEEK,
+    LM_IOPRIV_GET,
+};
+
+/* iostream_t states */
+enum {
+    LM_IOSTREAM_INIT,
+    LM_IOSTREAM_ACTIVE,
+    LM_IOSTREAM_DISCARD, /* redirect, the body is not passed on */
+};
+
+/* iopipe_t states */
+enum {
+    LM_IOPIPE_FREE,
+    LM_IOPIPE_RUNNING,
+    LM_IOPIPE_DONE,
 };
 
 /** 
@@ -54,8 +70,16 @@ typedef struct iostat {
         char *location;
         char *content_type;
     } headers;
+    unsigned int ttfb;      /* ms to the first byte of the response, 0 if not known */
+    uint8_t  unreachable;   /* the host could not be resolved or did not answer */
 } iostat_t;
 
+/** 
+ * A cap of 0 means that ptr points to memory not owned 
+ * by the buffer, such as a file mapped by lm_io_get(). 
+ * Such a buffer must not be grown or freed, a parser that 
+ * wants to replace the data must allocate a new buffer.
+ **/
 typedef struct iobuf {
     char *ptr;
     size_t sz;
@@ -69,83 +93,205 @@ typedef struct iobuf {
  * transfer later.
  *
  * ioh will be used internally by the IO-functions,
- * and then handle will be used externally by 
- * workers to get information. Before an ioprivate_t 
- * object is returned to a worker, handle will be 
- * set to the CURL handle used.
+ * and handle will be used externally by workers to
+ * get information. Each ioprivate_t owns its CURL
+ * handle, HEAD lookups take theirs from the pool in 
+ * io_t and must be given back to it through 
+ * lm_multipeek_release() once the worker is done.
  **/
 typedef struct ioprivate {
     int        identifier;
-    union {
-        struct iohandle *ioh;
-        CURL            *handle;
-    };
+    int        type;   /* LM_IOPRIV_* */
+    CURLcode   result; /* set by the IO-thread when done */
+    struct iohandle *ioh;
+    CURL            *handle;
 } ioprivate_t;
 
+/** 
+ * Destination of a transfer into an iobuf_t, keeps track 
+ * of the body size limit. See lm_io_sink_cb().
+ *
+ * If 'accept' is set, it is called with the Content-Type
+ * of a 2xx response before any data is stored. If it 
+ * returns 0 the transfer is aborted and 'rejected' is set,
+ * this is not treated as an error by lm_io_get().
+ **/
+typedef struct iosink {
+    iobuf_t    *buf;
+    CURL       *h;
+    struct io  *io;
+    size_t      max;      /* max body size, 0 means no limit */
+    size_t      received;
+    int         too_big;  /* set if the transfer was aborted because of max */
+    int         rejected; /* set if the transfer was aborted by accept */
+    int       (*accept)(struct iosink *s, const char *content_type);
+    void       *accept_data;
+} iosink_t;
+
+/** 
+ * One slot in the GET pipeline of an iohandle, see
+ * lm_multiget_add(). The slot owns its CURL handle 
+ * and buffer, the buffer is swapped with the 
+ * iohandle's primary buffer when picked up by
+ * lm_io_get().
+ **/
+typedef struct iopipe {
+    ioprivate_t  info; /* info.identifier is the slot index */
+    CURL        *h;
+    char        *url;
+    size_t       url_cap;
+    iobuf_t      buf;
+    iosink_t     sink;
+    int          state; /* LM_IOPIPE_* */
+} iopipe_t;
+
+/** 
+ * Used by lm_io_get_stream() to pass data on to a parser
+ * while it is being downloaded. 'cb' is called for each 
+ * chunk received, with all data not yet consumed by a 
+ * previous call prepended. cb should return the number of 
+ * bytes it consumed, the rest will be given to it again 
+ * together with the next chunk. When the transfer is done,
+ * cb is called a last time with 'eof' set, and must then 
+ * consume everything.
+ **/
+typedef struct iostream {
+    size_t (*cb)(struct iostream *, char *, size_t, int eof);
+    void            *data;  /* set by the owner, e.g. the worker */
+    void            *state; /* owned by cb */
+    int              status; /* LM_IOSTREAM_*, used internally */
+    struct iohandle *ioh;
+} iostream_t;
+
 typedef struct iohandle {
     CURL       *primary;
     struct io  *io;
     iobuf_t     buf;
+    iosink_t    sink;     /* for buf */
+    size_t      max_body; /* body size limit for the next lm_io_get() */
+    long        connect_timeout; /* ms for the next transfers, 0 for */
+    long        timeout;         /* curl's defaults, see ue_host_check() */
     iostat_t    transfer;
 
+    /* set while buf points into a mapped local file, 
+     * see lm_io_perform_file() and lm_io_unmap() */
+    struct {
+        void       *addr;
+        size_t      len;
+        iobuf_t     saved; /* the real buffer */
+    } map;
+
+    /* finished HEAD lookups, only touched by the worker */
     struct {
         ioprivate_t **list;
         size_t        count;
         size_t        allocsz;
     } done;
-    int waiting;
     int total; /* total transfers active/done */
     int provided;
-    pthread_mutex_t dcond_mtx;
-    pthread_cond_t  dcond;
+
+    struct {
+        iopipe_t     *slots;
+        int           count;   /* 0 if pipelining is disabled */
+        int           running; /* transfers not yet collected */
+    } pipeline;
+
+    /* finished transfers are pushed to 'ring' by the IO-threads, 
+     * or to 'overflow' if the ring is full. The worker moves them 
+     * on to 'done' or the pipeline slots, see lm_iohandle_drain() */
+    ring_t  ring;
+    struct {
+        ioprivate_t **list;
+        int           size;
+        int           allocsz;
+    } overflow;
+    pthread_mutex_t overflow_mtx;
+
+    /* the worker sleeps on ev_fd when 'waiting' is set */
+    int          ev_fd;
+    volatile int waiting;
 } iohandle_t;
 
-/* pos descriptor for the pending transfer queue */
-typedef struct ioqp {
-    int   identifier;
-    char *url;
-    iohandle_t *ioh; /* which handle added this url? */
-} ioqp_t;
+/* number of size classes in the buffer pool, the first 
+ * class holds buffers of at least 1 KB, the last one 
+ * buffers of at least 1 MB */
+#define LM_IO_POOL_CLASSES 11
+/* max number of buffers kept per size class */
+#define LM_IO_POOL_DEPTH   4
 
-typedef struct io {
-    M_CODE     error;
+/** 
+ * One IO-thread, with its own multi handle and epoll set. 
+ * Transfers are spread over the IO-threads by a hash of 
+ * their host name, see lm_io_shard(), so that all transfers
+ * to one host end up in the same connection cache.
+ **/
+typedef struct iothr {
+    struct io *io;
     CURLM     *multi_h;
-    CURLSH    *share_h;
     pthread_t  thr;
-    int        started;
-
-    struct metha *m;
 
-    /* pipe used for communicating with the IO-thread, see
-     * LM_IOMSG_* */
-    int msg_fd[2];
+    /* eventfd used for waking up the IO-thread, writes are 
+     * coalesced through 'signalled', see lm_io_notify() */
+    int          ev_fd;
+    volatile int signalled;
+    volatile int stop;
     int e_fd;
     int e_timeout;
 
-    /* timer */
-    int          synchronous;
-    clock_t      timer_last;
-    unsigned int timer_wait;
-    unsigned int timer_wait_mp;
-
     /* running transfers */
     int        prev_running;
     int        nrunning;
 
+    /* transfers to add, pushed by the workers. 'queue' is
+     * only used when the ring is full */
+    ring_t     ring;
     struct {
-        ioqp_t *pos;
+        ioprivate_t **pos;
         int size;
         int allocsz;
     } queue;
 
     pthread_mutex_t queue_mtx;
+} iothr_t;
+
+typedef struct io {
+    M_CODE     error;
+    CURLSH    *share_h;
+    int        started; /* number of IO-threads launched */
+
+    struct metha *m;
+
+    int          synchronous;
+
+    iothr_t     *threads;
+
+    /* recycled HEAD lookup handles, see lm_io_pool_get() */
+    struct {
+        ioprivate_t **list;
+        int size;
+        int allocsz;
+    } pool;
+
+    /* unused data buffers by size class, see lm_io_buf_acquire() */
+    struct {
+        char   *ptr[LM_IO_POOL_DEPTH];
+        size_t  cap[LM_IO_POOL_DEPTH];
+        int     count;
+    } bufpool[LM_IO_POOL_CLASSES];
+
+    pthread_mutex_t pool_mtx;
+    pthread_mutex_t bufpool_mtx;
     pthread_rwlock_t share_mtx;
     pthread_rwlock_t cookies_mtx;
     pthread_rwlock_t dns_mtx;
+    pthread_rwlock_t ssl_mtx;     /* TLS session cache */
+    pthread_rwlock_t connect_mtx; /* connection cache */
 
     /* options */
     int         cookies;
     int         verbose;
+    int         num_pipelines; /* max concurrent GETs per worker */
+    int         num_threads;   /* number of IO-threads */
     const char *user_agent; /* free()'d externally */
     const char *proxy;
 } io_t;
@@ -157,11 +303,15 @@ struct ioev_t {
 iohandle_t *lm_iohandle_obtain(io_t *io);
 void        lm_iohandle_destroy(iohandle_t *ioh);
 M_CODE      lm_io_get(iohandle_t *h, url_t *url);
+M_CODE      lm_io_get_stream(iohandle_t *h, url_t *url, iostream_t *st);
 M_CODE      lm_io_head(iohandle_t *h, url_t *url);
 M_CODE      lm_io_save(iohandle_t *h, url_t *url, const char *name);
 M_CODE      lm_iothr_stop(io_t *io);
 M_CODE      lm_io_provide(iohandle_t *h, const char *buf, size_t len);
 
+void        lm_io_buf_shrink(io_t *io, iobuf_t *b);
+void        lm_io_done(iohandle_t *h);
+
 int lm_io_data_cb(char *ptr, size_t size, size_t nmemb, void *s);
 
 #endif
@@ -41,6 +41,18 @@ typedef enum {
     LMOPT_ERROR_FUNCTION,
     LMOPT_WARNING_FUNCTION,
     LMOPT_EV_FUNCTION,
+    LMOPT_NUM_PIPELINES,
+    LMOPT_HOST_DELAY,
+    LMOPT_HOST_MAX_CONNECTIONS,
+    LMOPT_IO_THREADS,
+    LMOPT_URL_FILTER_SIZE,
+    LMOPT_FRONTIER_MEMORY,
+    LMOPT_SPILL_DIR,
+    LMOPT_HOST_ORDER,
+    LMOPT_HOST_SCORE_FUNCTION,
+    LMOPT_FRONTIER_PACK,
+    LMOPT_HOST_TIMEOUT,
+    LMOPT_HOST_MAX_FAILURES,
 } LMOPT;
 
 #endif
@@ -68,23 +68,38 @@ static JSClass global_jsclass = {
     JSCLASS_NO_OPTIONAL_MEMBERS
 };
 
+/* per-host politeness presets for LMOPT_MODE */
 static struct {
     const char *ident;
-    unsigned int timer_wait;
-    unsigned int timer_wait_mp;
-} timer_vals[] = {
-    {"aggressive", 0, 0},
-    {"friendly",  10, 2},
-    {"coward",    30, 5},
+    unsigned int delay;      /* ms */
+    unsigned int delay_peek; /* ms */
+    unsigned int max_active;
+} mode_vals[] = {
+    {"aggressive",     0,    0, 0},
+    {"friendly",   10000, 2000, 1},
+    {"coward",     30000, 5000, 1},
 };
 
+/* values for LMOPT_HOST_ORDER */
+static struct {
+    const char *ident;
+    int         order;
+} order_vals[] = {
+    {"inlinks", UE_ORDER_INLINKS},
+    {"backlog", UE_ORDER_BACKLOG},
+    {"fifo",    UE_ORDER_FIFO},
+    {"lifo",    UE_ORDER_LIFO},
+};
+#define NUM_ORDER_VALS (sizeof(order_vals)/sizeof(order_vals[0]))
+
 static wfunction_t
 m_builtin_parsers[] = {
     {
         .type    = LM_WFUNCTION_TYPE_NATIVE,
         .purpose = LM_WFUNCTION_PURPOSE_PARSER,
         .name = "html",
-        .fn.native_parser = &lm_parser_html
+        .fn.native_parser = &lm_parser_html,
+        .native_stream = &lm_parser_html_stream
     }, {
         .type    = LM_WFUNCTION_TYPE_NATIVE,
         .purpose = LM_WFUNCTION_PURPOSE_PARSER,
@@ -149,6 +164,8 @@ filetype_class =
         LMC_OPT_STRING("crawler_switch", offsetof(filetype_t, switch_to.name)),
         LMC_OPT_ARRAY("attributes", &lm_filetype_set_attributes),
         LMC_OPT_FLAG("ignore_host", FT_FLAG_IGNORE_HOST),
+        LMC_OPT_FLAG("streaming", FT_FLAG_STREAMING),
+        LMC_OPT_UINT("max_body_size", offsetof(filetype_t, max_body_size)),
         LMC_OPT_END,
     }
 };
@@ -174,11 +191,16 @@ crawler_class =
         LMC_OPT_FLAG("external", LM_CRFLAG_EXTERNAL),
         LMC_OPT_UINT("external_peek", offsetof(crawler_t, peek_limit)),
         LMC_OPT_UINT("depth_limit", offsetof(crawler_t, depth_limit)),
+        LMC_OPT_UINT("max_body_size", offsetof(crawler_t, max_body_size)),
         LMC_OPT_STRING("initial_filetype", offsetof(crawler_t, initial_filetype.name)),
         LMC_OPT_STRING("init", offsetof(crawler_t, init)),
         LMC_OPT_FLAG("spread_workers", LM_CRFLAG_SPREAD_WORKERS),
         LMC_OPT_FLAG("jail", LM_CRFLAG_JAIL),
         LMC_OPT_FLAG("robotstxt", LM_CRFLAG_ROBOTSTXT),
+        LMC_OPT_FLAG("get_lookup", LM_CRFLAG_GET_LOOKUP),
+        LMC_OPT_FLAG("url_fingerprints", LM_CRFLAG_FINGERPRINTS),
+        LMC_OPT_ARRAY("strip_params", &lm_crawler_set_strip_params),
+        LMC_OPT_UINT("sort_params", offsetof(crawler_t, canon.sort)),
         LMC_OPT_STRING("default_handler", offsetof(crawler_t, default_handler.name)),
         LMC_OPT_END,
     }
@@ -201,14 +223,10 @@ lmetha_setopt(metha_t *m, LMOPT opt, ...)
         case LMOPT_MODE:
             arg = va_arg(ap, char *);
             for (x=0; x<3; x++) {
-                if (strcasecmp(arg, timer_vals[x].ident) == 0) {
-                    if (timer_vals[x].timer_wait) {
-                        m->io.synchronous = 1;
-                        m->io.timer_wait = timer_vals[x].timer_wait*CLOCKS_PER_SEC;
-                        m->io.timer_wait_mp = timer_vals[x].timer_wait_mp*CLOCKS_PER_SEC;
-                        m->io.timer_last = (clock_t)-1;
-                    } else
-                        m->io.synchronous = 0;
+                if (strcasecmp(arg, mode_vals[x].ident) == 0) {
+                    m->ue.host_delay      = mode_vals[x].delay;
+                    m->ue.host_delay_peek = mode_vals[x].delay_peek;
+                    m->ue.host_max_active = mode_vals[x].max_active;
                     break;
                 }
             }
@@ -224,11 +242,14 @@ lmetha_setopt(metha_t *m, LMOPT opt, ...)
             if (m->builtin_parsers)
                 break;
             m->builtin_parsers = 1;
-            for (x=0; x<LM_NUM_BUILTIN_PARSERS; x++)
-                lmetha_add_wfunction(m, m_builtin_parsers[x].name,
+            for (x=0; x<LM_NUM_BUILTIN_PARSERS; x++) {
+                if (lmetha_add_wfunction(m, m_builtin_parsers[x].name,
                                      m_builtin_parsers[x].type,
                                      m_builtin_parsers[x].purpose,
-                                     m_builtin_parsers[x].fn.native_parser);
+                                     m_builtin_parsers[x].fn.native_parser) == M_OK)
+                    m->functions[m->num_functions-1]->native_stream
+                        = m_builtin_parsers[x].native_stream;
+            }
             break;
 
         case LMOPT_NUM_THREADS:
@@ -287,6 +308,125 @@ lmetha_setopt(metha_t *m, LMOPT opt, ...)
             m->io.cookies = va_arg(ap, int);
             break;
 
+            /** 
+             * Max number of concurrent GET transfers per 
+             * worker, 1 or less disables pipelining
+             **/
+        case LMOPT_NUM_PIPELINES:
+            m->io.num_pipelines = va_arg(ap, int);
+            break;
+
+            /** 
+             * Minimum time in milliseconds between two transfers 
+             * to the same host, overrides the value set by LMOPT_MODE
+             **/
+        case LMOPT_HOST_DELAY:
+            m->ue.host_delay = va_arg(ap, unsigned int);
+            break;
+
+            /** 
+             * Max number of concurrent transfers to the same 
+             * host, 0 means no limit
+             **/
+        case LMOPT_HOST_MAX_CONNECTIONS:
+            m->ue.host_max_active = va_arg(ap, unsigned int);
+            break;
+
+            /** 
+             * Max time in milliseconds for a transfer. Once set,
+             * the timeouts of each host are shortened from its
+             * response times and failures, see ue_host_check()
+             **/
+        case LMOPT_HOST_TIMEOUT:
+            m->ue.host_timeout = va_arg(ap, unsigned int);
+            break;
+
+            /** 
+             * Number of transfers in a row a host may fail to 
+             * answer before its URLs are put off for a while, 
+             * 0 means never
+             **/
+        case LMOPT_HOST_MAX_FAILURES:
+            m->ue.host_max_failures = va_arg(ap, unsigned int);
+            break;
+
+            /** 
+             * Number of IO-threads running HEAD lookups and 
+             * pipelined GETs, transfers are spread over them by 
+             * host name
+             **/
+        case LMOPT_IO_THREADS:
+            m->io.num_threads = va_arg(ap, int);
+            break;
+
+            /** 
+             * Number of URL fingerprints kept by the lock-free 
+             * pre-filter in front of the per-host URL caches, 
+             * 0 disables it
+             **/
+        case LMOPT_URL_FILTER_SIZE:
+            if (ue_set_filter_size(&m->ue, va_arg(ap, unsigned int)) != M_OK)
+                goto fail;
+            break;
+
+            /** 
+             * Memory budget in kilobytes for URLs waiting to be 
+             * crawled, once it is exceeded URL lists are moved to 
+             * disk. 0 means no limit.
+             **/
+        case LMOPT_FRONTIER_MEMORY:
+            m->ue.frontier.budget = (size_t)va_arg(ap, unsigned int)*1024;
+            break;
+
+            /** 
+             * Directory for the files of LMOPT_FRONTIER_MEMORY, 
+             * defaults to $TMPDIR or /tmp
+             **/
+        case LMOPT_SPILL_DIR:
+            if (lm_spill_set_dir(&m->ue.frontier.disk, va_arg(ap, char*)) != M_OK)
+                goto fail;
+            break;
+
+            /** 
+             * Keep URL lists that are waiting to be crawled front 
+             * coded in memory, host lists once they reach 256 URLs
+             * and utable levels below the one being crawled. Costs
+             * some CPU when the URLs are decoded again.
+             **/
+        case LMOPT_FRONTIER_PACK:
+            m->ue.frontier.pack = va_arg(ap, int);
+            break;
+
+            /** 
+             * Order in which hosts found by external crawlers are
+             * crawled, one of "inlinks" (default), "backlog", 
+             * "fifo" and "lifo"
+             **/
+        case LMOPT_HOST_ORDER:
+            arg = va_arg(ap, char *);
+            for (x=0; x<NUM_ORDER_VALS; x++) {
+                if (strcasecmp(arg, order_vals[x].ident) == 0) {
+                    m->ue.pending.order = order_vals[x].order;
+                    break;
+                }
+            }
+            if (x == NUM_ORDER_VALS)
+                goto badarg;
+            break;
+
+            /** 
+             * Score hosts with a function of our own, hosts with 
+             * higher scores are crawled first. The function is 
+             * called as fn(m, host, inlinks, backlog), from any
+             * worker thread.
+             **/
+        case LMOPT_HOST_SCORE_FUNCTION:
+            m->ue.pending.score_cb  = va_arg(ap, unsigned int (*)(void *, const char *,
+                                                                  unsigned int, unsigned int));
+            m->ue.pending.score_arg = m;
+            m->ue.pending.order     = UE_ORDER_CUSTOM;
+            break;
+
             /** 
              * The status function will be called whenever a worker
              * crawls a new URL.
@@ -802,7 +942,7 @@ stop_worker_threads(metha_t *m)
     /* Wait for all threads to exit and clean up */
     for (x=0; x<m->nworkers; x++) {
         pthread_join(m->workers[x]->thr, 0);
-        free(w);
+        free(m->workers[x]);
     }
 
     if (m->nworkers) {
@@ -842,7 +982,9 @@ start_worker_threads(metha_t *m, int argc,
         if (m->ueh_save) {
             h = m->ueh_save;
             m->ueh_save = 0;
-        } else {
+        } else if (x < argc || !(h = ue_handle_unpark(&m->ue))) {
+            /* workers without initial URLs continue where
+             * the workers of an earlier session stopped */
             h = ue_handle_obtain(&m->ue);
         }
 
@@ -957,7 +1099,7 @@ lmetha_prepare(metha_t *m)
     /* Make sure no more than 1 worker thread is launched if running synchronously */
     if (m->io.synchronous) {
         if (m->num_threads != 1)
-            LM_WARNING(m, "worker count must be 1 when running with timer");
+            LM_WARNING(m, "worker count must be 1 when running synchronously");
         m->num_threads = 1;
     } else {
         if (!m->num_threads)
@@ -1398,6 +1540,7 @@ lmetha_add_wfunction(metha_t *m, const char *name, uint8_t type,
     wf->type = type;
     wf->purpose = purpose;
     wf->name = strdup(name);
+    wf->native_stream = 0;
     switch (type) {
         case LM_WFUNCTION_TYPE_NATIVE:
             wf->fn.native_parser = va_arg(ap, void*);
@@ -1618,12 +1761,56 @@ lmetha_signal(metha_t *m, int sig)
 M_CODE
 lmetha_reset(metha_t *m)
 {
+    uint32_t gen;
+    ue_t     opts;
+    char    *spill_dir;
+    unsigned int filter_size;
+    M_CODE   r;
+
 #ifdef DEBUG
     fprintf(stderr, "* metha:(%p) reset\n", m);
 #endif
+
+    /* the saved handle holds host entries that are about 
+     * to be freed */
+    if (m->ueh_save) {
+        ue_handle_free(m->ueh_save);
+        m->ueh_save = 0;
+    }
+
+    /* the options set through lmetha_setopt() live in m->ue
+     * too, they must survive the reset, the spill directory
+     * is taken away before ue_uninit() frees it */
+    memcpy(&opts, &m->ue, sizeof(ue_t));
+    spill_dir = m->ue.frontier.disk.dir;
+    m->ue.frontier.disk.dir = 0;
+    filter_size = m->ue.filter.slots ? (m->ue.filter.mask+1)*UE_FILTER_WAYS : 0;
+
     ue_uninit(&m->ue);
+    /* keep the generation of the host table going, so that
+     * no host cache outliving the reset is taken as valid */
+    gen = m->ue.hosts.gen;
     memset(&m->ue, 0, sizeof(ue_t));
-    ue_init(&m->ue);
+    r = ue_init(&m->ue);
+    m->ue.hosts.gen = gen;
+
+    m->ue.host_delay        = opts.host_delay;
+    m->ue.host_delay_peek   = opts.host_delay_peek;
+    m->ue.host_max_active   = opts.host_max_active;
+    m->ue.host_timeout      = opts.host_timeout;
+    m->ue.host_max_failures = opts.host_max_failures;
+    m->ue.frontier.budget   = opts.frontier.budget;
+    m->ue.frontier.pack     = opts.frontier.pack;
+    m->ue.pending.order     = opts.pending.order;
+    m->ue.pending.score_cb  = opts.pending.score_cb;
+    m->ue.pending.score_arg = opts.pending.score_arg;
+    m->ue.frontier.disk.dir = spill_dir;
+
+    if (r != M_OK)
+        return r;
+
+    if (filter_size != UE_FILTER_SIZE)
+        return ue_set_filter_size(&m->ue, filter_size);
 
     return M_OK;
 }
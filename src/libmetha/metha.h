@@ -188,6 +188,9 @@ M_CODE lm_get(struct crawler *c, url_t *url, iostat_t *stat);
 M_CODE lm_peek(struct crawler *c, url_t *url, iostat_t *stat);
 M_CODE lm_multipeek_add(iohandle_t *ioh, url_t *url, int id);
 ioprivate_t* lm_multipeek_wait(iohandle_t *ioh);
+void   lm_multipeek_release(iohandle_t *ioh, ioprivate_t *info);
+M_CODE lm_multiget_add(iohandle_t *ioh, url_t *url, size_t max_body);
+void   lm_multiget_retain(iohandle_t *ioh, url_t **urls, int num);
 
 /* errors.c */
 void lm_default_status_reporter(metha_t *, struct worker *, url_t *);
@@ -198,5 +201,9 @@ void lm_default_warning_reporter(metha_t *, const char *s, ...);
 /* events.c */
 void lm_default_event_handler(metha_t *m, unsigned ev);
 
+/* checkpoint.c */
+M_CODE lmetha_checkpoint(metha_t *m, const char *file);
+M_CODE lmetha_resume(metha_t *m, const char *file);
+
 #endif
 
@@ -40,6 +40,14 @@
  * This table is not used for mime types and file extensions 
  * anymore, because those suffice better in tiny hash tables.
  *
+ * The children of a node are kept in a sorted array along 
+ * with a 64-bit bitmap of which characters are present, so 
+ * a child is found with a single popcount. All nodes, 
+ * branch arrays, leaves and conns of one table are allocated
+ * from an arena owned by the table. Freed blocks are kept in 
+ * per-size free lists and reused, and the whole table is 
+ * freed at once by mtrie_cleanup().
+ *
  * http://bithack.se/projects/methabot/docs/mtrie.html
  **/
 
@@ -49,10 +57,12 @@
 
 /*#define MTRIE_DEBUG*/
 
+/* the character of each 6-bit value, see MTRIE_OFFS() */
+const char mtrie_decodetbl[] = " !_#$%&'()*+,-./0123456789:;<=>?`abcdefghijklmnopqrstuvwxyz{|}~";
+
 #ifdef MTRIE_DEBUG
 #include <stdio.h>
 #define _DEBUG(x, ...) fprintf(stderr, "* " x "\n", __VA_ARGS__)
-static const char decodetbl[] = " !_#$%&'()*+,-./0123456789:;<=>?`abcdefghijklmnopqrstuvwxyz{|}~";
 #else
 #define _DEBUG(x, ...)
 #endif
@@ -63,12 +73,45 @@ static const char decodetbl[] = " !_#$%&'()*+,-./0123456789:;<=>?`abcdefghijklmn
 
 #define inl_   static inline
 typedef struct mtrie_node   NODE;
-typedef struct mtrie_br_pos BRANCH;
+typedef struct mtrie_br     BRANCH;
 typedef struct mtrie_leaf   LEAF;
 typedef struct mtrie_conn   CONN;
 
-static void br_free(NODE *n);
-static void node_free(NODE *n);
+/* 6-bit value of a character, see MTRIE_OFFS() */
+#define CHR(x)       (MTRIE_OFFS(x) & 0x3f)
+#define BR_SIZE(n)   (sizeof(BRANCH)+(n)*sizeof(NODE))
+#define LEAF_SIZE(n) (sizeof(LEAF)+(n))
+#define CONN_SIZE(n) (sizeof(CONN)+(n))
+
+#define ARENA_ALIGN     8
+#define ARENA_MAX       256 /* larger blocks are malloc()'d one by one */
+#define ARENA_CLASSES   (ARENA_MAX/ARENA_ALIGN)
+#define ARENA_CHUNK_MIN 256
+#define ARENA_CHUNK_MAX (64*1024)
+#define ARENA_ROUND(x)  (((x)+ARENA_ALIGN-1) & ~(size_t)(ARENA_ALIGN-1))
+
+struct mtrie_chunk {
+    struct mtrie_chunk *next;
+    size_t              size;
+    uint64_t            data[];
+};
+
+/* header of blocks larger than ARENA_MAX */
+struct mtrie_big {
+    struct mtrie_big *prev;
+    struct mtrie_big *next;
+};
+
+struct mtrie_arena {
+    struct mtrie_chunk *chunks; /* the first one is the current */
+    size_t              used;   /* bytes used of the current chunk */
+    void               *free[ARENA_CLASSES]; /* by size/ARENA_ALIGN-1 */
+    struct mtrie_big   *big;
+};
+
+static void *mtrie_alloc(mtrie_t *p, size_t sz);
+static void  mtrie_free(mtrie_t *p, void *ptr, size_t sz);
+static void *mtrie_resize(mtrie_t *p, void *ptr, size_t old, size_t sz);
 
 mtrie_t *
 mtrie_create(void)
@@ -88,117 +131,278 @@ mtrie_destroy(mtrie_t* p)
     free(p);
 }
 
-inl_ NODE*
-mtrie_next(NODE *n, BRANCH *p, char count, char c)
+/**
+ * Clean up the whole table, free all allocated buffers. The
+ * table is left empty and can be used again.
+ **/
+void
+mtrie_cleanup(mtrie_t *p)
+{
+    struct mtrie_chunk *c, *cn;
+    struct mtrie_big   *b, *bn;
+
+    if (p->arena) {
+        for (c = p->arena->chunks; c; c = cn) {
+            cn = c->next;
+            free(c);
+        }
+        for (b = p->arena->big; b; b = bn) {
+            bn = b->next;
+            free(b);
+        }
+        free(p->arena);
+    }
+
+    memset(p, 0, sizeof(mtrie_t));
+}
+
+/** 
+ * Allocate a block of 'sz' bytes from the table's arena. 
+ * Blocks are taken from the free list of their size class 
+ * if possible, otherwise from the end of the current chunk.
+ * Chunks start small and double in size, since most hosts 
+ * only ever see a handful of URLs.
+ **/
+static void *
+mtrie_alloc(mtrie_t *p, size_t sz)
 {
-    char top  = count-1;
-    int  x;
-
-    if (!p)
-        goto add;
-    if (c < p[0].c) {
-        x = 0;
-        goto add;
+    struct mtrie_arena *a;
+    struct mtrie_chunk *c;
+    struct mtrie_big   *b;
+    size_t              rem, csz;
+    void               *r;
+
+    if (!(a = p->arena)) {
+        if (!(a = p->arena = calloc(1, sizeof(struct mtrie_arena))))
+            return 0;
+    }
+
+    sz = ARENA_ROUND(sz);
+
+    if (sz > ARENA_MAX) {
+        if (!(b = malloc(sizeof(struct mtrie_big)+sz)))
+            return 0;
+        b->prev = 0;
+        if ((b->next = a->big))
+            b->next->prev = b;
+        a->big = b;
+        return b+1;
     }
-    if (c > p[(int)top].c) {
-        x = count;
-        goto add;
+
+    if ((r = a->free[sz/ARENA_ALIGN-1])) {
+        a->free[sz/ARENA_ALIGN-1] = *(void**)r;
+        return r;
     }
-#if 0
-    if (count < 4) {
-#endif
-        for (x=0; x<count; x++) {
-            if (p[x].c == c)
-                return &p[x].node;
-            else if (p[x].c > c) {
-                /* insert this one at x */
-                goto add;
+
+    c = a->chunks;
+    if (!c || a->used+sz > c->size) {
+        csz = ARENA_CHUNK_MIN;
+        if (c) {
+            /* give what is left of the current chunk to the free lists */
+            if ((rem = c->size-a->used) >= ARENA_ALIGN) {
+                r = (char*)c->data+a->used;
+                *(void**)r = a->free[rem/ARENA_ALIGN-1];
+                a->free[rem/ARENA_ALIGN-1] = r;
             }
+            if ((csz = c->size*2) > ARENA_CHUNK_MAX)
+                csz = ARENA_CHUNK_MAX;
         }
-        /* temporarily disable optimization code.
-         * TODO: fix the code so it doesn't crash,
-         * we need a faster lookup. */
-#if 0
-    } else {
-        if (!(y = (c - p[0].c)))
-            return &p[0].node;
-        /* estimate where in the array this char is */
-        x = (y/((p[top].c - p[0].c)/count));
-        if (x >= count)
-            x = count-1;
-        if (p[x].c > c) {
-            /* loop downwards */
-            for (x--; x>=0; x--) {
-                if (p[x].c == c)
-                    return &p[x].node;
-                if (p[x].c < c) {
-                    x++;
-                    goto add;
-                }
-            }
-        } else if (p[x].c < c) {
-            /* loop upwards */
-            for (x++; x<count; x++) {
-                if (p[x].c == c)
-                    return &p[x].node;
-                if (p[x].c > c)
-                    goto add;
-            }
-        } else
-            return &p[x].node;
+
+        if (!(c = malloc(sizeof(struct mtrie_chunk)+csz)))
+            return 0;
+
+        _DEBUG("arena:(%p) new chunk of %d bytes", a, (int)csz);
+        c->size   = csz;
+        c->next   = a->chunks;
+        a->chunks = c;
+        a->used   = 0;
     }
-#endif
 
-add:
-    _DEBUG("branch:(%p) realloc(), new address is:", p);
-    p = realloc(p, sizeof(struct mtrie_br_pos)*(count+1));
-    _DEBUG("-- %p", p);
-    if (x != count)
-        memmove(p+x+1, p+x, (count-x)*sizeof(struct mtrie_br_pos));
-    p[x].c = c;
-    p[x].node.magic = 0;
-    p[x].node.next = 0;
-    n->next = p;
-    n->magic++;
-    _DEBUG("branch:(%p) added char '%c' (%hhd)", p, decodetbl[c], c);
-
-    return &p[x].node;
+    r = (char*)c->data+a->used;
+    a->used += sz;
+
+    return r;
 }
 
+/** 
+ * Give a block of 'sz' bytes back to the arena
+ **/
 static void
-node_free(NODE *n)
+mtrie_free(mtrie_t *p, void *ptr, size_t sz)
 {
-    if (n->magic & 0x80) {
-        if (n->magic & 0x3f)
-            free(n->next); /* free leaf */
-        else {
-            br_free(&((CONN*)n->next)->node);
-            free(n->next);
-        }
-    } else 
-        br_free(n);
+    struct mtrie_arena *a = p->arena;
+    struct mtrie_big   *b;
+
+    sz = ARENA_ROUND(sz);
+
+    if (sz > ARENA_MAX) {
+        b = (struct mtrie_big*)ptr-1;
+        if (b->prev)
+            b->prev->next = b->next;
+        else
+            a->big = b->next;
+        if (b->next)
+            b->next->prev = b->prev;
+        free(b);
+        return;
+    }
+
+    *(void**)ptr = a->free[sz/ARENA_ALIGN-1];
+    a->free[sz/ARENA_ALIGN-1] = ptr;
 }
 
-static void
-br_free(NODE *n)
+/** 
+ * Like realloc(), for blocks in the arena. If a block can not 
+ * be shrunk, the old one is kept. Returns 0 if out of memory.
+ **/
+static void *
+mtrie_resize(mtrie_t *p, void *ptr, size_t old, size_t sz)
 {
-    int x;
-    int v = n->magic & 0x3f;
-    for (x=0; x<v; x++)
-        node_free(&n->next[x].node);
-    free(n->next);
+    void *r;
+
+    if (ARENA_ROUND(old) == ARENA_ROUND(sz))
+        return ptr;
+
+    if (!(r = mtrie_alloc(p, sz)))
+        return (sz < old ? ptr : 0);
+
+    memcpy(r, ptr, (sz < old ? sz : old));
+    mtrie_free(p, ptr, old);
+
+    return r;
 }
 
-/**
- * Clean up the whole table, free all allocated buffers
+/** 
+ * Find the child of the branch node n for the character c, 
+ * or add it. The branch array grows in powers of two, so 
+ * it is only reallocated when its size reaches one.
  **/
-void
-mtrie_cleanup(mtrie_t *p)
+inl_ NODE*
+mtrie_next(mtrie_t *p, NODE *n, uint8_t c)
 {
-    NODE *n;
-    
-    n = &p->entry;
-    node_free(n);
+    BRANCH   *br  = (BRANCH*)n->next;
+    uint64_t  bit = (uint64_t)1 << c;
+    int       x, count;
+
+    x = __builtin_popcountll(br->map & (bit-1));
+
+    if (br->map & bit)
+        return &br->pos[x];
+
+    count = __builtin_popcountll(br->map);
+    if (!(count & (count-1))) {
+        /* the array is full */
+        if (!(br = mtrie_resize(p, br, BR_SIZE(count), BR_SIZE(count*2))))
+            return 0;
+        _DEBUG("branch:(%p) grown to %d", br, count*2);
+        n->next = br;
+    }
+
+    if (x != count)
+        memmove(&br->pos[x+1], &br->pos[x], (count-x)*sizeof(NODE));
+    br->pos[x].magic = 0;
+    br->pos[x].next  = 0;
+    br->map |= bit;
+    _DEBUG("branch:(%p) added char '%c' (%hhd)", br, mtrie_decodetbl[c], c);
+
+    return &br->pos[x];
+}
+
+/** 
+ * The leaf or conn of node n differs from the string being 
+ * added at position x, where the string has the character c1.
+ * Split it into a branch with two children, one for the rest
+ * of the leaf or conn and one for c1. If x is not 0, the part
+ * before x is kept in a new conn. Returns the (empty) node 
+ * for c1, or 0 if out of memory.
+ **/
+static NODE *
+mtrie_split(mtrie_t *p, NODE *n, uint_fast16_t x, uint8_t c1)
+{
+    BRANCH  *br;
+    CONN    *pre = 0;
+    CONN    *conn;
+    LEAF    *leaf;
+    NODE     rest;
+    char    *s2;
+    uint16_t sz;
+    uint8_t  c2;
+    int      v;
+
+    if (!(br = mtrie_alloc(p, BR_SIZE(2))))
+        return 0;
+    if (x && !(pre = mtrie_alloc(p, CONN_SIZE(x)))) {
+        mtrie_free(p, br, BR_SIZE(2));
+        return 0;
+    }
+
+    if (n->magic & MTRIE_LEAF) {
+        leaf = (LEAF*)n->next;
+        s2   = leaf->s;
+        sz   = leaf->sz;
+    } else {
+        conn = (CONN*)n->next;
+        s2   = conn->s;
+        sz   = conn->sz;
+    }
+
+    c2 = s2[x] & 0x3f;
+    rest.magic = s2[x] & MTRIE_MATCH;
+
+    if (pre) {
+        memcpy(pre->s, s2, x);
+        pre->sz = x;
+        pre->node.magic = 0;
+        pre->node.next  = br;
+    }
+
+    /* move whatever is left after x down below c2 */
+    if (n->magic & MTRIE_LEAF) {
+        _DEBUG("leaf:(%p) split at char '%c', leaf-pos %d",
+                leaf, mtrie_decodetbl[c2], (int)x);
+        if (x == sz-1) {
+            /* the end of a leaf is always a match */
+            mtrie_free(p, leaf, LEAF_SIZE(sz));
+            rest.magic = MTRIE_MATCH;
+            rest.next  = 0;
+        } else {
+            leaf->sz = sz-x-1;
+            memmove(leaf->s, leaf->s+x+1, leaf->sz);
+            rest.magic |= MTRIE_MULTI | MTRIE_LEAF;
+            rest.next   = mtrie_resize(p, leaf, LEAF_SIZE(sz), LEAF_SIZE(sz-x-1));
+        }
+    } else {
+        if (x == sz-1) {
+            /* nothing left of the conn but the node it leads to */
+            rest.magic |= conn->node.magic;
+            rest.next   = conn->node.next;
+            mtrie_free(p, conn, CONN_SIZE(sz));
+        } else {
+            conn->sz = sz-x-1;
+            memmove(conn->s, conn->s+x+1, conn->sz);
+            rest.magic |= MTRIE_MULTI;
+            rest.next   = mtrie_resize(p, conn, CONN_SIZE(sz), CONN_SIZE(sz-x-1));
+        }
+    }
+
+    if (pre) {
+        n->magic = (n->magic & MTRIE_MATCH) | MTRIE_MULTI;
+        n->next  = pre;
+    } else {
+        n->magic &= MTRIE_MATCH;
+        n->next   = br;
+    }
+
+    /* sort the two nodes */
+    v = (c1 > c2);
+    br->map = ((uint64_t)1 << c1) | ((uint64_t)1 << c2);
+    br->pos[v].magic = 0;
+    br->pos[v].next  = 0;
+    br->pos[!v] = rest;
+    _DEBUG("branch:(%p) new with [0] = '%c', [1] = '%c'",
+            br, mtrie_decodetbl[v?c2:c1], mtrie_decodetbl[v?c1:c2]);
+
+    return &br->pos[v];
 }
 
 /** 
@@ -216,175 +420,180 @@ mtrie_cleanup(mtrie_t *p)
 int
 mtrie_tryadd(mtrie_t *p, url_t *url)
 {
-    NODE *n;
-    uint8_t       v; /* current char, converted through MTRIE_OFFS() */
+    NODE         *n;
+    LEAF         *leaf;
+    uint8_t       c1;
     uint_fast16_t x, y;
-    const char *s;
-    const char *e;
-    uint16_t   sz;
+    const char   *s;
+    const char   *e;
+    char         *s2;
+    uint16_t      sz;
 
-    /*
-    s = url->str;
-    e = url->str+url->sz;
-    */
     s = url->str+url->host_o;
     e = url->str+url->sz;
     n = &p->entry;
 
-cont:for (;;) {
+    for (;;) {
         if (s == e) {
-            if (n->magic & 0x40)
+            if (n->magic & MTRIE_MATCH)
                 return 0;
-            n->magic |= 0x40;
+            n->magic |= MTRIE_MATCH;
             return 1;
         }
 
-        v = n->magic & 0x3f;
-        if (n->magic & 0x80) {
+        if (n->magic & MTRIE_MULTI) {
             /* this is a multi-char connection between one 
              * leaf or many nodes */
-            char     *s2;
-            void     *next = (void*)n->next;
-            int       leaf; /* leaf or conn */
-
-            if (v) {
-                /* type is leaf */
-                s2 = (char*)&((LEAF *)(n->next))->s;
-                sz = ((LEAF *)(n->next))->sz;
-                leaf = 1;
+            if (n->magic & MTRIE_LEAF) {
+                s2 = ((LEAF*)n->next)->s;
+                sz = ((LEAF*)n->next)->sz;
             } else {
-                /* type is conn */
-                s2 = (char*)&((CONN *)(n->next))->s;
-                sz = ((CONN *)(n->next))->sz;
-                leaf = 0;
+                s2 = ((CONN*)n->next)->s;
+                sz = ((CONN*)n->next)->sz;
             }
+
             y = (sz > e-s)?e-s:sz;
             for (x=0; x<y; x++) {
-                register uint8_t c1 = MTRIE_OFFS(*(s+x));
-                register uint8_t c2 = (*(s2+x) & 0x3f);
-                if (c1 == c2)
-                    continue;
-                uint8_t magic;
-                BRANCH* br = malloc(sizeof(BRANCH)*2);
-                if (!x) {
-                    /* it was the first char that didnt match */
-                    n->magic = (n->magic & 0x40) + 2;
-                    n->next  = br;
-    /*                x = 1;*/
-                } else {
-                    CONN *new = (CONN*)(n->next = malloc(sizeof(CONN)+x));
-                    memcpy(new->s, s2, x);
-                    new->sz = x;
-                    new->node.magic = 2;
-                    new->node.next = br;
-                    n->magic = (n->magic & 0x40) | 0x80;
-                }
-                /* split the leaf/conn */
-                if (leaf) {
-                    LEAF *leaf = (LEAF*)next;
-                    _DEBUG("leaf:(%p) split at char '%c', leaf-pos %d",
-                            leaf,
-                            decodetbl[*(s2+x)], x);
-                    if (leaf->sz == 1) {
-                        _DEBUG("leaf:(%p) new size was %d, destroyed",
-                                leaf, -1);
-                        free(leaf);
-                        magic = 0x40;
-                        next = 0;
-                    } else {
-                        magic = (0x81 | (*(s2+x) & 0x40));
-                        /* shrink the leaf... */
-                        _DEBUG("leaf:(%p) new size = %d, old size = %d",
-                                leaf,
-                                leaf->sz-x-1, leaf->sz);
-                        leaf->sz -= x+1;
-                        if (leaf->sz == 0) {
-                            free(leaf);
-                            magic = 0x40;
-                            next = 0;
-                        } else {
-                            memmove(leaf->s, leaf->s+x+1, leaf->sz);
-                            leaf = realloc(leaf, sizeof(LEAF)+leaf->sz);
-                            next = (void*)leaf;
-                        }
-                    }
-                } else {
-                    magic = (0x80 | (*(s2+x) & 0x40));
-                    /* shrink the conn... */
-                    CONN *conn = (CONN*)next;
-                    conn->sz -= x+1;
-                    memmove(conn->s, conn->s+x+1, conn->sz);
-                    conn = realloc(conn, sizeof(CONN)+conn->sz);
-                    next = (void*)conn;
-                }
-                /* sort the two nodes */
-                v = (c1 > c2);
-                (*(br+v)).c = c1;
-                (*(br+v)).node.magic = 0;
-                (*(br+v)).node.next  = 0;
-                n = &((*(br+v)).node);
-                (*(br+!v)).c = c2;
-                (*(br+!v)).node.magic = magic;
-                (*(br+!v)).node.next  = next;
-                _DEBUG("branch:(%p) new with [0] = '%c', [1] = '%c'",
-                        br, decodetbl[br[0].c], decodetbl[br[1].c]);
-                s+=x+1;
-                goto cont;
+                c1 = CHR(*(s+x));
+                if (c1 != (*(s2+x) & 0x3f))
+                    break;
             }
-            if (leaf) {
-                if (e-s > sz) {
-                    /* expand leaf */
-                    LEAF *leaf = (LEAF*)n->next;
-                    _DEBUG("leaf:(%p) expanding to size: "
-                            "%d, with, '%s', new address:",
-                            leaf, e-s, s);
-                    leaf = realloc(leaf, sizeof(leaf)+(e-s));
-                    _DEBUG("-- %p", leaf);
-                    leaf->sz = y = e-s;
-                    leaf->s[x-1] |= 0x40/* | MTRIE_OFFS(*(s+x))*/;
-                    for (;x<y;x++)
-                        leaf->s[x] = MTRIE_OFFS(*(s+x));
-                    n->next = (BRANCH*)leaf;
-                    return 1;
-                } else if (x < sz) {
-                    if (*(s2+x-1) & 0x40)
-                        return 0;
-                    *(s2+x-1) |= 0x40;
-                    return 1;
-                }
-                return 0;
+
+            if (x < y) {
+                if (!(n = mtrie_split(p, n, x, c1)))
+                    return 0;
+                s += x+1;
+                continue;
             }
-            /* for conn */
+
             if (x == e-s) {
-                if (*(s2+x-1) & 0x40)
+                /* the string ends within the leaf or conn, 
+                 * or at the end of a leaf which is always a match */
+                if ((n->magic & MTRIE_LEAF) && x == sz)
+                    return 0;
+                if (*(s2+x-1) & MTRIE_MATCH)
                     return 0;
-                *(s2+x-1) |= 0x40;
+                *(s2+x-1) |= MTRIE_MATCH;
                 return 1;
             }
+
+            if (n->magic & MTRIE_LEAF) {
+                /* expand leaf */
+                if (!(leaf = mtrie_resize(p, n->next, LEAF_SIZE(sz), LEAF_SIZE(e-s))))
+                    return 0;
+                _DEBUG("leaf:(%p) expanded to size %d", leaf, (int)(e-s));
+                leaf->sz = y = e-s;
+                leaf->s[x-1] |= MTRIE_MATCH;
+                for (;x<y;x++)
+                    leaf->s[x] = CHR(*(s+x));
+                n->next = leaf;
+                return 1;
+            }
+
             /* the string matched the complete conn */
-            s+=x;
-            n = mtrie_next(&((CONN*)n->next)->node, ((CONN*)n->next)->node.next,
-                    ((CONN*)n->next)->node.magic & 0x3f, MTRIE_OFFS(*s));
+            s += x;
+            if (!(n = mtrie_next(p, &((CONN*)n->next)->node, CHR(*s))))
+                return 0;
             s++;
             continue;
-        } else if (!v) {
+        } else if (!n->next) {
             /* node branch is empty, add this new as a leaf */
-            n->magic |= 0x81;
-            sz = e-s; /* size */
-            LEAF *leaf = (LEAF*)(n->next = malloc(sizeof(LEAF)+sz));
+            sz = e-s;
+            if (!(leaf = mtrie_alloc(p, LEAF_SIZE(sz))))
+                return 0;
 
             _DEBUG("leaf:(%p) new with '%s'", leaf, s);
 
             leaf->sz = sz;
             while (sz > 0) {
                 sz--;
-                leaf->s[sz] = MTRIE_OFFS(*(s+sz));
+                leaf->s[sz] = CHR(*(s+sz));
             }
+            n->magic |= MTRIE_MULTI | MTRIE_LEAF;
+            n->next = leaf;
             return 1;
         }
-        n = mtrie_next(n, n->next, v, MTRIE_OFFS(*s));
+
+        if (!(n = mtrie_next(p, n, CHR(*s))))
+            return 0;
         s++;
     }
+
     return 0;
 }
 
+struct mtrie_walk {
+    void (*cb)(void *, const char *, uint16_t);
+    void  *arg;
+    char   buf[65536];
+};
+
+/** 
+ * Called by mtrie_walk() for the node n, reached by the 
+ * len first characters of w->buf
+ **/
+static void
+mtrie_walk_node(struct mtrie_walk *w, NODE *n, uint_fast16_t len)
+{
+    BRANCH       *br;
+    uint64_t      map;
+    char         *s2;
+    uint_fast16_t x, sz;
+    int           c;
+
+    if (n->magic & MTRIE_MATCH)
+        w->cb(w->arg, w->buf, len);
+
+    if (n->magic & MTRIE_MULTI) {
+        if (n->magic & MTRIE_LEAF) {
+            s2 = ((LEAF*)n->next)->s;
+            sz = ((LEAF*)n->next)->sz;
+        } else {
+            s2 = ((CONN*)n->next)->s;
+            sz = ((CONN*)n->next)->sz;
+        }
+
+        if (len+sz >= sizeof(w->buf))
+            return;
+
+        for (x=0; x<sz; x++) {
+            w->buf[len+x] = mtrie_decodetbl[s2[x] & 0x3f];
+            /* the end of a leaf is always a match */
+            if ((s2[x] & MTRIE_MATCH)
+                    || (x == sz-1 && (n->magic & MTRIE_LEAF)))
+                w->cb(w->arg, w->buf, len+x+1);
+        }
+
+        if (!(n->magic & MTRIE_LEAF))
+            mtrie_walk_node(w, &((CONN*)n->next)->node, len+sz);
+    } else if ((br = (BRANCH*)n->next) && len+1 < sizeof(w->buf)) {
+        for (map = br->map, x = 0; map; map &= map-1, x++) {
+            c = __builtin_ctzll(map);
+            w->buf[len] = mtrie_decodetbl[c];
+            mtrie_walk_node(w, &br->pos[x], len+1);
+        }
+    }
+}
+
+/** 
+ * Call cb once for each string in the table, in sorted order.
+ * The strings are the host names and paths of the added URLs,
+ * lower case, and are not NUL-terminated. Adding any of them 
+ * to a table gives the same result as adding the original URL.
+ **/
+M_CODE
+mtrie_walk(mtrie_t *p, void (*cb)(void *arg, const char *s, uint16_t len),
+           void *arg)
+{
+    struct mtrie_walk *w;
+
+    if (!(w = malloc(sizeof(struct mtrie_walk))))
+        return M_OUT_OF_MEM;
+
+    w->cb  = cb;
+    w->arg = arg;
+    mtrie_walk_node(w, &p->entry, 0);
+    free(w);
+
+    return M_OK;
+}
@@ -32,14 +32,25 @@
 #define MTRIE_OFFS(x)              \
     (x=='_'?2:((x-32)&0x40?x-64:x-32))
 
+/* the character x is stored as, the mtrie does not tell 
+ * apart characters that fold to the same one */
+#define MTRIE_FOLD(x) (mtrie_decodetbl[MTRIE_OFFS(x) & 0x3f])
+
+extern const char mtrie_decodetbl[];
+
+/* node magic */
+#define MTRIE_MATCH 0x40 /* a string ends here */
+#define MTRIE_MULTI 0x80 /* next is a leaf or a conn */
+#define MTRIE_LEAF  0x01 /* together with MTRIE_MULTI, next is a leaf */
+
 struct mtrie_leaf {
     uint16_t sz;
     char     s[];
 };
 
 struct mtrie_node {
-    char magic;
-    struct mtrie_br_pos *next;
+    uint8_t  magic;
+    void    *next; /* struct mtrie_br, leaf or conn */
 };
 
 /* used for connecting two nodes by more than one character */
@@ -49,18 +60,24 @@ struct mtrie_conn {
     char     s[];
 };
 
-struct mtrie_br_pos {
-    char c;
-    struct mtrie_node node;
+/* children of a node, sorted by character. Bit n of 'map' 
+ * is set if there is a child for the character n */
+struct mtrie_br {
+    uint64_t          map;
+    struct mtrie_node pos[];
 };
 
+struct mtrie_arena;
+
 typedef struct mtrie {
-    struct mtrie_node entry;
+    struct mtrie_node   entry;
+    struct mtrie_arena *arena; /* all nodes are allocated from here */
 } mtrie_t;
 
 mtrie_t* mtrie_create(void);
 void   mtrie_destroy(mtrie_t *p);
 void   mtrie_cleanup(mtrie_t *p);
 int    mtrie_tryadd(mtrie_t *p, url_t *url);
+M_CODE mtrie_walk(mtrie_t *p, void (*cb)(void *arg, const char *s, uint16_t len), void *arg);
 
 #endif
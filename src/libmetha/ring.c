@@ -0,0 +1,181 @@
+/*-
+ * ring.c
+ * This file is part of libmetha
+ *
+ * Copyright (c) 2008, Emil Romanus <emil.romanus@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ * 
+ * http://bithack.se/projects/methabot/
+ */
+
+/**
+ * Bounded lock-free queue of pointers, used for passing 
+ * transfers between the workers and the IO-threads without 
+ * taking a mutex.
+ *
+ * Each cell has a sequence number telling whether it is 
+ * free for the push at position 'seq', or holds the data 
+ * pushed at position 'seq-1'. Producers and consumers claim 
+ * a position with a compare-and-swap on tail or head, so 
+ * any number of threads may push and pop concurrently.
+ *
+ * The queue never grows, lm_ring_push() returns 0 if it is 
+ * full and the caller must have somewhere else to put the 
+ * data.
+ *
+ * Without the __sync builtins, the ring falls back to a 
+ * mutex around each push and pop.
+ **/
+
+#include <stdlib.h>
+
+#include "ring.h"
+
+/** 
+ * Set up a ring with room for 'size' pointers, size
+ * must be a power of 2
+ **/
+M_CODE
+lm_ring_init(ring_t *r, unsigned long size)
+{
+    unsigned long x;
+
+    if (!size || (size & (size-1)))
+        return M_FAILED;
+
+    if (!(r->cells = malloc(size*sizeof(struct ring_cell))))
+        return M_OUT_OF_MEM;
+
+    for (x=0; x<size; x++)
+        r->cells[x].seq = x;
+
+    r->mask = size-1;
+    r->head = 0;
+    r->tail = 0;
+
+#if HAVE_BUILTIN_ATOMIC == 0
+    pthread_mutex_init(&r->lock, 0);
+#endif
+
+    return M_OK;
+}
+
+void
+lm_ring_uninit(ring_t *r)
+{
+    if (r->cells) {
+        free(r->cells);
+#if HAVE_BUILTIN_ATOMIC == 0
+        pthread_mutex_destroy(&r->lock);
+#endif
+    }
+    r->cells = 0;
+}
+
+/** 
+ * Add a pointer to the ring, returns 0 if the ring is full
+ **/
+int
+lm_ring_push(ring_t *r, void *data)
+{
+#if HAVE_BUILTIN_ATOMIC == 0
+    struct ring_cell *c;
+    int               ret = 0;
+
+    pthread_mutex_lock(&r->lock);
+    c = &r->cells[r->tail & r->mask];
+    if (c->seq == r->tail) {
+        c->data = data;
+        c->seq  = r->tail+1;
+        r->tail ++;
+        ret = 1;
+    }
+    pthread_mutex_unlock(&r->lock);
+
+    return ret;
+#else
+    struct ring_cell *c;
+    unsigned long     pos = r->tail;
+    long              diff;
+
+    for (;;) {
+        c    = &r->cells[pos & r->mask];
+        diff = (long)c->seq - (long)pos;
+
+        if (diff == 0) {
+            if (__sync_bool_compare_and_swap(&r->tail, pos, pos+1))
+                break;
+        } else if (diff < 0)
+            return 0; /* full */
+
+        pos = r->tail;
+    }
+
+    c->data = data;
+    /* the data must be visible before the cell is marked as used */
+    __sync_synchronize();
+    c->seq = pos+1;
+
+    return 1;
+#endif
+}
+
+/** 
+ * Take the oldest pointer from the ring, returns 0 if 
+ * the ring is empty
+ **/
+void *
+lm_ring_pop(ring_t *r)
+{
+#if HAVE_BUILTIN_ATOMIC == 0
+    struct ring_cell *c;
+    void             *data = 0;
+
+    pthread_mutex_lock(&r->lock);
+    c = &r->cells[r->head & r->mask];
+    if (c->seq == r->head+1) {
+        data   = c->data;
+        c->seq = r->head+r->mask+1;
+        r->head ++;
+    }
+    pthread_mutex_unlock(&r->lock);
+
+    return data;
+#else
+    struct ring_cell *c;
+    unsigned long     pos = r->head;
+    long              diff;
+    void             *data;
+
+    for (;;) {
+        c    = &r->cells[pos & r->mask];
+        diff = (long)c->seq - (long)(pos+1);
+
+        if (diff == 0) {
+            if (__sync_bool_compare_and_swap(&r->head, pos, pos+1))
+                break;
+        } else if (diff < 0)
+            return 0; /* empty */
+
+        pos = r->head;
+    }
+
+    data = c->data;
+    /* the data must be read before the cell is given back */
+    __sync_synchronize();
+    c->seq = pos+r->mask+1;
+
+    return data;
+#endif
+}
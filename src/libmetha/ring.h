@@ -0,0 +1,54 @@
+/*-
+ * ring.h
+ * This file is part of libmetha
+ *
+ * Copyright (c) 2008, Emil Romanus <emil.romanus@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ * 
+ * http://bithack.se/projects/methabot/
+ */
+
+/* see comments in ring.c */
+
+#ifndef _RING__H_
+#define _RING__H_
+
+#include "errors.h"
+#include "config.h"
+
+#if HAVE_BUILTIN_ATOMIC == 0
+#include <pthread.h>
+#endif
+
+struct ring_cell {
+    volatile unsigned long seq;
+    void                  *data;
+};
+
+typedef struct ring {
+    struct ring_cell *cells;
+    unsigned long     mask;
+    volatile unsigned long head; /* next position to pop */
+    volatile unsigned long tail; /* next position to push */
+#if HAVE_BUILTIN_ATOMIC == 0
+    pthread_mutex_t   lock;
+#endif
+} ring_t;
+
+M_CODE lm_ring_init(ring_t *r, unsigned long size);
+void   lm_ring_uninit(ring_t *r);
+int    lm_ring_push(ring_t *r, void *data);
+void  *lm_ring_pop(ring_t *r);
+
+#endif
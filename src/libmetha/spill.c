@@ -0,0 +1,529 @@
+/*-
+ * spill.c
+ * This file is part of libmetha
+ *
+ * Copyright (c) 2008, Emil Romanus <emil.romanus@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ * http://bithack.se/projects/methabot/
+ */
+
+/**
+ * Disk storage for URL lists that do not fit in memory, used
+ * by the URL engine once the frontier grows past its memory
+ * budget, see LMOPT_FRONTIER_MEMORY.
+ *
+ * URLs are appended to segment files, a run of URLs written
+ * at once is described by a spillref_t that is later given
+ * back to lm_spill_read() or lm_spill_drop(). Nothing is
+ * ever rewritten, a segment is closed once it is full and
+ * all its runs have been read back.
+ *
+ * The segment files are unlinked as soon as they are
+ * created, so they never outlive the process. Only one
+ * process ever reads them, so the records are written in
+ * the host's byte order.
+ *
+ * A run can also be kept in memory, front coded, with 
+ * lm_spill_pack(). URLs of one list mostly share scheme,
+ * host and the start of the path, so each URL only stores
+ * the bytes that differ from the one before it. Such runs
+ * are read back and dropped like the ones on disk, see 
+ * LMOPT_FRONTIER_PACK.
+ **/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "spill.h"
+
+/* header of each URL in a segment, followed by the sz bytes
+ * of the URL string */
+struct spillrec {
+    uint16_t sz, file_o, ext_o;
+    uint8_t  host_o, host_l;
+    uint8_t  bind, protocol;
+    uint8_t  flags;
+};
+
+static int lm_spill_open(spill_t *s);
+static void lm_spill_release(spill_t *s, uint32_t seg);
+static M_CODE lm_spill_unpack(spillref_t *ref, ulist_t *dest);
+
+M_CODE
+lm_spill_init(spill_t *s)
+{
+    s->dir   = 0;
+    s->segs  = 0;
+    s->nsegs = 0;
+    s->cur   = 0;
+
+    if (pthread_mutex_init(&s->lock, 0) != 0)
+        return M_FAILED;
+
+    return M_OK;
+}
+
+void
+lm_spill_uninit(spill_t *s)
+{
+    uint32_t x;
+
+    for (x=0; x<s->nsegs; x++)
+        if (s->segs[x].fd != -1)
+            close(s->segs[x].fd);
+
+    free(s->segs);
+    free(s->dir);
+    s->segs  = 0;
+    s->nsegs = 0;
+    s->dir   = 0;
+
+    pthread_mutex_destroy(&s->lock);
+}
+
+/**
+ * Set the directory new segment files are created in.
+ * If dir is 0, $TMPDIR or /tmp is used.
+ **/
+M_CODE
+lm_spill_set_dir(spill_t *s, const char *dir)
+{
+    char *d = 0;
+
+    if (dir && !(d = strdup(dir)))
+        return M_OUT_OF_MEM;
+
+    pthread_mutex_lock(&s->lock);
+    free(s->dir);
+    s->dir = d;
+    pthread_mutex_unlock(&s->lock);
+
+    return M_OK;
+}
+
+/**
+ * Start a new segment file and make it the current one,
+ * s->lock must be held. Returns 0 on failure.
+ **/
+static int
+lm_spill_open(spill_t *s)
+{
+    struct spillseg *segs;
+    const char *dir;
+    char *name;
+    uint32_t x;
+    int fd;
+
+    if (!(dir = s->dir) && !(dir = getenv("TMPDIR")))
+        dir = "/tmp";
+
+    if (!(name = malloc(strlen(dir)+sizeof("/metha-spill-XXXXXX"))))
+        return 0;
+    sprintf(name, "%s/metha-spill-XXXXXX", dir);
+
+    if ((fd = mkstemp(name)) == -1) {
+        free(name);
+        return 0;
+    }
+    unlink(name);
+    free(name);
+
+    /* reuse the slot of a segment that has been closed */
+    for (x=0; x<s->nsegs; x++)
+        if (s->segs[x].fd == -1)
+            break;
+
+    if (x == s->nsegs) {
+        if (!(segs = realloc(s->segs, (s->nsegs+1)*sizeof(struct spillseg)))) {
+            close(fd);
+            return 0;
+        }
+        s->segs = segs;
+        s->nsegs ++;
+    }
+
+#ifdef DEBUG
+    fprintf(stderr, "* spill:(%p) opened segment %u\n", s, x);
+#endif
+
+    s->segs[x].fd   = fd;
+    s->segs[x].size = 0;
+    s->segs[x].live = 0;
+    s->cur = x;
+
+    return 1;
+}
+
+/**
+ * Forget one run of the given segment, s->lock must be held.
+ * The segment is closed once nothing in it is used any more,
+ * unless more is going to be appended to it.
+ **/
+static void
+lm_spill_release(spill_t *s, uint32_t seg)
+{
+    struct spillseg *g = &s->segs[seg];
+
+    if (--g->live == 0 && (seg != s->cur || g->size >= LM_SPILL_SEGMENT_SIZE)) {
+#ifdef DEBUG
+        fprintf(stderr, "* spill:(%p) closing segment %u\n", s, seg);
+#endif
+        close(g->fd);
+        g->fd = -1;
+    }
+}
+
+/**
+ * Write the URLs at positions from to to-1 of the given list
+ * to disk, empty URLs are skipped. The list is not modified.
+ * On success, *out is set to a new spillref_t that must be
+ * passed to lm_spill_read() or lm_spill_drop() later.
+ *
+ * Space in the segment is reserved with s->lock held, the
+ * data is then written without it.
+ **/
+M_CODE
+lm_spill_write(spill_t *s, ulist_t *l, size_t from, size_t to, spillref_t **out)
+{
+    struct spillrec r;
+    spillref_t *ref;
+    char    *buf, *p;
+    size_t   len = 0, x;
+    uint32_t count = 0;
+    ssize_t  n;
+    off_t    off;
+    int      fd;
+
+    for (x=from; x<to; x++)
+        if (l->row[x].sz)
+            len += sizeof(struct spillrec)+l->row[x].sz;
+
+    if (!len)
+        return M_FAILED;
+
+    if (!(ref = malloc(sizeof(spillref_t))))
+        return M_OUT_OF_MEM;
+    if (!(buf = malloc(len))) {
+        free(ref);
+        return M_OUT_OF_MEM;
+    }
+
+    memset(&r, 0, sizeof(struct spillrec));
+    for (x=from, p=buf; x<to; x++) {
+        url_t *u = &l->row[x];
+        if (!u->sz)
+            continue;
+        r.sz       = u->sz;
+        r.file_o   = u->file_o;
+        r.ext_o    = u->ext_o;
+        r.host_o   = u->host_o;
+        r.host_l   = u->host_l;
+        r.bind     = u->bind;
+        r.protocol = u->protocol;
+        r.flags    = u->flags;
+        memcpy(p, &r, sizeof(struct spillrec));
+        memcpy(p+sizeof(struct spillrec), u->str, u->sz);
+        p += sizeof(struct spillrec)+u->sz;
+        count ++;
+    }
+
+    pthread_mutex_lock(&s->lock);
+    if ((!s->nsegs || s->segs[s->cur].fd == -1
+            || s->segs[s->cur].size >= LM_SPILL_SEGMENT_SIZE)
+            && !lm_spill_open(s)) {
+        pthread_mutex_unlock(&s->lock);
+        free(buf);
+        free(ref);
+        return M_FAILED;
+    }
+    ref->seg = s->cur;
+    off = s->segs[s->cur].size;
+    s->segs[s->cur].size += len;
+    s->segs[s->cur].live ++;
+    fd = s->segs[s->cur].fd;
+    pthread_mutex_unlock(&s->lock);
+
+    for (x=0; x<len; x+=n) {
+        if ((n = pwrite(fd, buf+x, len-x, off+x)) <= 0) {
+            if (n == -1 && errno == EINTR) {
+                n = 0;
+                continue;
+            }
+            pthread_mutex_lock(&s->lock);
+            lm_spill_release(s, ref->seg);
+            pthread_mutex_unlock(&s->lock);
+            free(buf);
+            free(ref);
+            return M_FAILED;
+        }
+    }
+
+    free(buf);
+
+    ref->next  = 0;
+    ref->count = count;
+    ref->off   = off;
+    ref->len   = len;
+    ref->mem   = 0;
+    *out = ref;
+
+    return M_OK;
+}
+
+/* LEB128, values never exceed 16 bits here */
+#define PUT_VARINT(p, v) \
+    do { unsigned int _v = (v); \
+        while (_v >= 0x80) { *(p)++ = (char)(_v|0x80); _v >>= 7; } \
+        *(p)++ = (char)_v; } while (0)
+
+static const char *
+lm_spill_get_varint(const char *p, const char *e, unsigned int *v)
+{
+    unsigned int shift = 0;
+
+    *v = 0;
+    while (p < e && shift < 21) {
+        *v |= (unsigned int)(*p & 0x7f) << shift;
+        if (!(*p++ & 0x80))
+            return p;
+        shift += 7;
+    }
+    return 0;
+}
+
+/**
+ * Like lm_spill_write(), but the URLs are kept in memory,
+ * front coded. Each URL is stored as the number of bytes
+ * it shares with the URL before it, the number of bytes
+ * that follow, its offsets and flags and then the bytes
+ * that differ.
+ **/
+M_CODE
+lm_spill_pack(ulist_t *l, size_t from, size_t to, spillref_t **out)
+{
+    spillref_t *ref;
+    url_t   *u, *prev = 0;
+    char    *buf, *p, *tmp;
+    size_t   len = 0, x;
+    uint32_t count = 0;
+    unsigned int shared;
+
+    for (x=from; x<to; x++)
+        if (l->row[x].sz)
+            len += 4*3+5+l->row[x].sz;
+
+    if (!len)
+        return M_FAILED;
+
+    if (!(ref = malloc(sizeof(spillref_t))))
+        return M_OUT_OF_MEM;
+    if (!(buf = malloc(len))) {
+        free(ref);
+        return M_OUT_OF_MEM;
+    }
+
+    for (x=from, p=buf; x<to; x++) {
+        u = &l->row[x];
+        if (!u->sz)
+            continue;
+
+        shared = 0;
+        if (prev)
+            while (shared < prev->sz && shared < u->sz
+                    && prev->str[shared] == u->str[shared])
+                shared ++;
+
+        PUT_VARINT(p, shared);
+        PUT_VARINT(p, u->sz-shared);
+        PUT_VARINT(p, u->file_o);
+        PUT_VARINT(p, u->ext_o);
+        *p++ = (char)u->host_o;
+        *p++ = (char)u->host_l;
+        *p++ = (char)u->bind;
+        *p++ = (char)u->protocol;
+        *p++ = (char)u->flags;
+        memcpy(p, u->str+shared, u->sz-shared);
+        p += u->sz-shared;
+
+        prev = u;
+        count ++;
+    }
+
+    /* give back what the estimate above was off by */
+    len = p-buf;
+    if ((tmp = realloc(buf, len)))
+        buf = tmp;
+
+    ref->next  = 0;
+    ref->seg   = 0;
+    ref->count = count;
+    ref->off   = 0;
+    ref->len   = len;
+    ref->mem   = buf;
+    *out = ref;
+
+    return M_OK;
+}
+
+/**
+ * Decode a run created by lm_spill_pack() and append its 
+ * URLs to dest. The strings are put in dest's slab.
+ **/
+static M_CODE
+lm_spill_unpack(spillref_t *ref, ulist_t *dest)
+{
+    const char *p = ref->mem, *e = ref->mem+ref->len;
+    unsigned int shared, sfx, file_o, ext_o;
+    size_t   prev = 0;
+    uint32_t n;
+    url_t   *t;
+
+    for (n=0; n<ref->count; n++) {
+        if (!(p = lm_spill_get_varint(p, e, &shared))
+                || !(p = lm_spill_get_varint(p, e, &sfx))
+                || !(p = lm_spill_get_varint(p, e, &file_o))
+                || !(p = lm_spill_get_varint(p, e, &ext_o))
+                || p+5+sfx > e
+                || (shared && (!n || shared > dest->row[prev].sz))
+                || shared+sfx > UINT16_MAX-1)
+            return M_FAILED;
+
+        if (!(t = lm_ulist_inc(dest)))
+            return M_OUT_OF_MEM;
+        if (lm_ulist_reserve(dest, t, shared+sfx+1) != M_OK) {
+            lm_ulist_dec(dest);
+            return M_OUT_OF_MEM;
+        }
+
+        if (shared)
+            memcpy(t->str, dest->row[prev].str, shared);
+        memcpy(t->str+shared, p+5, sfx);
+        t->sz       = shared+sfx;
+        t->str[t->sz] = '\0';
+        t->file_o   = file_o;
+        t->ext_o    = ext_o;
+        t->host_o   = (uint8_t)p[0];
+        t->host_l   = (uint8_t)p[1];
+        t->bind     = (uint8_t)p[2];
+        t->protocol = (uint8_t)p[3];
+        t->flags    = (uint8_t)p[4];
+
+        p += 5+sfx;
+        prev = dest->sz-1;
+    }
+
+    return M_OK;
+}
+
+/**
+ * Read back the URLs of the given run and append them to
+ * dest. The run is released and ref is free()'d, even if
+ * reading fails.
+ **/
+M_CODE
+lm_spill_read(spill_t *s, spillref_t *ref, ulist_t *dest)
+{
+    M_CODE ret = lm_spill_load(s, ref, dest);
+
+    lm_spill_drop(s, ref);
+    return ret;
+}
+
+/**
+ * Like lm_spill_read(), but the run is left where it is
+ **/
+M_CODE
+lm_spill_load(spill_t *s, spillref_t *ref, ulist_t *dest)
+{
+    struct spillrec r;
+    url_t    tmp, *t;
+    char    *buf = 0, *p, *e;
+    size_t   x;
+    ssize_t  n;
+    int      fd;
+    M_CODE   ret = M_FAILED;
+
+    if (ref->mem)
+        return lm_spill_unpack(ref, dest);
+
+    pthread_mutex_lock(&s->lock);
+    fd = s->segs[ref->seg].fd;
+    pthread_mutex_unlock(&s->lock);
+
+    if (!(buf = malloc(ref->len)))
+        goto done;
+
+    for (x=0; x<ref->len; x+=n) {
+        if ((n = pread(fd, buf+x, ref->len-x, ref->off+x)) <= 0) {
+            if (n == -1 && errno == EINTR) {
+                n = 0;
+                continue;
+            }
+            goto done;
+        }
+    }
+
+    for (p=buf, e=buf+ref->len; p+sizeof(struct spillrec) <= e; ) {
+        memcpy(&r, p, sizeof(struct spillrec));
+        p += sizeof(struct spillrec);
+        if (p+r.sz > e)
+            break;
+
+        tmp.str      = p;
+        tmp.allocsz  = r.sz+1;
+        tmp.sz       = r.sz;
+        tmp.file_o   = r.file_o;
+        tmp.ext_o    = r.ext_o;
+        tmp.host_o   = r.host_o;
+        tmp.host_l   = r.host_l;
+        tmp.bind     = r.bind;
+        tmp.protocol = r.protocol;
+        tmp.flags    = r.flags;
+
+        if (!(t = lm_ulist_inc(dest)))
+            goto done;
+        if (lm_url_dup(t, &tmp) != M_OK) {
+            lm_ulist_dec(dest);
+            goto done;
+        }
+        t->str[t->sz] = '\0';
+        p += r.sz;
+    }
+
+    ret = M_OK;
+
+done:
+    free(buf);
+    return ret;
+}
+
+/**
+ * Discard a run without reading it
+ **/
+void
+lm_spill_drop(spill_t *s, spillref_t *ref)
+{
+    if (ref->mem)
+        free(ref->mem);
+    else {
+        pthread_mutex_lock(&s->lock);
+        lm_spill_release(s, ref->seg);
+        pthread_mutex_unlock(&s->lock);
+    }
+    free(ref);
+}
@@ -0,0 +1,74 @@
+/*-
+ * spill.h
+ * This file is part of libmetha
+ *
+ * Copyright (c) 2008, Emil Romanus <emil.romanus@gmail.com>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ * http://bithack.se/projects/methabot/
+ */
+
+/* see comments in spill.c */
+
+#ifndef _SPILL__H_
+#define _SPILL__H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <pthread.h>
+
+#include "errors.h"
+#include "utable.h"
+
+#define LM_SPILL_SEGMENT_SIZE (64*1024*1024) /* start a new segment file after this many bytes */
+
+/* a run of URLs written to a segment by lm_spill_write(), or
+ * kept in memory by lm_spill_pack() */
+typedef struct spillref {
+    struct spillref *next;
+    uint32_t         seg;
+    uint32_t         count; /* number of URLs */
+    off_t            off;
+    size_t           len;
+    char            *mem;   /* packed URLs, 0 if the run is on disk */
+} spillref_t;
+
+/* bytes of memory held by a run */
+#define LM_SPILL_REF_COST(r) ((r)->mem ? sizeof(spillref_t)+(r)->len : 0)
+
+struct spillseg {
+    int          fd;   /* -1 if the slot is unused */
+    off_t        size;
+    unsigned int live; /* refs not yet read back or dropped */
+};
+
+typedef struct spill {
+    char            *dir;  /* where to create segments, 0 for TMPDIR */
+    struct spillseg *segs;
+    uint32_t         nsegs;
+    uint32_t         cur;  /* segment being appended to */
+    pthread_mutex_t  lock;
+} spill_t;
+
+M_CODE lm_spill_init(spill_t *s);
+void   lm_spill_uninit(spill_t *s);
+M_CODE lm_spill_set_dir(spill_t *s, const char *dir);
+M_CODE lm_spill_write(spill_t *s, ulist_t *l, size_t from, size_t to, spillref_t **out);
+M_CODE lm_spill_pack(ulist_t *l, size_t from, size_t to, spillref_t **out);
+M_CODE lm_spill_read(spill_t *s, spillref_t *ref, ulist_t *dest);
+M_CODE lm_spill_load(spill_t *s, spillref_t *ref, ulist_t *dest);
+void   lm_spill_drop(spill_t *s, spillref_t *ref);
+
+#endif
@@ -32,18 +32,32 @@ struct protocol {
     char   *str;
     int     str_len;
     uint8_t val;
+    char   *port; /* default port, removed by lm_url_canonicalize() */
 };
 
 static struct protocol protocols[] = {
-    {"http",  4, LM_PROTOCOL_HTTP},
-    {"ftp",   3, LM_PROTOCOL_FTP},
-    {"file",  4, LM_PROTOCOL_FILE},
-    {"https", 5, LM_PROTOCOL_HTTPS},
-    {"ftps",  4, LM_PROTOCOL_FTPS},
+    {"http",  4, LM_PROTOCOL_HTTP,  "80"},
+    {"ftp",   3, LM_PROTOCOL_FTP,   "21"},
+    {"file",  4, LM_PROTOCOL_FILE,  ""},
+    {"https", 5, LM_PROTOCOL_HTTPS, "443"},
+    {"ftps",  4, LM_PROTOCOL_FTPS,  "990"},
+};
+
+/* RFC 3986 2.3 */
+#define LM_URL_UNRESERVED(c) \
+    (isalnum(c) || (c) == '-' || (c) == '.' || (c) == '_' || (c) == '~')
+
+struct lm_url_param {
+    const char *s;
+    uint16_t    len;
 };
 
 static M_CODE lm_url_realloc(url_t *url, uint16_t sz);
 static M_CODE lm_url_encodecpy(url_t *url, const char *prefix, uint16_t prefix_sz, const char *str, uint16_t sz);
+static int lm_url_hexval(int c);
+static int lm_url_strip_match(const lm_canon_t *rules, const char *s, uint16_t len);
+static int lm_url_param_cmp(const void *a, const void *b);
+static uint16_t lm_url_canon_query(const lm_canon_t *rules, char *s, uint16_t sz);
 
 /** 
  * Zero an url
@@ -88,6 +102,7 @@ lm_url_init(url_t *url)
     url->sz = 0;
     url->allocsz = 0;
     url->str = 0;
+    url->slab = 0;
 }
 
 /** 
@@ -119,10 +134,12 @@ lm_url_hostcmp(url_t *u1, url_t *u2)
 void
 lm_url_uninit(url_t *url)
 {
-    free(url->str);
+    if (!url->slab)
+        free(url->str);
     url->sz = 0;
     url->allocsz = 0;
     url->str = 0;
+    url->slab = 0;
 }
 
 /** 
@@ -145,7 +162,17 @@ lm_url_realloc(url_t *url, uint16_t sz)
         a |= a >> 8;
         a++;
     }
-    if (url->allocsz < a) {
+    if (url->slab) {
+        /* a slab string is never resized in place, it 
+         * is copied to a buffer of its own if too small */
+        if (url->allocsz >= sz)
+            return M_OK;
+        if (!(s = malloc(a)))
+            return M_OUT_OF_MEM;
+        memcpy(s, url->str, url->allocsz);
+        url->allocsz = a;
+        url->slab = 0;
+    } else if (url->allocsz < a) {
         s = realloc(s, a);
         if (!s) {
             /* allocation failed, try the tightest buffer (not
@@ -420,6 +447,52 @@ pback:
     return M_OK;
 }
 
+/**
+ * Let url use buf, which is sz bytes and owned by someone
+ * else, typically a list's slab (see lm_ulist_reserve()).
+ * The URL's old buffer is free()'d.
+ **/
+void
+lm_url_attach(url_t *url, char *buf, uint16_t sz)
+{
+    if (!url->slab)
+        free(url->str);
+    url->str = buf;
+    url->allocsz = sz;
+    url->slab = 1;
+}
+
+/**
+ * Give a URL whose string is in a slab a buffer of its own.
+ * Must be done before a URL is moved to a list that might 
+ * outlive the one the string was allocated from. An empty
+ * URL just forgets its buffer. If out of memory, the URL
+ * is emptied.
+ **/
+M_CODE
+lm_url_detach(url_t *url)
+{
+    char    *s;
+    uint16_t sz = url->sz;
+
+    if (!url->slab)
+        return M_OK;
+
+    if (!sz || !(s = malloc(sz+1))) {
+        lm_url_init(url);
+        url->flags = 0;
+        return (sz ? M_OUT_OF_MEM : M_OK);
+    }
+
+    memcpy(s, url->str, sz);
+    s[sz] = '\0';
+    url->str = s;
+    url->allocsz = sz+1;
+    url->slab = 0;
+
+    return M_OK;
+}
+
 void
 lm_url_swap(url_t *u1, url_t *u2)
 {
@@ -428,3 +501,241 @@ lm_url_swap(url_t *u1, url_t *u2)
     (*u2) = tmp;
 }
 
+
+static int
+lm_url_hexval(int c)
+{
+    if (c >= '0' && c <= '9')
+        return c-'0';
+    if (c >= 'a' && c <= 'f')
+        return c-'a'+10;
+    if (c >= 'A' && c <= 'F')
+        return c-'A'+10;
+    return -1;
+}
+
+/**
+ * Return 1 if the parameter starting at s, and reaching at
+ * most len bytes, has a name in rules->strip
+ **/
+static int
+lm_url_strip_match(const lm_canon_t *rules, const char *s, uint16_t len)
+{
+    uint16_t n;
+    int x;
+
+    for (n=0; n<len && s[n] != '='; n++)
+        ;
+
+    for (x=0; x<rules->num_strip; x++)
+        if (strncasecmp(rules->strip[x], s, n) == 0 && !rules->strip[x][n])
+            return 1;
+
+    return 0;
+}
+
+static int
+lm_url_param_cmp(const void *a, const void *b)
+{
+    const struct lm_url_param *p1 = a, *p2 = b;
+    int r = memcmp(p1->s, p2->s, (p1->len < p2->len ? p1->len : p2->len));
+
+    return r ? r : (int)p1->len-(int)p2->len;
+}
+
+/**
+ * Rewrite the sz bytes of the query string s, without the 
+ * '?', according to rules. Empty parameters are dropped.
+ * Returns the new size.
+ **/
+static uint16_t
+lm_url_canon_query(const lm_canon_t *rules, char *s, uint16_t sz)
+{
+    struct lm_url_param *p;
+    char     *buf, *t;
+    uint16_t  n = 1, x, y, start;
+
+    for (x=0; x<sz; x++)
+        if (s[x] == '&')
+            n ++;
+
+    if (!(p = malloc(n*sizeof(struct lm_url_param))))
+        return sz;
+    if (!(buf = malloc(sz))) {
+        free(p);
+        return sz;
+    }
+
+    for (x=0, y=0, start=0; x<=sz; x++) {
+        if (x < sz && s[x] != '&')
+            continue;
+        if (x > start && !(rules->num_strip
+                    && lm_url_strip_match(rules, s+start, x-start))) {
+            p[y].s   = s+start;
+            p[y].len = x-start;
+            y ++;
+        }
+        start = x+1;
+    }
+
+    if (rules->sort)
+        qsort(p, y, sizeof(struct lm_url_param), &lm_url_param_cmp);
+
+    for (x=0, t=buf; x<y; x++) {
+        if (x)
+            *t++ = '&';
+        memcpy(t, p[x].s, p[x].len);
+        t += p[x].len;
+    }
+
+    sz = t-buf;
+    memcpy(s, buf, sz);
+    free(buf);
+    free(p);
+
+    return sz;
+}
+
+/**
+ * Rewrite a URL in canonical form, so that URLs that only 
+ * differ in ways that do not matter are recognized as the 
+ * same by the seen-sets of the URL engine. The normalizations
+ * of RFC 3986 section 6.2.2 are always done:
+ *  - the host name is made lower case and the default port
+ *    of the protocol is removed
+ *  - percent-encoded unreserved characters are decoded, the
+ *    hex digits of the other ones are made upper case
+ *  - "." and ".." segments of the path are resolved
+ *  - an empty query is removed
+ *
+ * rules, if not 0, holds the crawler's own rules. Parameters
+ * of the query, and ";name=value" parameters of the path, 
+ * named in rules->strip are removed, and if rules->sort is 
+ * set the query parameters are sorted.
+ *
+ * The URL never grows, it is rewritten in place.
+ **/
+M_CODE
+lm_url_canonicalize(url_t *url, const lm_canon_t *rules)
+{
+    char     *s = url->str;
+    uint16_t  sz = url->sz;
+    uint16_t  p0, q, r, w, e, n, x;
+    int       a, b, dir = 0;
+
+    p0 = url->host_o+url->host_l;
+    if (!s || p0 > sz)
+        return M_FAILED;
+
+    /* host name */
+    for (x=url->host_o; x<p0; x++)
+        s[x] = tolower(s[x]);
+
+    for (x=p0; x>url->host_o && s[x-1] != ':'; x--)
+        ;
+    if (x > url->host_o) {
+        for (n=0; n<NUM_PROTOCOLS; n++)
+            if (protocols[n].val == url->protocol)
+                break;
+        if (x == p0 || (n < NUM_PROTOCOLS
+                    && strlen(protocols[n].port) == p0-x
+                    && memcmp(s+x, protocols[n].port, p0-x) == 0)) {
+            /* x is past the ':' */
+            n = p0-x+1;
+            memmove(s+x-1, s+p0, sz-p0);
+            sz -= n;
+            p0 -= n;
+            url->host_l -= n;
+        }
+    }
+
+    /* percent-encoding */
+    for (r=p0, w=p0; r<sz; ) {
+        if (s[r] == '%' && r+2 < sz
+                && (a = lm_url_hexval(s[r+1])) >= 0
+                && (b = lm_url_hexval(s[r+2])) >= 0) {
+            if (LM_URL_UNRESERVED(a*16+b))
+                s[w++] = (char)(a*16+b);
+            else {
+                s[w++] = '%';
+                s[w++] = toupper(s[r+1]);
+                s[w++] = toupper(s[r+2]);
+            }
+            r += 3;
+        } else
+            s[w++] = s[r++];
+    }
+    sz = w;
+
+    for (q=p0; q<sz && s[q] != '?'; q++)
+        ;
+
+    /* dot segments, RFC 3986 5.2.4, and path parameters */
+    if (p0 < q && s[p0] == '/') {
+        for (r=p0, w=p0; r<q; r=e) {
+            for (e=r+1; e<q && s[e] != '/'; e++)
+                ;
+            n = e-r-1;
+
+            if (n == 1 && s[r+1] == '.')
+                dir = 1;
+            else if (n == 2 && s[r+1] == '.' && s[r+2] == '.') {
+                while (w > p0 && s[--w] != '/')
+                    ;
+                dir = 1;
+            } else {
+                memmove(s+w, s+r, n+1);
+                w += n+1;
+                dir = 0;
+            }
+        }
+        if (dir || w == p0)
+            s[w++] = '/';
+
+        if (rules && rules->num_strip) {
+            for (r=p0; r<w; ) {
+                if (s[r] == ';') {
+                    for (x=r+1; x<w && s[x] != ';' && s[x] != '/'; x++)
+                        ;
+                    if (lm_url_strip_match(rules, s+r+1, x-r-1)) {
+                        memmove(s+r, s+x, w-x);
+                        w -= x-r;
+                        continue;
+                    }
+                }
+                r ++;
+            }
+        }
+
+        memmove(s+w, s+q, sz-q);
+        sz -= q-w;
+        q = w;
+    }
+
+    /* query */
+    if (q < sz) {
+        n = sz-q-1;
+        if (rules && (rules->num_strip || rules->sort))
+            n = lm_url_canon_query(rules, s+q+1, n);
+        sz = (n ? q+1+n : q);
+    }
+
+    /* file and extension offsets as set by lm_url_encodecpy() */
+    for (x=q; x>p0 && s[x-1] != '/'; x--)
+        ;
+    url->file_o = (x > p0 ? x-1 : p0);
+    url->ext_o  = 0;
+    for (; x<q; x++)
+        if (s[x] == '.')
+            url->ext_o = x;
+
+    if (q < sz)
+        url->flags |= LM_URL_DYNAMIC;
+    else
+        url->flags &= ~LM_URL_DYNAMIC;
+
+    s[sz] = '\0';
+    url->sz = sz;
+
+    return M_OK;
+}
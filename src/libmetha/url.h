@@ -36,10 +36,14 @@ enum {
     LM_NUM_PROTOCOLS
 };
 
+#define LM_PROTOCOL_IS_HTTP(p) ((p) == LM_PROTOCOL_HTTP || (p) == LM_PROTOCOL_HTTPS)
+#define LM_PROTOCOL_IS_FTP(p)  ((p) == LM_PROTOCOL_FTP || (p) == LM_PROTOCOL_FTPS)
+
 /* url flags */
 #define LM_URL_DYNAMIC    1
 #define LM_URL_EXTERNAL   2
 #define LM_URL_WWW_PREFIX 4
+#define LM_URL_LOOKUP     8 /* filetype is looked up by the GET, see lm_worker_lookup() */
 
 #define LM_URL_ISSET(x,y) ((x)->flags & (y))
 
@@ -61,8 +65,16 @@ typedef struct url {
     uint8_t  host_o, host_l;
     uint8_t  bind, protocol;
     uint8_t  flags;
+    uint8_t  slab;   /* str is owned by a list's slab, see utable.c */
 } url_t;
 
+/* canonicalization rules of a crawler, see lm_url_canonicalize() */
+typedef struct lm_canon {
+    char        **strip;     /* names of parameters to remove, such as session ids */
+    int           num_strip;
+    unsigned int  sort;      /* sort the query parameters */
+} lm_canon_t;
+
 void   lm_url_init(url_t *url);
 void   lm_url_uninit(url_t *url);
 void   lm_url_dump(url_t *url);
@@ -72,6 +84,9 @@ M_CODE lm_url_dup(url_t *dest, url_t *source);
 int    lm_url_hostcmp(url_t *u1, url_t *u2);
 void   lm_url_nullify(url_t *url);
 void   lm_url_swap(url_t *u1, url_t *u2);
+void   lm_url_attach(url_t *url, char *buf, uint16_t sz);
+M_CODE lm_url_detach(url_t *url);
+M_CODE lm_url_canonicalize(url_t *url, const lm_canon_t *rules);
 
 #define lm_url_bind(url, ft) (url)->bind = (ft)
 
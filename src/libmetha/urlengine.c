@@ -22,8 +22,16 @@
 #include <jsapi.h>
 #include <ctype.h>
 #include <string.h>
+#include <time.h>
 #include "urlengine.h"
 
+/* how long to wait before retrying a host that has reached 
+ * its max number of concurrent transfers */
+#define UE_HOST_RETRY_MS   50
+/* how deep into a pending heap ue_pop_pending() will look
+ * for a host that is ready to be crawled */
+#define UE_PENDING_SCAN    16
+
 /*#define UE_DEBUG*/
 #ifdef _DEBUG
 #undef _DEBUG
@@ -35,30 +43,183 @@
 #define _DEBUG(x, ...)
 #endif
 
-static struct host_ent *ue_hostent_create(uehandle_t *h, const char *str, uint16_t len, int secondary_n, int add_pending);
-static void ue_hostent_free(struct host_ent *p);
-static M_CODE ue_push_pending(uehandle_t *h, struct host_ent *p);
-/*static M_CODE ue_remove_pending(uehandle_t *h, struct host_ent *p);*/
-struct host_ent *ue_get_hostent(uehandle_t *h, const char *host, uint16_t host_sz, int add_pending);
+static struct host_ent *ue_hostent_create(uehandle_t *h, const char *str, uint16_t len, uint32_t hash, int add_pending);
+static struct host_ent *ue_hosts_find(ue_t *ue, const char *host, uint16_t len, uint32_t hash);
+static struct host_ent *ue_hostcache_find(uehandle_t *h, const char *host, uint16_t len, uint32_t hash);
+static void ue_hostcache_put(uehandle_t *h, struct host_ent *p, int n);
+static void   ue_hosts_add(ue_t *ue, struct host_ent *p);
+static M_CODE ue_hosts_grow(ue_t *ue);
+static void ue_hostent_free(ue_t *ue, struct host_ent *p);
+static uint64_t ue_pending_key(ue_t *ue, struct host_ent *p);
+static void ue_pending_up(struct ue_pqueue *q, unsigned int pos);
+static void ue_pending_down(struct ue_pqueue *q, unsigned int pos);
+static M_CODE ue_pending_insert(ue_t *ue, struct ue_pqueue *q, struct host_ent *p);
+static struct host_ent *ue_pending_take(ue_t *ue, struct ue_pqueue *q);
+static void ue_pending_update(ue_t *ue, struct host_ent *p);
+static uint64_t ue_now_ms(void);
+static int ue_host_ready(ue_t *ue, struct host_ent *ent);
+static int ue_host_down(struct host_ent *ent, uint64_t now);
+static M_CODE ue_level_dec(uehandle_t *h);
+static void ue_levels_update(uehandle_t *h);
+static void ue_spill_levels(uehandle_t *h);
+static void ue_spill_list(ue_t *ue, struct host_ent *p);
+static void ue_pack_list(ue_t *ue, struct host_ent *p);
+static void ue_pack_level(ulist_t *l);
+static void ue_retire(uehandle_t *h, struct host_ent *p);
+static void ue_host_switch(uehandle_t *h, struct host_ent *ent, int retire);
+static void ue_revive(struct host_ent *p);
+static int ue_reclaim(uehandle_t *h, ulist_t *top);
+static void ue_unshare(uehandle_t *h);
+static void ue_batch_move(ulist_t *to, ulist_t *from);
+
+/* fingerprints collected by ue_retire() */
+struct ue_fpbuf {
+    uint64_t *a;
+    uint32_t  n;
+    uint32_t  cap;
+    int       err;
+};
+
+/* memory accounted for a URL in a host list */
+#define UE_URL_COST(u) (sizeof(url_t)+(u)->allocsz)
+
+#define ue_over_budget(ue) \
+    ((ue)->frontier.budget \
+     && (ue)->frontier.lists+(ue)->frontier.levels > (ue)->frontier.budget)
+
+/** 
+ * Add the URL to the set of seen URLs of the given host. 
+ * Returns 0 if it was seen before. ent->lock must be held,
+ * fp is the URL's fingerprint from lm_fpset_hash().
+ **/
+static inline int
+ue_seen(struct host_ent *ent, url_t *url, uint64_t fp)
+{
+    if (ent->retired) {
+        if (lm_fpset_find_sorted(ent->retired, ent->nretired, fp))
+            return 0;
+        ue_revive(ent);
+    }
+    if (ent->use_fp)
+        return lm_fpset_tryadd_hash(&ent->fp, fp);
+    return mtrie_tryadd(&ent->cache, url);
+}
+
+/** 
+ * Check whether the pre-filter knows the given URL fingerprint
+ * as seen. The pre-filter is a cache of the fingerprints of 
+ * recently added URLs, shared by all workers and read and 
+ * written without any locking. Entries might be overwritten
+ * at any time, so a miss means nothing, the host's seen-set
+ * must then be asked. A hit is wrong only if two URLs have 
+ * the same 64-bit fingerprint, see fpset.c.
+ **/
+static inline int
+ue_filter_check(ue_t *ue, uint64_t fp)
+{
+    volatile uint64_t *b;
+    int x;
+
+    if (!ue->filter.slots)
+        return 0;
+
+    b = ue->filter.slots+(fp & ue->filter.mask)*UE_FILTER_WAYS;
+    for (x=0; x<UE_FILTER_WAYS; x++)
+        if (b[x] == fp)
+            return 1;
+
+    return 0;
+}
+
+/** 
+ * Remember a fingerprint in the pre-filter. If its bucket is
+ * full, one of the entries is replaced, picked by the high 
+ * bits of the fingerprint. Concurrent adds to the same bucket
+ * might overwrite each other, which only costs a later miss.
+ **/
+static inline void
+ue_filter_add(ue_t *ue, uint64_t fp)
+{
+    volatile uint64_t *b;
+    int x;
+
+    if (!ue->filter.slots)
+        return;
+
+    b = ue->filter.slots+(fp & ue->filter.mask)*UE_FILTER_WAYS;
+    for (x=0; x<UE_FILTER_WAYS; x++) {
+        if (!b[x]) {
+            b[x] = fp;
+            return;
+        }
+    }
+
+    b[(fp >> 62) % UE_FILTER_WAYS] = fp;
+}
+
+/** 
+ * Set the number of fingerprints kept by the pre-filter, 
+ * rounded down to a power of two. 0 disables it. Must not be
+ * called while workers are running.
+ **/
+M_CODE
+ue_set_filter_size(ue_t *ue, unsigned int size)
+{
+    unsigned int n;
+
+    free((void*)ue->filter.slots);
+    ue->filter.slots = 0;
+    ue->filter.mask  = 0;
+
+    if (size < UE_FILTER_WAYS)
+        return M_OK;
+
+    for (n = UE_FILTER_WAYS; n <= size/2; n *= 2)
+        ;
+
+    if (!(ue->filter.slots = calloc(n, sizeof(uint64_t))))
+        return M_OUT_OF_MEM;
+    ue->filter.mask = n/UE_FILTER_WAYS-1;
+
+    return M_OK;
+}
 
 M_CODE
 ue_init(ue_t *ue)
 {
     int x;
 
-    for (x=0; x<UE_SECONDARY_SIZE; x++)
-        if (pthread_rwlock_init(&ue->secondary[x].rwlock, 0) != 0)
-            return M_FAILED;
-
-    if (pthread_mutex_init(&ue->pending_lk, 0) != 0)
+    if (pthread_mutex_init(&ue->hosts.lock, 0) != 0)
         return M_FAILED;
 
-    if (!(ue->pending.st = malloc(8*sizeof(struct host_ent *))))
+    ue->hosts.cur = calloc(1, sizeof(struct ue_hosttab)
+                              +UE_HOSTS_INIT_SIZE*sizeof(struct host_ent*));
+    if (!ue->hosts.cur)
+        return M_OUT_OF_MEM;
+    ue->hosts.cur->mask = UE_HOSTS_INIT_SIZE-1;
+
+    for (x=0; x<UE_PENDING_SHARDS; x++) {
+        struct ue_pqueue *q = &ue->pending.shards[x];
+        if (pthread_mutex_init(&q->lock, 0) != 0)
+            return M_FAILED;
+        if (!(q->heap = malloc(8*sizeof(struct host_ent *))))
+            return M_OUT_OF_MEM;
+        q->sz  = 0;
+        q->cap = 8;
+        q->top = 0;
+    }
+    ue->pending.seq = 0;
+
+    if (ue_set_filter_size(ue, UE_FILTER_SIZE) != M_OK)
         return M_OUT_OF_MEM;
 
-    ue->pending.sz = 0;
-    ue->pending.cap = 8;
+    if (lm_spill_init(&ue->frontier.disk) != M_OK)
+        return M_FAILED;
 
+    if (pthread_mutex_init(&ue->parked.lock, 0) != 0)
+        return M_FAILED;
+    if (pthread_mutex_init(&ue->sharing.lock, 0) != 0)
+        return M_FAILED;
 
     return M_OK;
 }
@@ -66,30 +227,46 @@ ue_init(ue_t *ue)
 void
 ue_uninit(ue_t *ue)
 {
-    int x, y;
-    struct host_ent *curr, *next;
-
-    for (x=0; x<UE_SECONDARY_SIZE; x++) {
-        pthread_rwlock_destroy(&ue->secondary[x].rwlock);
-
-        /* clean up the host entries */
-        for (y=0; y<8; y++) {
-            if ((curr = ue->secondary[x].hosts[y])) {
-                do {
-                    next = curr->next;
-                    ue_hostent_free(curr);
-                } while ((curr = next));
+    uint32_t x;
+    struct ue_hosttab *t, *next_t;
+    struct host_ent   *curr, *next;
+
+    for (x=0; x<ue->parked.count; x++)
+        ue_handle_free(ue->parked.list[x]);
+    free(ue->parked.list);
+    pthread_mutex_destroy(&ue->parked.lock);
+    free(ue->sharing.list);
+    pthread_mutex_destroy(&ue->sharing.lock);
+
+    pthread_mutex_destroy(&ue->hosts.lock);
+
+    /* clean up the host entries, those not yet moved 
+     * out of the old table are still there */
+    for (t = ue->hosts.cur; t; t = (t == ue->hosts.cur ? ue->hosts.old : 0)) {
+        for (x=0; x<=t->mask; x++) {
+            for (curr = t->buckets[x]; curr; curr = next) {
+                next = curr->next;
+                ue_hostent_free(ue, curr);
             }
         }
     }
 
-    pthread_mutex_destroy(&ue->pending_lk);
+    for (t = ue->hosts.cur; t; t = next_t) {
+        next_t = t->retired;
+        free(t);
+    }
+
+    /* a handle that outlives the host entries must not find
+     * them in its cache, see lmetha_reset() */
+    ue->hosts.gen ++;
 
-    /*
-    for (x=0; x<ue->pending.sz; x++)
-        ue_hostent_free(ue->pending.st[x]);
-        */
-    free(ue->pending.st);
+    /* the pending hosts were freed with the host table */
+    for (x=0; x<UE_PENDING_SHARDS; x++) {
+        pthread_mutex_destroy(&ue->pending.shards[x].lock);
+        free(ue->pending.shards[x].heap);
+    }
+    free((void*)ue->filter.slots);
+    lm_spill_uninit(&ue->frontier.disk);
 }
 
 /** 
@@ -102,6 +279,7 @@ ue_handle_obtain(ue_t *ue)
 
     ret->parent = ue;
     ret->depth_limit = 1;
+    pthread_mutex_init(&ret->shared.lock, 0);
 
     lm_utable_init(&ret->primary);
     return ret;
@@ -110,10 +288,85 @@ ue_handle_obtain(ue_t *ue)
 void
 ue_handle_free(uehandle_t *h)
 {
+    spillref_t *r, *next;
+    size_t x;
+
+    ue_unshare(h);
+    pthread_mutex_destroy(&h->shared.lock);
+    free(h->shared.q);
+
+    ue_host_unhold(h, h->host_ent, 0);
+    if (h->is_peeking)
+        ue_host_unhold(h, h->host_ent_bk, 0);
+
+    for (x=0; x<h->primary.cap; x++) {
+        for (r = h->primary.row[x].spilled; r; r = next) {
+            next = r->next;
+            lm_spill_drop(&h->parent->frontier.disk, r);
+        }
+    }
+
+    __sync_fetch_and_sub(&h->parent->frontier.levels, h->level_mem);
     lm_utable_uninit(&h->primary);
     free(h);
 }
 
+/** 
+ * Called when a worker stops. If the handle still has URLs 
+ * left to crawl, it is kept by the url engine so that the 
+ * next session can continue where this one stopped, see 
+ * ue_handle_unpark() and lmetha_checkpoint(). Otherwise, 
+ * it is free()'d.
+ **/
+void
+ue_handle_park(uehandle_t *h)
+{
+    ue_t *ue = h->parent;
+    uehandle_t **list;
+    size_t x;
+
+    ue_unshare(h);
+
+    for (x=0; x<h->primary.sz; x++)
+        if (h->primary.row[x].sz || h->primary.row[x].spilled)
+            break;
+
+    if (x == h->primary.sz) {
+        ue_handle_free(h);
+        return;
+    }
+
+    pthread_mutex_lock(&ue->parked.lock);
+    if (!(list = realloc(ue->parked.list, (ue->parked.count+1)*sizeof(uehandle_t*)))) {
+        pthread_mutex_unlock(&ue->parked.lock);
+        ue_handle_free(h);
+        return;
+    }
+    list[ue->parked.count++] = h;
+    ue->parked.list = list;
+    pthread_mutex_unlock(&ue->parked.lock);
+}
+
+/** 
+ * Take back a handle given to ue_handle_park(), returns 0
+ * if there is none
+ **/
+uehandle_t *
+ue_handle_unpark(ue_t *ue)
+{
+    uehandle_t *h = 0;
+
+    pthread_mutex_lock(&ue->parked.lock);
+    if (ue->parked.count)
+        h = ue->parked.list[--ue->parked.count];
+    pthread_mutex_unlock(&ue->parked.lock);
+
+    if (h)
+        h->resumed = 1;
+
+    return h;
+}
+
 /** 
  * Used when adding URLs initially before a session has begun
  **/
@@ -134,14 +387,31 @@ ue_add_initial(uehandle_t *h, const char *url, uint16_t len)
     if (!(t = lm_ulist_inc(list)))
         return M_FAILED;
 
-    if (lm_url_set(t, url, len) != M_OK)
+    if (lm_url_set(t, url, len) != M_OK
+        || lm_url_canonicalize(t, h->canon) != M_OK)
         return M_FAILED;
 
     /* pretty slow way of adding the URL to its host's cache, but
-     * it works ok right now */
-    ue_set_host(h, t->str+t->host_o, t->host_l);
+     * it works ok right now. The hosts of the initial URLs are
+     * never retired here, their URLs are all still to be crawled */
+    {
+        const char *host = t->str+t->host_o;
+        uint16_t    host_sz = t->host_l;
+        struct host_ent *ent;
+
+        if (host_sz > 4 && strncasecmp(host, "www.", 4) == 0) {
+            host+=4;
+            host_sz-=4;
+        }
+        if (!(ent = ue_get_hostent(h, host, host_sz, 0))) {
+            list->sz--;
+            return M_FAILED;
+        }
+        ue_host_switch(h, ent, 0);
+    }
     pthread_mutex_lock(&h->host_ent->lock);
-    if (!mtrie_tryadd(&h->host_ent->cache, t)) {
+    if (!ue_seen(h->host_ent, t,
+                 lm_fpset_hash(t->str+t->host_o, t->sz-t->host_o))) {
         pthread_mutex_unlock(&h->host_ent->lock);
         list->sz--;
         return M_FAILED;
@@ -159,94 +429,302 @@ M_CODE
 ue_revert(uehandle_t *h, const char *url, uint16_t len)
 {
     h->depth_counter --;
-    lm_utable_dec(&h->primary);
+    ue_level_dec(h);
 
     return ue_add(h, url, len);
 }
 
 /** 
- * Add a relative or absolute URL.
+ * Resolve url against h->current and store it in t, a new 
+ * row of list. Absolute URLs of another host are flagged 
+ * LM_URL_EXTERNAL. Called by ue_add() and ue_add_batch().
  **/
-M_CODE
-ue_add(uehandle_t *h, const char *url, uint16_t len)
+static M_CODE
+ue_resolve(uehandle_t *h, ulist_t *list, url_t *t,
+           const char *url, uint16_t len)
 {
-    url_t   *t;
-    ulist_t *list;
     int x;
-    M_CODE ret;
-
-    if (!(list = lm_utable_top(&h->primary)))
-        return M_FAILED;
-    if (!(t = lm_ulist_inc(list)))
-        return M_FAILED;
-
-    /* now we have the list in 'list' and a place for the
-     * URL in 't' */
 
     /* fix the given url depending on its syntax */
     if (*url == '/') {
         /* the URL starts with a '/' and should thus presumably be appended
          * to the current host */
-        if ((ret = lm_url_combine(t, h->current, url, len)) != M_OK)
-            goto failed;
-        goto cache_check;
+        lm_ulist_reserve(list, t, h->current->sz+len+16);
+        if (lm_url_combine(t, h->current, url, len) != M_OK
+            || lm_url_canonicalize(t, h->canon) != M_OK)
+            return M_FAILED;
+        return M_OK;
     }
     for (x=0; x<len; x++) {
         if (!isalnum(url[x])) {
             if (url[x] == ':') {
-                if (lm_url_set(t, url, len) == M_OK) {
+                lm_ulist_reserve(list, t, len+16);
+                if (lm_url_set(t, url, len) == M_OK
+                    && lm_url_canonicalize(t, h->canon) == M_OK) {
+                    /* a remote page must never make us open local
+                     * files, only local files may link to them */
+                    if (t->protocol == LM_PROTOCOL_FILE
+                        && h->current->protocol != LM_PROTOCOL_FILE)
+                        return M_FAILED;
                     /* now we need to check whether the URL is external or not,
                      * by comparing the host of the URL with the current URL's host */
                     if (t->protocol != h->current->protocol
                         || lm_url_hostcmp(t, h->current) != 0)
                         t->flags |= LM_URL_EXTERNAL; /* set the "external" flag for this URL if
                                                         the host doesn't match the current URL's */
-                    goto cache_check;
+                    return M_OK;
                 } else
-                    goto failed;
+                    return M_FAILED;
             }
             break;
         }
     }
     /* the url is something like "hello/dsa" or "xyz.html", merge it with current host and path */
-    if ((ret = lm_url_combine(t, h->current, url, len)) != M_OK)
+    lm_ulist_reserve(list, t, h->current->sz+len+16);
+    if (lm_url_combine(t, h->current, url, len) != M_OK
+        || lm_url_canonicalize(t, h->canon) != M_OK)
+        return M_FAILED;
+
+    return M_OK;
+}
+
+/** 
+ * Find the host entry whose seen-set the resolved URL t 
+ * belongs to. If last is not 0 and names the same host,
+ * it is returned without a lookup.
+ **/
+static struct host_ent *
+ue_url_hostent(uehandle_t *h, url_t *t, struct host_ent *last)
+{
+    uint16_t len, o;
+
+    if (!(t->flags & LM_URL_EXTERNAL))
+        return h->host_ent;
+
+    /* url is external, we can't use the current cache since that
+     * cache is for the current host name only. We must find a matching
+     * cache for the given host */
+    len = t->host_l-(LM_URL_ISSET(t, LM_URL_WWW_PREFIX)?4:0);
+    o   = t->host_o+(LM_URL_ISSET(t, LM_URL_WWW_PREFIX)?4:0);
+
+    if (last && last->len == len
+            && strncasecmp(t->str+o, last->str, len) == 0)
+        return last;
+
+    return ue_get_hostent(h, t->str+o, len, 1);
+}
+
+/** 
+ * Add a relative or absolute URL.
+ **/
+M_CODE
+ue_add(uehandle_t *h, const char *url, uint16_t len)
+{
+    url_t   *t;
+    ulist_t *list;
+    int added;
+    uint64_t fp;
+    struct host_ent *ent;
+
+    if (!(list = lm_utable_top(&h->primary)))
+        return M_FAILED;
+    if (!(t = lm_ulist_inc(list)))
+        return M_FAILED;
+
+    /* now we have the list in 'list' and a place for the
+     * URL in 't' */
+    if (ue_resolve(h, list, t, url, len) != M_OK)
         goto failed;
 
-cache_check:
     /* if we can't add this to the cache, it's probably already crawled or added to the list. 
      * and if so, we should remoev it from the list again and thus discard it */
 
-    if (t->flags & LM_URL_EXTERNAL) {
-        /* url is external, we can't use the current cache since that
-         * cache is for the current host name only. We must find a matching
-         * cache for the given host */
-        uint16_t len = t->host_l-(LM_URL_ISSET(t, LM_URL_WWW_PREFIX)?4:0);
-        uint16_t o   = t->host_o+(LM_URL_ISSET(t, LM_URL_WWW_PREFIX)?4:0);
-        struct host_ent *ent = ue_get_hostent(h, t->str+o, len, 1);
+    /* most links on a page have been seen before, the pre-filter 
+     * lets us find out without taking any lock */
+    fp = lm_fpset_hash(t->str+t->host_o, t->sz-t->host_o);
+    if (ue_filter_check(h->parent, fp))
+        goto failed;
+
+    ent = ue_url_hostent(h, t, 0);
 
-        pthread_mutex_lock(&ent->lock);
-        if (!mtrie_tryadd(&ent->cache, t)) {
-            pthread_mutex_unlock(&ent->lock);
+    pthread_mutex_lock(&ent->lock);
+    added = ue_seen(ent, t, fp);
+    pthread_mutex_unlock(&ent->lock);
+
+    ue_filter_add(h->parent, fp);
+
+    if (!added)
+        goto failed;
+
+    return M_OK;
+
+failed:
+    list->sz--;
+    return M_FAILED;
+}
+
+/* a link of ue_add_batch() that passed the pre-filter */
+struct ue_link_ent {
+    struct host_ent *ent;
+    uint64_t         fp;
+    size_t           row; /* index in the top list */
+};
+
+static int
+ue_link_ent_cmp(const void *a, const void *b)
+{
+    const struct ue_link_ent *x = a, *y = b;
+
+    if (x->ent != y->ent)
+        return ((uintptr_t)x->ent < (uintptr_t)y->ent ? -1 : 1);
+
+    return (x->row < y->row ? -1 : (x->row > y->row));
+}
+
+/** 
+ * Add num relative or absolute URLs found on the current
+ * page, like calling ue_add() for each of them. 
+ *
+ * All links are resolved first and those known by the 
+ * pre-filter are dropped right away. The rest are grouped
+ * by host, and each host entry is locked once for its 
+ * whole group instead of once per link. Links of one host
+ * usually follow each other on a page, so the host entry
+ * of the previous external link is tried before a lookup.
+ *
+ * Added URLs keep the order they were given in. If the list
+ * can not grow, the links left are given to ue_add() one by
+ * one. Returns M_OK if at least one URL was added.
+ **/
+M_CODE
+ue_add_batch(uehandle_t *h, const ue_link_t *links, int num)
+{
+    url_t   *t;
+    ulist_t *list;
+    size_t   first, x, y;
+    int      n, i, added, rest = num;
+    uint8_t *keep;
+    uint64_t fp;
+    struct host_ent    *ent, *last = 0;
+    struct ue_link_ent *b;
+
+    if (num <= 0)
+        return M_FAILED;
+    if (num == 1)
+        return ue_add(h, links->ptr, links->len);
+
+    if (!(list = lm_utable_top(&h->primary)))
+        return M_FAILED;
+    if (!(b = malloc(num*(sizeof(struct ue_link_ent)+1))))
+        return M_OUT_OF_MEM;
+    keep = (uint8_t*)(b+num);
+    memset(keep, 0, num);
+
+    first = list->sz;
+
+    for (i=0, n=0; i<num; i++) {
+        if (!(t = lm_ulist_inc(list))) {
+            rest = i;
+            break;
+        }
+
+        if (ue_resolve(h, list, t, links[i].ptr, links[i].len) != M_OK) {
             list->sz--;
-            return M_FAILED;
+            continue;
         }
-        pthread_mutex_unlock(&ent->lock);
-    } else {
-        /* lock the current cache and add the URL */
-        pthread_mutex_lock(&h->host_ent->lock);
-        if (!mtrie_tryadd(&h->host_ent->cache, t)) {
-            pthread_mutex_unlock(&h->host_ent->lock);
+
+        fp = lm_fpset_hash(t->str+t->host_o, t->sz-t->host_o);
+        if (ue_filter_check(h->parent, fp)) {
             list->sz--;
-            return M_FAILED;
+            continue;
+        }
+
+        ent = ue_url_hostent(h, t, last);
+        if (t->flags & LM_URL_EXTERNAL)
+            last = ent;
+
+        b[n].ent = ent;
+        b[n].fp  = fp;
+        b[n].row = list->sz-1;
+        n++;
+    }
+
+    qsort(b, n, sizeof(struct ue_link_ent), &ue_link_ent_cmp);
+
+    for (i=0, added=0; i<n;) {
+        ent = b[i].ent;
+
+        pthread_mutex_lock(&ent->lock);
+        do {
+            if (ue_seen(ent, &list->row[b[i].row], b[i].fp)) {
+                keep[b[i].row-first] = 1;
+                added++;
+            }
+        } while (++i<n && b[i].ent == ent);
+        pthread_mutex_unlock(&ent->lock);
+    }
+
+    for (i=0; i<n; i++)
+        ue_filter_add(h->parent, b[i].fp);
+
+    /* move the added URLs down over the rejected ones, rows 
+     * are swapped so that no string buffer is lost */
+    for (x=first, y=first; x<list->sz; x++) {
+        if (keep[x-first]) {
+            if (x != y) {
+                url_t tmp    = list->row[y];
+                list->row[y] = list->row[x];
+                list->row[x] = tmp;
+            }
+            y++;
         }
-        pthread_mutex_unlock(&h->host_ent->lock);
     }
+    list->sz = y;
+
+    free(b);
+
+    /* with the rejected rows gone, there might be room for
+     * the links left, otherwise ue_add() fails like it would
+     * have without the batch */
+    for (i=rest; i<num; i++)
+        if (ue_add(h, links[i].ptr, links[i].len) == M_OK)
+            added++;
+
+    return (added ? M_OK : M_FAILED);
+}
+
+/** 
+ * Collect a link for ue_add_batch(). The link is not copied,
+ * url must stay valid until ue_add_flush() is called, which
+ * happens here too once UE_LINKS_BATCH links are collected.
+ * Parsers that find many links on a page use this instead
+ * of ue_add() and flush before they return.
+ **/
+M_CODE
+ue_add_deferred(uehandle_t *h, const char *url, uint16_t len)
+{
+    h->links.link[h->links.sz].ptr = url;
+    h->links.link[h->links.sz].len = len;
+
+    if (++h->links.sz == UE_LINKS_BATCH)
+        return ue_add_flush(h);
 
     return M_OK;
+}
 
-failed:
-    list->sz--;
-    return M_FAILED;
+/** 
+ * Add the links collected by ue_add_deferred()
+ **/
+M_CODE
+ue_add_flush(uehandle_t *h)
+{
+    int num = h->links.sz;
+
+    if (!num)
+        return M_OK;
+
+    h->links.sz = 0;
+    return ue_add_batch(h, h->links.link, num);
 }
 
 
@@ -258,86 +736,249 @@ failed:
 M_CODE
 ue_set_host(uehandle_t *h, const char *host, uint16_t host_sz)
 {
+    struct host_ent *ent;
+
     if (host_sz > 4 && strncasecmp(host, "www.", 4) == 0) {
         host+=4;
         host_sz-=4;
     }
 
-    h->host_ent = ue_get_hostent(h, host, host_sz, 0);
-
-    if (!h->host_ent) {
+    if (!(ent = ue_get_hostent(h, host, host_sz, 0))) {
         /*lm_error("internal: find/create host entry '%s' failed, file a bug report\n", host);*/
         abort();
     }
 
+    ue_host_switch(h, ent, 1);
+
     return M_OK;
 }
 
+/** 
+ * Make ent the current host of the handle. The handle holds
+ * its current host, see host_ent.holders, and the previous
+ * host is retired once nothing holds it anymore, unless 
+ * 'retire' is 0.
+ **/
+static void
+ue_host_switch(uehandle_t *h, struct host_ent *ent, int retire)
+{
+    struct host_ent *prev = h->host_ent;
+
+    if (prev == ent)
+        return;
+
+    ue_host_hold(ent);
+    h->host_ent = ent;
+    ue_host_unhold(h, prev, retire);
+}
+
+/** 
+ * Count one more holder of the host's URLs, see 
+ * host_ent.holders. A handle that starts an external peek
+ * holds the host it will return to.
+ **/
+void
+ue_host_hold(struct host_ent *ent)
+{
+    if (ent)
+        __sync_add_and_fetch(&ent->holders, 1);
+}
+
+/** 
+ * Drop a hold taken by ue_host_hold(). If it was the last
+ * one and 'retire' is set, the host is retired if nothing 
+ * of it is left to crawl, see ue_retire().
+ **/
+void
+ue_host_unhold(uehandle_t *h, struct host_ent *ent, int retire)
+{
+    if (ent && __sync_sub_and_fetch(&ent->holders, 1) == 0 && retire)
+        ue_retire(h, ent);
+}
+
 /** 
  * Called by ue_set_host() and ue_move_to_secondary()
  *
  * If a matching host entry does not exists, it will be
  * created. So this function *should* always return a 
  * valid pointer unless something goes really wrong.
+ *
+ * The host table is first searched without any locking. 
+ * If that fails, either the host is new or it was being 
+ * moved by a growing table, so the search is done again 
+ * with ue->hosts.lock held before a new entry is created.
  **/
 struct host_ent *
 ue_get_hostent(uehandle_t *h, const char *host, uint16_t host_sz, int add_pending)
 {
-    struct host_ent *p, *last = 0;
-    uint16_t n = host_sz;
-    ue_t *ue = h->parent;
-    pthread_rwlock_t *rwl;
-
-    n = ((((n << 1) ^ *host) << 1) ^ *(host+host_sz-1)) & 0x3f;
-    p = ue->secondary[n].hosts[host_sz & 7];
-    rwl = &ue->secondary[n].rwlock;
-
-    /** 
-     * Lock the secondary table for reading, so we can find a matching
-     * host entry. If the host entry is not found, we will re-lock
-     * the n'th entry in the secondary table again, but for writing
-     * that time.
-     **/
-    pthread_rwlock_rdlock(rwl);
-
-    while (p) {
-        if (p->len == host_sz && strncasecmp(host, p->str, host_sz) == 0)
-            break;
-        last = p;
-        p = p->next;
-    }
-
-    if (!p) {
-        /* no matching host entry was found, we must add one to last->next */
-
-        /* relock the table */
-        pthread_rwlock_unlock(rwl);
-        pthread_rwlock_wrlock(rwl);
-        struct host_ent **np;
-
-        /* there is a SLIGHT possibility that another thread 
-         * added the host between the unlock and wrlock call (possibly,
-         * another worker could have locked rwl for writing while we had it locked 
-         * for reading), thus we must check again if the host entry still does 
-         * not exists */
-        if (!*(np = (last?&last->next:&ue->secondary[n].hosts[host_sz & 7]))) {
-            /* still didnt exists, so we create it */
-            if (!(p = ue_hostent_create(h, host, host_sz, n, add_pending))) {
-                pthread_rwlock_unlock(rwl);
-                return 0;
-            }
+    struct host_ent *p;
+    ue_t    *ue   = h->parent;
+    uint32_t hash = (uint32_t)lm_fpset_hash(host, host_sz);
+
+    if ((p = ue_hostcache_find(h, host, host_sz, hash)))
+        return p;
 
-            *np = p;
-        } else
-            p = *np;
+    if ((p = ue_hosts_find(ue, host, host_sz, hash))) {
+        ue_hostcache_put(h, p, UE_HOSTCACHE_SIZE-1);
+        return p;
     }
 
-    pthread_rwlock_unlock(rwl);
+    pthread_mutex_lock(&ue->hosts.lock);
 
-    return p;
-}
+    if (!(p = ue_hosts_find(ue, host, host_sz, hash))) {
+        /* still didnt exists, so we create it */
+        if ((p = ue_hostent_create(h, host, host_sz, hash, add_pending)))
+            ue_hosts_add(ue, p);
+    }
+
+    pthread_mutex_unlock(&ue->hosts.lock);
 
+    if (p)
+        ue_hostcache_put(h, p, UE_HOSTCACHE_SIZE-1);
 
+    return p;
+}
+
+/** 
+ * Search the host cache of the handle, see uehandle_t. A hit
+ * is moved to the front. Nothing shared is written, the 
+ * only shared read is ue->hosts.gen.
+ **/
+static struct host_ent *
+ue_hostcache_find(uehandle_t *h, const char *host, uint16_t len, uint32_t hash)
+{
+    struct host_ent *p;
+    int x;
+
+    if (h->hostcache.gen != h->parent->hosts.gen) {
+        memset(h->hostcache.ent, 0, sizeof(h->hostcache.ent));
+        h->hostcache.gen = h->parent->hosts.gen;
+        return 0;
+    }
+
+    for (x=0; x<UE_HOSTCACHE_SIZE && (p = h->hostcache.ent[x]); x++) {
+        if (h->hostcache.hash[x] == hash && p->len == len
+                && strncasecmp(host, p->str, len) == 0) {
+            if (x)
+                ue_hostcache_put(h, p, x);
+            return p;
+        }
+    }
+
+    return 0;
+}
+
+/** 
+ * Put p first in the host cache of the handle. Entry n, the
+ * old place of p or the last one, is overwritten by moving 
+ * the entries before it one step back.
+ **/
+static void
+ue_hostcache_put(uehandle_t *h, struct host_ent *p, int n)
+{
+    memmove(h->hostcache.ent+1, h->hostcache.ent, n*sizeof(struct host_ent *));
+    memmove(h->hostcache.hash+1, h->hostcache.hash, n*sizeof(uint32_t));
+    h->hostcache.ent[0] = p;
+    h->hostcache.hash[0] = p->hash;
+}
+
+/** 
+ * Search the host table. Safe to call without ue->hosts.lock,
+ * but might then miss an entry that is being moved from the 
+ * old table to the new one.
+ **/
+static struct host_ent *
+ue_hosts_find(ue_t *ue, const char *host, uint16_t len, uint32_t hash)
+{
+    struct ue_hosttab *t;
+    struct host_ent   *p;
+
+    for (t = ue->hosts.cur; t; t = (t == ue->hosts.cur ? ue->hosts.old : 0)) {
+        for (p = t->buckets[hash & t->mask]; p; p = p->next) {
+            if (p->hash == hash && p->len == len 
+                    && strncasecmp(host, p->str, len) == 0)
+                return p;
+        }
+    }
+
+    return 0;
+}
+
+/** 
+ * Add a new host entry to the host table, ue->hosts.lock must 
+ * be held. If the table is growing, UE_HOSTS_MIGRATE buckets 
+ * are moved from the old table to the new one first.
+ *
+ * Entries are fully set up before they are linked in, and 
+ * are never freed while the table is in use, so lock-free 
+ * readers always see valid entries. A reader walking a chain
+ * while an entry is moved might end up on the new chain and
+ * miss the rest of the old one, which is why ue_get_hostent()
+ * searches again with the lock held.
+ **/
+static void
+ue_hosts_add(ue_t *ue, struct host_ent *p)
+{
+    struct ue_hosttab *old, *cur;
+    struct host_ent   *e;
+    struct host_ent * volatile *b;
+    int x;
+
+    if ((old = ue->hosts.old)) {
+        cur = ue->hosts.cur;
+        for (x=0; x<UE_HOSTS_MIGRATE && ue->hosts.migrated <= old->mask; x++) {
+            b = &old->buckets[ue->hosts.migrated++];
+            while ((e = *b)) {
+                *b = e->next;
+                e->next = cur->buckets[e->hash & cur->mask];
+                __sync_synchronize();
+                cur->buckets[e->hash & cur->mask] = e;
+            }
+        }
+        if (ue->hosts.migrated > old->mask)
+            ue->hosts.old = 0; /* still on cur's retired list */
+    } else if (ue->hosts.count > ue->hosts.cur->mask) {
+        /* more entries than buckets, if we are out of memory 
+         * the chains will just get longer */
+        ue_hosts_grow(ue);
+    }
+
+    cur = ue->hosts.cur;
+    p->next = cur->buckets[p->hash & cur->mask];
+    __sync_synchronize();
+    cur->buckets[p->hash & cur->mask] = p;
+    ue->hosts.count ++;
+}
+
+/** 
+ * Replace the table with one twice the size. The entries are 
+ * left in the old table and moved over by ue_hosts_add(). The
+ * old table is not freed until ue_uninit(), since lock-free 
+ * readers might still be using it. All replaced tables 
+ * together are smaller than the current one.
+ **/
+static M_CODE
+ue_hosts_grow(ue_t *ue)
+{
+    struct ue_hosttab *t;
+    uint32_t size = (ue->hosts.cur->mask+1)*2;
+
+    if (!(t = calloc(1, sizeof(struct ue_hosttab)+size*sizeof(struct host_ent*))))
+        return M_OUT_OF_MEM;
+
+#ifdef DEBUG
+    fprintf(stderr, "* ue:(%p) growing host table to %u buckets\n", ue, size);
+#endif
+
+    t->mask     = size-1;
+    t->retired  = ue->hosts.cur;
+    ue->hosts.migrated = 0;
+    ue->hosts.old = ue->hosts.cur;
+    __sync_synchronize();
+    ue->hosts.cur = t;
+
+    return M_OK;
+}
 
 /** 
  * Set the current host using a host_ent
@@ -347,18 +988,34 @@ ue_get_hostent(uehandle_t *h, const char *host, uint16_t host_sz, int add_pendin
 M_CODE
 ue_set_hostent(uehandle_t *h, struct host_ent *ent)
 {
-    h->host_ent = ent;
+    ue_host_switch(h, ent, 1);
 
     ulist_t *top;
     if (lm_utable_inc(&h->primary) == M_OK
         && (top = lm_utable_top(&h->primary))) {
         int x;
+        size_t cost = 0;
+        spillref_t *r;
+
+        pthread_mutex_lock(&ent->lock);
         for (x=0; x<ent->list.sz; x++) {
             url_t *t = lm_ulist_inc(top);
+            cost += UE_URL_COST(&ent->list.row[x]);
             lm_url_swap(t, &ent->list.row[x]);
         }
+        for (r = ent->list.spilled; r; r = r->next)
+            cost += LM_SPILL_REF_COST(r);
 
         lm_ulist_uninit(&ent->list);
+
+        /* the spilled URLs are read back by ue_next() once
+         * the ones in memory are used up */
+        top->spilled = ent->list.spilled;
+        ent->list.spilled = 0;
+        ent->backlog = 0;
+        pthread_mutex_unlock(&ent->lock);
+
+        __sync_fetch_and_sub(&h->parent->frontier.lists, cost);
     } else {
         /*lm_error("increasing primary utable failed, file a bug report\n");*/
         abort();
@@ -384,7 +1041,7 @@ ue_next(uehandle_t *h)
 
     if (h->depth_limit) {
         while (h->depth_counter >= h->depth_limit) {
-            lm_utable_dec(&h->primary);
+            ue_level_dec(h);
             h->depth_counter --;
         }
     }
@@ -392,10 +1049,24 @@ ue_next(uehandle_t *h)
     if (!(top = lm_utable_top(&h->primary)))
         return 0;
     while (!(url = lm_ulist_pop(top))) {
+        if (top->spilled) {
+            /* more URLs of this list are on disk */
+            spillref_t *r = top->spilled;
+            top->spilled = r->next;
+            if (lm_spill_read(&h->parent->frontier.disk, r, top) != M_OK) {
+#ifdef DEBUG
+                fprintf(stderr, "* uehandle:(%p) reading spilled URLs failed\n", h);
+#endif
+            }
+            continue;
+        }
+        if (h->shared.count && ue_reclaim(h, top))
+            continue;
+
         /* popping a URL from the current list failed...
          * we'll try to decrease the utable size to 
          * get the next (or actually the previous) list */
-        if (lm_utable_dec(&h->primary) != M_OK || !(top = lm_utable_top(&h->primary))) {
+        if (ue_level_dec(h) != M_OK || !(top = lm_utable_top(&h->primary))) {
             return 0;
         }
 
@@ -407,16 +1078,29 @@ ue_next(uehandle_t *h)
             h->depth_counter = h->depth_counter_bk;
             h->depth_limit   = h->depth_limit_bk;
             h->is_peeking    = 0;
-            ue_set_host(h, h->host_ent_bk->str, h->host_ent_bk->len);
+            ue_host_switch(h, h->host_ent_bk, 1);
+            ue_host_unhold(h, h->host_ent_bk, 0);
 
             if (h->depth_counter >= h->depth_limit) {
-                if (lm_utable_dec(&h->primary) != M_OK || !(top = lm_utable_top(&h->primary))) {
+                if (ue_level_dec(h) != M_OK || !(top = lm_utable_top(&h->primary))) {
                     return 0;
                 }
             }
         }
     }
 
+    /* the list below the one the URL was popped from will
+     * not be touched until everything found from this URL
+     * has been crawled */
+    if (h->parent->frontier.pack && h->primary.sz >= 2)
+        ue_pack_level(&h->primary.row[h->primary.sz-2]);
+
+    if (h->parent->frontier.budget) {
+        ue_levels_update(h);
+        if (ue_over_budget(h->parent))
+            ue_spill_levels(h);
+    }
+
     h->state_info = lm_utable_top(&h->primary)->private;
     /* increase the size of the utable so that our found URLs
      * will be put in the next list and not the current */
@@ -482,6 +1166,7 @@ ue_move_to_secondary(uehandle_t *h, url_t *url)
     uint16_t host_o;
     uint16_t host_l;
     char     *host;
+    uint32_t n;
 
     if (LM_URL_ISSET(url, LM_URL_WWW_PREFIX)) {
         host_o = url->host_o+4;
@@ -497,24 +1182,249 @@ ue_move_to_secondary(uehandle_t *h, url_t *url)
 
     pthread_mutex_lock(&p->lock);
     url_t *t = lm_ulist_inc(&p->list);
-    lm_url_swap(t, url);
+    if (t) {
+        /* the host's list outlives the level the URL is in */
+        lm_url_detach(url);
+        lm_url_swap(t, url);
+        p->backlog ++;
+        __sync_fetch_and_add(&h->parent->frontier.lists, UE_URL_COST(t));
+
+        if (p->list.sz >= UE_SPILL_MIN_LIST && ue_over_budget(h->parent))
+            ue_spill_list(h->parent, p);
+        else if (p->list.sz >= UE_PACK_CHUNK && h->parent->frontier.pack)
+            ue_pack_list(h->parent, p);
+    }
     pthread_mutex_unlock(&p->lock);
 
+    /* move the host up in its pending queue each time its
+     * number of in-links doubles */
+    n = __sync_add_and_fetch(&p->inlinks, 1);
+    if (!(n & (n-1)) && p->pending_pos != UE_PENDING_NONE)
+        ue_pending_update(h->parent, p);
+
     return M_OK;
 }
 
+/** 
+ * Write the list of the given host entry to disk, p->lock
+ * must be held. Any host entry with URLs in its list is one
+ * no worker is crawling at the moment, so we do not bother
+ * picking the coldest one, the list that just grew past 
+ * UE_SPILL_MIN_LIST is spilled.
+ **/
+static void
+ue_spill_list(ue_t *ue, struct host_ent *p)
+{
+    spillref_t *r;
+    size_t cost = 0;
+    size_t x;
+
+    if (lm_spill_write(&ue->frontier.disk, &p->list, 0, p->list.sz, &r) != M_OK)
+        return;
+
+    for (x=0; x<p->list.sz; x++)
+        cost += UE_URL_COST(&p->list.row[x]);
+
+#ifdef DEBUG
+    fprintf(stderr, "* ue:(%p) spilled %u URLs of '%s'\n", ue, r->count, p->str);
+#endif
+
+    r->next = p->list.spilled;
+    p->list.spilled = r;
+    lm_ulist_uninit(&p->list);
+
+    __sync_fetch_and_sub(&ue->frontier.lists, cost);
+}
+
+/**
+ * Front code the URLs in the list of the given host entry, 
+ * p->lock must be held. The run is kept with the spilled 
+ * ones and read back the same way once a worker picks the 
+ * host.
+ **/
+static void
+ue_pack_list(ue_t *ue, struct host_ent *p)
+{
+    spillref_t *r;
+    size_t cost = 0;
+    size_t x;
+
+    if (lm_spill_pack(&p->list, 0, p->list.sz, &r) != M_OK)
+        return;
+
+    for (x=0; x<p->list.sz; x++)
+        cost += UE_URL_COST(&p->list.row[x]);
+
+    r->next = p->list.spilled;
+    p->list.spilled = r;
+    lm_ulist_uninit(&p->list);
+
+    __sync_fetch_and_add(&ue->frontier.lists, LM_SPILL_REF_COST(r));
+    __sync_fetch_and_sub(&ue->frontier.lists, cost);
+}
+
+/**
+ * Front code a utable level that is below the one being
+ * crawled, in runs of UE_PACK_CHUNK URLs that ue_next() 
+ * decodes one at a time when it gets back to the level.
+ * A level is only packed when it has more than one run of
+ * URLs in memory, so the run decoded last is not packed
+ * again each time the worker goes down a level. Like in 
+ * ue_spill_levels(), the runs are kept first to last ahead
+ * of the ones the level already had.
+ **/
+static void
+ue_pack_level(ulist_t *l)
+{
+    spillref_t *r, *first = 0, **last = &first;
+    size_t start, end;
+
+    if (l->sz < UE_PACK_MIN_LEVEL)
+        return;
+
+    for (end=l->sz; end>0; end=start) {
+        start = end > UE_PACK_CHUNK ? end-UE_PACK_CHUNK : 0;
+        if (lm_spill_pack(l, start, end, &r) != M_OK)
+            break;
+        *last = r;
+        last  = &r->next;
+        l->sz = start;
+    }
+    *last = l->spilled;
+    l->spilled = first;
+
+    if (!l->sz)
+        lm_ulist_uninit(l);
+}
+
+/** 
+ * Remove the top list of the utable, dropping any of its 
+ * URLs that are on disk
+ **/
+static M_CODE
+ue_level_dec(uehandle_t *h)
+{
+    ulist_t *top;
+    spillref_t *r, *next;
+
+    if ((top = lm_utable_top(&h->primary))) {
+        for (r = top->spilled; r; r = next) {
+            next = r->next;
+            lm_spill_drop(&h->parent->frontier.disk, r);
+        }
+        top->spilled = 0;
+    }
+
+    return lm_utable_dec(&h->primary);
+}
+
+/** 
+ * Estimate the memory used by the handle's utable and update
+ * the engine's total. Counting the bytes of each URL would 
+ * mean walking every list, so URL strings are assumed to be
+ * UE_URL_EST bytes. Lists above the top still count, since
+ * lm_utable_dec() keeps their memory around.
+ **/
+static void
+ue_levels_update(uehandle_t *h)
+{
+    spillref_t *r;
+    size_t x, est = 0;
+
+    for (x=0; x<h->primary.cap; x++)
+        est += h->primary.row[x].cap*sizeof(url_t)
+               + (x < h->primary.sz ? h->primary.row[x].sz*UE_URL_EST : 0);
+    for (x=0; x<h->primary.sz; x++)
+        for (r = h->primary.row[x].spilled; r; r = r->next)
+            est += LM_SPILL_REF_COST(r);
+    est += h->shared.urls*(sizeof(url_t)+UE_URL_EST);
+
+    if (est > h->level_mem)
+        __sync_fetch_and_add(&h->parent->frontier.levels, est-h->level_mem);
+    else
+        __sync_fetch_and_sub(&h->parent->frontier.levels, h->level_mem-est);
+    h->level_mem = est;
+}
+
+/** 
+ * Called by ue_next() when the frontier is over its memory 
+ * budget, with the list of the URL just popped on top. The 
+ * lists below it are not needed until the top one and 
+ * everything found from it has been crawled, so they are 
+ * written to disk in runs of UE_SPILL_CHUNK URLs, which
+ * ue_next() reads back one at a time. Lists above the top
+ * are empty and are freed.
+ *
+ * URLs are popped from the end of a list, so the runs are 
+ * cut from the end and kept first to last, ahead of any 
+ * runs the list already had. ue_next() reads them back in
+ * the order the URLs would have been popped. A list of which
+ * a run can not be written is left in memory as it was.
+ **/
+static void
+ue_spill_levels(uehandle_t *h)
+{
+    ulist_t *l;
+    spillref_t *r, *next, *first, **last;
+    size_t x, start, end, sz;
+
+    for (x=h->primary.sz; x<h->primary.cap; x++)
+        if (h->primary.row[x].cap)
+            lm_ulist_uninit(&h->primary.row[x]);
+
+    for (x=0; x+1<h->primary.sz; x++) {
+        l = &h->primary.row[x];
+        if (l->sz < UE_SPILL_MIN_LEVEL)
+            continue;
+
+        first = 0;
+        last  = &first;
+        sz    = l->sz;
+        for (end=l->sz; end>0; end=start) {
+            start = end > UE_SPILL_CHUNK ? end-UE_SPILL_CHUNK : 0;
+            if (lm_spill_write(&h->parent->frontier.disk, l, start, end, &r) != M_OK)
+                break;
+            *last = r;
+            last  = &r->next;
+            l->sz = start;
+        }
+        if (l->sz) {
+            /* the rows still in memory would be popped before
+             * the runs cut above them, give the runs back. The
+             * rows are left as they were by lm_spill_write() */
+            for (r = first; r; r = next) {
+                next = r->next;
+                lm_spill_drop(&h->parent->frontier.disk, r);
+            }
+            l->sz = sz;
+            continue;
+        }
+        *last = l->spilled;
+        l->spilled = first;
+
+#ifdef DEBUG
+        fprintf(stderr, "* uehandle:(%p) spilled level %u, %u URLs\n", 
+                h, (unsigned)x, (unsigned)sz);
+#endif
+
+        lm_ulist_uninit(l);
+    }
+
+    ue_levels_update(h);
+}
+
 /**
  * Create a host name entry.
  *
  * If 'add_pending' is set to 1, the host will be added to the
  * url engine's pending stack.
  *
- * secondary_n should be the position in ue_t->secondary in which this
- * host entry is going to be added.
+ * hash is the value from lm_fpset_hash() the entry is 
+ * going to be added to the host table with.
  **/
 static struct host_ent *
 ue_hostent_create(uehandle_t *h, const char *str,
-                  uint16_t len, int secondary_n, int add_pending)
+                  uint16_t len, uint32_t hash, int add_pending)
 {
     struct host_ent *p;
 
@@ -526,11 +1436,12 @@ ue_hostent_create(uehandle_t *h, const char *str,
     }
 
     pthread_mutex_init(&p->lock, 0);
+    p->use_fp = (h->fingerprints != 0);
 
     memcpy(p->str, str, len);
     p->str[len] = '\0';
     p->len = len;
-    p->secondary_n = secondary_n;
+    p->hash = hash;
 
 #ifdef DEBUG
     fprintf(stderr, "* uehandle:(%p) created new host entry for '%s'\n", h, p->str);
@@ -542,105 +1453,961 @@ ue_hostent_create(uehandle_t *h, const char *str,
         ue_push_pending(h, p);
     else {
         p->pending = 0;
-        p->pending_pos = 0;
+        p->pending_pos = UE_PENDING_NONE;
     }
 
     return p;
 }
 
+/**
+ * Called by mtrie_walk() from ue_retire()
+ **/
+static void
+ue_retire_cb(void *arg, const char *s, uint16_t len)
+{
+    struct ue_fpbuf *b = arg;
+    uint64_t *a;
+
+    if (b->n == b->cap) {
+        if (b->err || !(a = realloc(b->a, (b->cap ? b->cap*2 : 64)*sizeof(uint64_t)))) {
+            b->err = 1;
+            return;
+        }
+        b->a = a;
+        b->cap = (b->cap ? b->cap*2 : 64);
+    }
+
+    b->a[b->n++] = lm_fpset_hash(s, len);
+}
+
+/**
+ * Called when the last holder of a host lets go of it, see
+ * ue_host_unhold(). If nothing of the host is left to crawl,
+ * that is no handle or shared batch holds it and its list
+ * is empty, its seen-set is replaced by a sorted 
+ * array of the fingerprints of the URLs, 8 bytes per URL, 
+ * and the mtrie or fpset is freed. Over a long crawl with 
+ * external crawlers, most hosts are finished and never 
+ * linked to again.
+ *
+ * A host that is linked to again is revived by ue_seen(), 
+ * see ue_revive(). The mtrie can not be rebuilt from the 
+ * fingerprints, so a revived host keeps using an fpset. 
+ * lm_fpset_hash() folds characters the way the mtrie does,
+ * so the strings walked out of the mtrie, which come back 
+ * lower case for instance, give the fingerprints of the URLs
+ * as they were found.
+ *
+ * The host entry itself, with its lock and robots.txt 
+ * filter, is kept. Workers read the filter without the 
+ * lock, so it can not be freed here.
+ **/
 static void
-ue_hostent_free(struct host_ent *p)
+ue_retire(uehandle_t *h, struct host_ent *p)
 {
+    struct ue_fpbuf b = {0, 0, 0, 0};
+
+    if (!p)
+        return;
+
+    pthread_mutex_lock(&p->lock);
+    if (p->retired || p->holders || p->list.sz || p->list.spilled) {
+        pthread_mutex_unlock(&p->lock);
+        return;
+    }
+
+    if (p->use_fp)
+        b.a = lm_fpset_compact(&p->fp, &b.n);
+    else if (mtrie_walk(&p->cache, &ue_retire_cb, &b) != M_OK || b.err) {
+        free(b.a);
+        b.a = 0;
+    } else if (b.a) {
+        b.n = lm_fpset_sort(b.a, b.n);
+        mtrie_cleanup(&p->cache);
+    }
+
+    if (b.a) {
+#ifdef DEBUG
+        fprintf(stderr, "* uehandle:(%p) retired host '%s', %u URLs\n", h, p->str, b.n);
+#endif
+        p->retired  = b.a;
+        p->nretired = b.n;
+    }
+    pthread_mutex_unlock(&p->lock);
+}
+
+/**
+ * A new URL was found on a retired host, move its seen-set 
+ * back to an fpset. p->lock must be held.
+ **/
+static void
+ue_revive(struct host_ent *p)
+{
+    uint32_t x;
+
+#ifdef DEBUG
+    fprintf(stderr, "* ue:(%p) reviving host '%s'\n", p, p->str);
+#endif
+
+    p->use_fp = 1;
+    for (x=0; x<p->nretired; x++)
+        lm_fpset_tryadd_hash(&p->fp, p->retired[x]);
+
+    free(p->retired);
+    p->retired  = 0;
+    p->nretired = 0;
+}
+
+static void
+ue_hostent_free(ue_t *ue, struct host_ent *p)
+{
+    spillref_t *r, *next;
+
+    for (r = p->list.spilled; r; r = next) {
+        next = r->next;
+        lm_spill_drop(&ue->frontier.disk, r);
+    }
+
     pthread_mutex_destroy(&p->lock);
     mtrie_cleanup(&p->cache);
+    lm_fpset_uninit(&p->fp);
     lm_ulist_uninit(&p->list);
+    free(p->retired);
     free(p->str);
     free(p);
 }
 
+/**
+ * Move the URLs of one list to the end of another, in the
+ * order they are in
+ **/
+static void
+ue_batch_move(ulist_t *to, ulist_t *from)
+{
+    url_t *d;
+    size_t x;
+
+    for (x=0; x<from->sz; x++) {
+        if (!from->row[x].sz)
+            continue;
+        if (!(d = lm_ulist_inc(to)))
+            return;
+        lm_url_detach(&from->row[x]);
+        lm_url_detach(d);
+        lm_url_swap(&from->row[x], d);
+    }
+    from->sz = 0;
+}
+
+/**
+ * Offer the URLs of the top list that the worker is not going
+ * to get to soon to idle workers, called after the list has
+ * been sorted. ue_next() pops from the end of the list, so the
+ * last UE_SHARE_KEEP URLs are kept, and the rest are cut from 
+ * the low end in batches of UE_SHARE_BATCH and put at the tail
+ * of h->shared, from where any other handle can take them with
+ * ue_steal() without involving this one. If nobody does, 
+ * ue_next() takes them back once the top list is empty, the 
+ * batch cut last, the one closest to the kept URLs, first.
+ **/
+void
+ue_share(uehandle_t *h)
+{
+    ue_t    *ue = h->parent;
+    ulist_t *top;
+    url_t   *d;
+    size_t   x, cut = 0;
+    unsigned int n;
+    struct ue_batch  *b;
+    struct ue_batch **q;
+    uehandle_t **list;
+
+    if (!h->share || h->is_peeking
+            || !(top = lm_utable_top(&h->primary))
+            || top->sz < UE_SHARE_KEEP+UE_SHARE_BATCH
+            /* the list is about to be dropped by ue_next() */
+            || (h->depth_limit && h->depth_counter >= h->depth_limit))
+        return;
+
+    if (!h->shared.listed) {
+        pthread_mutex_lock(&ue->sharing.lock);
+        if ((list = realloc(ue->sharing.list, (ue->sharing.count+1)*sizeof(uehandle_t*)))) {
+            ue->sharing.list = list;
+            list[ue->sharing.count++] = h;
+            h->shared.listed = 1;
+        }
+        pthread_mutex_unlock(&ue->sharing.lock);
+        if (!h->shared.listed)
+            return;
+    }
+
+    while (top->sz-cut >= UE_SHARE_KEEP+UE_SHARE_BATCH) {
+        /* make room for the batch first, only this handle adds
+         * to h->shared, so the room is still there once the 
+         * batch is cut */
+        pthread_mutex_lock(&h->shared.lock);
+        if (h->shared.tail == h->shared.cap) {
+            /* move the batches to the start of the array 
+             * before growing it */
+            if (h->shared.head) {
+                memmove(h->shared.q, h->shared.q+h->shared.head, 
+                        (h->shared.tail-h->shared.head)*sizeof(struct ue_batch*));
+                h->shared.tail -= h->shared.head;
+                h->shared.head  = 0;
+            } else if ((q = realloc(h->shared.q, (h->shared.cap ? h->shared.cap*2 : 8)*sizeof(struct ue_batch*)))) {
+                h->shared.q    = q;
+                h->shared.cap  = h->shared.cap ? h->shared.cap*2 : 8;
+            } else {
+                pthread_mutex_unlock(&h->shared.lock);
+                break;
+            }
+        }
+        pthread_mutex_unlock(&h->shared.lock);
+
+        if (!(b = malloc(sizeof(struct ue_batch))))
+            break;
+        if (lm_ulist_init(&b->list, UE_SHARE_BATCH) != M_OK) {
+            free(b);
+            break;
+        }
+        for (n=0; n<UE_SHARE_BATCH && (d = lm_ulist_inc(&b->list)); n++, cut++) {
+            lm_url_detach(&top->row[cut]);
+            lm_url_detach(d);
+            lm_url_swap(&top->row[cut], d);
+        }
+        b->level         = h->primary.sz;
+        b->depth_counter = h->depth_counter;
+        b->state_info    = top->private;
+        b->host_ent      = h->host_ent;
+        ue_host_hold(b->host_ent);
+
+        pthread_mutex_lock(&h->shared.lock);
+        h->shared.q[h->shared.tail++] = b;
+        h->shared.count ++;
+        h->shared.urls += b->list.sz;
+        pthread_mutex_unlock(&h->shared.lock);
+    }
+
+    /* close the gap left by the batches */
+    if (cut) {
+        for (x=cut; x<top->sz; x++)
+            lm_url_swap(&top->row[x-cut], &top->row[x]);
+        top->sz -= cut;
+    }
+
+#ifdef DEBUG
+    fprintf(stderr, "* uehandle:(%p) sharing %u batches\n", h, h->shared.count);
+#endif
+}
+
+/**
+ * Called by ue_next() when the top list is empty, move the last
+ * batch given away by ue_share() back into it if it is still 
+ * there. Returns 1 if URLs were added.
+ **/
+static int
+ue_reclaim(uehandle_t *h, ulist_t *top)
+{
+    struct ue_batch *b = 0;
+
+    pthread_mutex_lock(&h->shared.lock);
+    if (h->shared.tail > h->shared.head
+            && h->shared.q[h->shared.tail-1]->level >= h->primary.sz) {
+        b = h->shared.q[--h->shared.tail];
+        h->shared.count --;
+        h->shared.urls -= b->list.sz;
+    }
+    pthread_mutex_unlock(&h->shared.lock);
+
+    if (!b)
+        return 0;
+
+    ue_batch_move(top, &b->list);
+    ue_host_unhold(h, b->host_ent, 1);
+    lm_ulist_uninit(&b->list);
+    free(b);
+
+    return 1;
+}
+
+/**
+ * Take URLs shared by another handle, called by idle workers.
+ * The handle with the most batches is picked, and up to half 
+ * of its batches are taken from the head, which holds the URLs
+ * its owner would have got to last. Only batches from the same list as
+ * the first one are taken, so that they can all be continued 
+ * with the same crawler, host and depth.
+ *
+ * h must be out of URLs. Returns M_FAILED if there was nothing
+ * to steal, otherwise the state info of the handle is set to
+ * that of the stolen URLs, see ue_get_state_info().
+ **/
+M_CODE
+ue_steal(uehandle_t *h)
+{
+    ue_t *ue = h->parent;
+    uehandle_t *v = 0;
+    struct ue_batch *b, *first;
+    ulist_t *top;
+    unsigned int x, n, max = 0;
+
+    if (!ue->sharing.count)
+        return M_FAILED;
+
+    pthread_mutex_lock(&ue->sharing.lock);
+    for (x=0; x<ue->sharing.count; x++) {
+        if (ue->sharing.list[x] != h && ue->sharing.list[x]->shared.count > max) {
+            v   = ue->sharing.list[x];
+            max = v->shared.count;
+        }
+    }
+    if (!v) {
+        pthread_mutex_unlock(&ue->sharing.lock);
+        return M_FAILED;
+    }
+    /* v can not be unshared while ue->sharing.lock is held */
+    pthread_mutex_lock(&v->shared.lock);
+    pthread_mutex_unlock(&ue->sharing.lock);
+
+    if (v->shared.tail == v->shared.head) {
+        pthread_mutex_unlock(&v->shared.lock);
+        return M_FAILED;
+    }
+
+    if (!lm_utable_top(&h->primary))
+        lm_utable_inc(&h->primary);
+    top = lm_utable_top(&h->primary);
+
+    first = v->shared.q[v->shared.head];
+    n = (v->shared.tail-v->shared.head+1)/2;
+
+    for (x=0; x<n; x++) {
+        b = v->shared.q[v->shared.head];
+        if (b->level != first->level || b->state_info != first->state_info
+                || b->host_ent != first->host_ent
+                || b->depth_counter != first->depth_counter)
+            break;
+        v->shared.head ++;
+        v->shared.count --;
+        v->shared.urls -= b->list.sz;
+
+        ue_batch_move(top, &b->list);
+        if (b != first) {
+            lm_ulist_uninit(&b->list);
+            free(b);
+        }
+    }
+    pthread_mutex_unlock(&v->shared.lock);
+
+#ifdef DEBUG
+    fprintf(stderr, "* uehandle:(%p) stole %u batches from %p\n", h, x, v);
+#endif
+
+    top->private     = first->state_info;
+    h->state_info    = first->state_info;
+    /* the batches hand their holds on the host to h */
+    ue_host_switch(h, first->host_ent, 1);
+    while (x--)
+        ue_host_unhold(h, first->host_ent, 0);
+    h->depth_counter = first->depth_counter;
+    h->is_peeking    = 0;
+    lm_ulist_uninit(&first->list);
+    free(first);
+
+    /* let others take part of what we took */
+    ue_share(h);
+
+    return M_OK;
+}
+
+/**
+ * Stop sharing URLs, the batches nobody took are moved back 
+ * to the lists they came from so that ue_handle_park() and
+ * lmetha_checkpoint() see them
+ **/
+static void
+ue_unshare(uehandle_t *h)
+{
+    ue_t *ue = h->parent;
+    struct ue_batch *b;
+    unsigned int x;
+
+    if (h->shared.listed) {
+        pthread_mutex_lock(&ue->sharing.lock);
+        for (x=0; x<ue->sharing.count; x++) {
+            if (ue->sharing.list[x] == h) {
+                ue->sharing.list[x] = ue->sharing.list[--ue->sharing.count];
+                break;
+            }
+        }
+        pthread_mutex_unlock(&ue->sharing.lock);
+        h->shared.listed = 0;
+    }
+
+    /* a thief that found the handle before it was removed
+     * might still be taking batches */
+    pthread_mutex_lock(&h->shared.lock);
+    for (x=h->shared.head; x<h->shared.tail; x++) {
+        b = h->shared.q[x];
+        if (b->level && b->level <= h->primary.sz)
+            ue_batch_move(&h->primary.row[b->level-1], &b->list);
+        ue_host_unhold(h, b->host_ent, 0);
+        lm_ulist_uninit(&b->list);
+        free(b);
+    }
+    h->shared.head  = 0;
+    h->shared.tail  = 0;
+    h->shared.count = 0;
+    h->shared.urls  = 0;
+    pthread_mutex_unlock(&h->shared.lock);
+}
+
+/**
+ * Compute the key a host is ordered by in its pending queue,
+ * the host with the highest key is crawled first. The score
+ * of the host is in the upper 32 bits, ties are broken by
+ * the order the hosts were pushed in.
+ **/
+static uint64_t
+ue_pending_key(ue_t *ue, struct host_ent *p)
+{
+    uint32_t score = 0;
+
+    switch (ue->pending.order) {
+        case UE_ORDER_LIFO:
+            return p->pending_seq;
+        case UE_ORDER_FIFO:
+            return ~p->pending_seq;
+
+        case UE_ORDER_INLINKS:
+            score = p->inlinks;
+            break;
+
+        case UE_ORDER_BACKLOG:
+        case UE_ORDER_CUSTOM:
+            /* the counter is read without p->lock, the
+             * value is only used as a hint */
+            if (ue->pending.order == UE_ORDER_BACKLOG)
+                score = p->backlog;
+            else if (ue->pending.score_cb)
+                score = ue->pending.score_cb(ue->pending.score_arg, p->str, p->inlinks, p->backlog);
+            break;
+    }
+
+    return ((uint64_t)score << 32) | (uint32_t)~p->pending_seq;
+}
+
+/**
+ * Move the entry at pos towards the root of the heap until
+ * its parent has a higher key, q->lock must be held
+ **/
+static void
+ue_pending_up(struct ue_pqueue *q, unsigned int pos)
+{
+    struct host_ent *p = q->heap[pos];
+    unsigned int parent;
+
+    while (pos > 0) {
+        parent = (pos-1)/2;
+        if (q->heap[parent]->pending_key >= p->pending_key)
+            break;
+        q->heap[pos] = q->heap[parent];
+        q->heap[pos]->pending_pos = pos;
+        pos = parent;
+    }
+
+    q->heap[pos] = p;
+    p->pending_pos = pos;
+}
+
+/**
+ * Move the entry at pos away from the root of the heap until
+ * its children have lower keys, q->lock must be held
+ **/
+static void
+ue_pending_down(struct ue_pqueue *q, unsigned int pos)
+{
+    struct host_ent *p = q->heap[pos];
+    unsigned int child;
+
+    while ((child = pos*2+1) < q->sz) {
+        if (child+1 < q->sz 
+                && q->heap[child+1]->pending_key > q->heap[child]->pending_key)
+            child ++;
+        if (q->heap[child]->pending_key <= p->pending_key)
+            break;
+        q->heap[pos] = q->heap[child];
+        q->heap[pos]->pending_pos = pos;
+        pos = child;
+    }
+
+    q->heap[pos] = p;
+    p->pending_pos = pos;
+}
+
 /** 
- * Add a host entry to the url engine's pending stack, if pos
- * is not 0, set the uint pointed to by it to which position
- * in the stack this host entry was added to.
+ * Insert a host entry into the given queue, q->lock must
+ * be held
  **/
 static M_CODE
-ue_push_pending(uehandle_t *h, struct host_ent *p)
+ue_pending_insert(ue_t *ue, struct ue_pqueue *q, struct host_ent *p)
 {
-    struct lm_pending_e_st *st = &h->parent->pending;
-    pthread_mutex_lock(&h->parent->pending_lk);
+    struct host_ent **heap;
 
-    if (st->sz >= st->cap) {
-        st->cap *= 2;
-        if (!(st->st = realloc(st->st, st->cap*sizeof(struct host_ent*)))) {
-            pthread_mutex_unlock(&h->parent->pending_lk);
+    if (q->sz >= q->cap) {
+        if (!(heap = realloc(q->heap, q->cap*2*sizeof(struct host_ent*))))
             return M_OUT_OF_MEM;
-        }
+        q->heap = heap;
+        q->cap *= 2;
     }
 
+    p->pending_seq = __sync_add_and_fetch(&ue->pending.seq, 1);
     p->pending     = 1;
-    p->pending_pos = st->sz;
-    st->st[st->sz] = p;
-    st->sz ++;
+    p->pending_key = ue_pending_key(ue, p);
+    q->heap[q->sz] = p;
+    ue_pending_up(q, q->sz++);
+    q->top = q->heap[0]->pending_key;
 
-    pthread_mutex_unlock(&h->parent->pending_lk);
     return M_OK;
 }
 
 /** 
- * Remove the given host entry from the pending stack. This does not 
- * affect the host entry itself other than modifying its pending and
- * pending_pos values.
+ * Add a host entry to the url engine's pending queue
  **/
-/*
-static M_CODE
-ue_remove_pending(uehandle_t *h, struct host_ent *p)
+M_CODE
+ue_push_pending(uehandle_t *h, struct host_ent *p)
+{
+    ue_t *ue = h->parent;
+    struct ue_pqueue *q = &ue->pending.shards[p->hash % UE_PENDING_SHARDS];
+    M_CODE r;
+
+    pthread_mutex_lock(&q->lock);
+    r = ue_pending_insert(ue, q, p);
+    pthread_mutex_unlock(&q->lock);
+
+    return r;
+}
+
+/** 
+ * Put back a URL that could not be fetched because its host
+ * is down, see ue_host_check(). The URL is moved to the list
+ * of the host, and the host is queued as pending again if it
+ * was popped already, so that a worker picks it up once its
+ * breaker lets a probe through, see ue_pending_take().
+ **/
+M_CODE
+ue_park(uehandle_t *h, struct host_ent *p, url_t *url)
+{
+    ue_t *ue = h->parent;
+    struct ue_pqueue *q = &ue->pending.shards[p->hash % UE_PENDING_SHARDS];
+    url_t *t;
+    M_CODE r = M_OK;
+
+#ifdef DEBUG
+    fprintf(stderr, "* uehandle:(%p) parking '%s' until '%s' is up\n", h, url->str, p->str);
+#endif
+
+    pthread_mutex_lock(&p->lock);
+    if (!(t = lm_ulist_inc(&p->list))) {
+        pthread_mutex_unlock(&p->lock);
+        return M_OUT_OF_MEM;
+    }
+    lm_url_detach(url);
+    lm_url_swap(t, url);
+    p->backlog ++;
+    __sync_fetch_and_add(&ue->frontier.lists, UE_URL_COST(t));
+    pthread_mutex_unlock(&p->lock);
+
+    pthread_mutex_lock(&q->lock);
+    if (p->pending_pos == UE_PENDING_NONE)
+        r = ue_pending_insert(ue, q, p);
+    pthread_mutex_unlock(&q->lock);
+
+    return r;
+}
+
+/**
+ * Recompute the key of a pending host and move it to its new
+ * position, called when something the key depends on changed
+ **/
+static void
+ue_pending_update(ue_t *ue, struct host_ent *p)
 {
-    struct lm_pending_e_st *st = &h->parent->pending;
+    struct ue_pqueue *q = &ue->pending.shards[p->hash % UE_PENDING_SHARDS];
+
+    if (ue->pending.order == UE_ORDER_LIFO || ue->pending.order == UE_ORDER_FIFO)
+        return;
 
-    pthread_mutex_lock(&h->parent->pending_lk);
+    pthread_mutex_lock(&q->lock);
+    /* it might have been popped while we waited for the lock */
+    if (p->pending_pos < q->sz && q->heap[p->pending_pos] == p) {
+        p->pending_key = ue_pending_key(ue, p);
+        ue_pending_up(q, p->pending_pos);
+        ue_pending_down(q, p->pending_pos);
+        q->top = q->heap[0]->pending_key;
+    }
+    pthread_mutex_unlock(&q->lock);
+}
 
-    if (p->pending) {
-        if (st->sz > 1) {
-            st->st[p->pending_pos] = st->st[st->sz-1];
-            st->st[p->pending_pos]->pending_pos = p->pending_pos;
-        } else {
-            st->st[0] = 0;
+/**
+ * Remove and return the first host of the given queue, q->lock
+ * must be held. If per-host politeness is enabled, the first 
+ * host among the top UE_PENDING_SCAN entries of the heap that 
+ * is ready to be crawled is taken instead, so that workers move
+ * on to hosts they can start fetching from right away. 
+ *
+ * Hosts that are down are never taken, 0 is returned if all
+ * of the top entries are down. They are taken once their
+ * breaker lets a probe through, see ue_host_done() and 
+ * ue_pending_due().
+ **/
+static struct host_ent *
+ue_pending_take(ue_t *ue, struct ue_pqueue *q)
+{
+    struct host_ent *p, *last;
+    struct host_ent **heap;
+    unsigned int x = 0;
+    uint64_t     now;
+
+    if (!q->sz)
+        return 0;
+
+    if (UE_POLITE(ue) || ue->host_max_failures) {
+        for (x=0; x<q->sz && x<UE_PENDING_SCAN; x++)
+            if (ue_host_ready(ue, q->heap[x]))
+                break;
+        if (x == q->sz || x == UE_PENDING_SCAN) {
+            /* none is ready, take the first one that is only
+             * waiting for its politeness delay */
+            now = ue_now_ms();
+            for (x=0; x<q->sz && x<UE_PENDING_SCAN; x++)
+                if (!ue_host_down(q->heap[x], now))
+                    break;
+            if (x == q->sz || x == UE_PENDING_SCAN)
+                return 0;
         }
-        p->pending = 0;
-        p->pending_pos = 0;
-        st->sz --;
     }
 
-    pthread_mutex_unlock(&h->parent->pending_lk);
+    p = q->heap[x];
+    p->pending_pos = UE_PENDING_NONE;
 
-    return M_OK;
+    if (x != --q->sz) {
+        /* fill the hole with the last entry */
+        last = q->heap[q->sz];
+        q->heap[x] = last;
+        ue_pending_up(q, x);
+        if (last->pending_pos == x)
+            ue_pending_down(q, x);
+    }
+    if (q->sz)
+        q->top = q->heap[0]->pending_key;
+
+    if (q->cap > 8 && q->sz <= q->cap/4) {
+        if ((heap = realloc(q->heap, q->cap/2*sizeof(struct host_ent*)))) {
+            q->heap = heap;
+            q->cap /= 2;
+        }
+    }
+
+    return p;
 }
-*/
 
 /** 
- * Return a pointer to the top pneding stack entry
+ * Remove and return the pending host with the highest key, or
+ * 0 if there is none. The shards' tops are compared without
+ * locking, and a shard that is busy is skipped in favour of 
+ * the next best one as long as there is one.
  **/
 struct host_ent*
 ue_pop_pending(uehandle_t *h)
 {
-    struct lm_pending_e_st *st = &h->parent->pending;
-    pthread_mutex_lock(&h->parent->pending_lk);
-
-    if (st->sz) {
-        st->sz--;
-        if (st->cap > 8 && st->sz <= st->cap/4) {
-            st->cap /= 2;
-            if (!(st->st = realloc(st->st, st->cap*sizeof(struct host_ent*)))) {
-                pthread_mutex_unlock(&h->parent->pending_lk);
-                return 0;
+    ue_t *ue = h->parent;
+    struct ue_pqueue *q;
+    struct host_ent  *p;
+    unsigned int tried, x, best;
+    int pass;
+
+    for (pass=0; pass<2; pass++) {
+        tried = 0;
+        do {
+            best = UE_PENDING_SHARDS;
+            for (x=0; x<UE_PENDING_SHARDS; x++) {
+                q = &ue->pending.shards[x];
+                if (!(tried & (1<<x)) && q->sz
+                        && (best == UE_PENDING_SHARDS 
+                            || q->top > ue->pending.shards[best].top))
+                    best = x;
             }
-        }
+            if (best == UE_PENDING_SHARDS)
+                break;
+
+            tried |= 1<<best;
+            q = &ue->pending.shards[best];
+
+            if (pass == 0) {
+                if (pthread_mutex_trylock(&q->lock) != 0)
+                    continue;
+            } else
+                pthread_mutex_lock(&q->lock);
 
-        pthread_mutex_unlock(&h->parent->pending_lk);
-        return st->st[st->sz];
+            p = ue_pending_take(ue, q);
+            pthread_mutex_unlock(&q->lock);
+
+            if (p)
+                return p;
+        } while (1);
     }
 
-    pthread_mutex_unlock(&h->parent->pending_lk);
     return 0;
 }
 
+/** 
+ * Current monotonic time in milliseconds
+ **/
+static uint64_t
+ue_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+/** 
+ * Return 1 if a transfer to the given host may be
+ * started right now
+ **/
+static int
+ue_host_ready(ue_t *ue, struct host_ent *ent)
+{
+    int ready;
+
+    pthread_mutex_lock(&ent->lock);
+    ready = (!ue->host_max_active || ent->active < ue->host_max_active)
+            && ent->next_fetch <= ue_now_ms();
+    pthread_mutex_unlock(&ent->lock);
+
+    return ready;
+}
+
+/** 
+ * Return 1 if the breaker of the given host keeps transfers
+ * to it from starting at the time 'now'
+ **/
+static int
+ue_host_down(struct host_ent *ent, uint64_t now)
+{
+    int down;
+
+    pthread_mutex_lock(&ent->lock);
+    down = (ent->breaker != UE_BREAKER_CLOSED && now < ent->retry_at);
+    pthread_mutex_unlock(&ent->lock);
+
+    return down;
+}
+
+/** 
+ * Return the number of ms until the first pending host that
+ * is down may be tried again, or 0 if no pending host is 
+ * down. A worker out of URLs waits for it rather than going
+ * idle, since the URLs parked by ue_park() would otherwise
+ * never be crawled.
+ **/
+int
+ue_pending_due(ue_t *ue)
+{
+    struct ue_pqueue *q;
+    struct host_ent  *p;
+    uint64_t now, due = 0;
+    unsigned int x, y;
+
+    if (!ue->host_max_failures)
+        return 0;
+
+    now = ue_now_ms();
+    for (x=0; x<UE_PENDING_SHARDS; x++) {
+        q = &ue->pending.shards[x];
+        pthread_mutex_lock(&q->lock);
+        for (y=0; y<q->sz; y++) {
+            p = q->heap[y];
+            pthread_mutex_lock(&p->lock);
+            if (p->breaker != UE_BREAKER_CLOSED && now < p->retry_at
+                    && (!due || p->retry_at < due))
+                due = p->retry_at;
+            pthread_mutex_unlock(&p->lock);
+        }
+        pthread_mutex_unlock(&q->lock);
+    }
+
+    return (due ? (int)(due - now) : 0);
+}
+
+/** 
+ * Try to start a transfer to the given host. If the host
+ * is ready, it is marked as busy and 0 is returned, the
+ * caller must then call ue_host_release() once the transfer
+ * is done. Otherwise, the number of milliseconds to wait 
+ * before trying again is returned. 'peek' should be set 
+ * for HEAD lookups, which use a shorter delay.
+ *
+ * The delay is counted from the start of the previous 
+ * transfer, using wall time.
+ **/
+int
+ue_host_acquire(ue_t *ue, struct host_ent *ent, int peek)
+{
+    uint64_t now;
+    int      wait = 0;
+
+    if (!UE_POLITE(ue))
+        return 0;
+
+    pthread_mutex_lock(&ent->lock);
+    now = ue_now_ms();
+    if (ue->host_max_active && ent->active >= ue->host_max_active)
+        wait = UE_HOST_RETRY_MS;
+    else if (ent->next_fetch > now)
+        wait = (int)(ent->next_fetch - now);
+    else {
+        if (ue->host_max_active)
+            ent->active ++;
+        ent->next_fetch = now + (peek ? ue->host_delay_peek : ue->host_delay);
+    }
+    pthread_mutex_unlock(&ent->lock);
+
+    return wait;
+}
+
+/** 
+ * Mark a transfer started through ue_host_acquire() 
+ * as done
+ **/
+void
+ue_host_release(ue_t *ue, struct host_ent *ent)
+{
+    if (!ue->host_max_active)
+        return;
+
+    pthread_mutex_lock(&ent->lock);
+    if (ent->active)
+        ent->active --;
+    pthread_mutex_unlock(&ent->lock);
+}
+
+/** 
+ * Check the health of the given host before a transfer. 
+ * Returns 0 if the transfer may start, the timeouts to use
+ * are then stored in connect_ms and total_ms, both are 0 
+ * if LMOPT_HOST_TIMEOUT is not set. If the host is down, the
+ * number of milliseconds until it may be tried again is 
+ * returned, and the transfer should be put off without 
+ * touching the network, see ue_park().
+ *
+ * The connect timeout follows the average time to the 
+ * first byte of the host, and both timeouts are halved for
+ * each failure in a row, so that a host that stopped 
+ * answering costs less and less until its breaker opens. 
+ * The breaker opens after LMOPT_HOST_MAX_FAILURES failures
+ * in a row, the host is then skipped for UE_BREAKER_COOLDOWN
+ * ms, after which one transfer is let through as a probe. 
+ * If the probe fails too, the breaker opens again for twice
+ * as long.
+ *
+ * The result of a transfer let through should be given to
+ * ue_host_done().
+ **/
+int
+ue_host_check(ue_t *ue, struct host_ent *ent, long *connect_ms, long *total_ms)
+{
+    uint64_t     now;
+    unsigned int c, t;
+    int          wait = 0;
+
+    *connect_ms = 0;
+    *total_ms   = 0;
+
+    if (!UE_HEALTH(ue))
+        return 0;
+
+    pthread_mutex_lock(&ent->lock);
+    if (ent->breaker != UE_BREAKER_CLOSED) {
+        now = ue_now_ms();
+        if (now < ent->retry_at)
+            wait = (int)(ent->retry_at - now);
+        else {
+            /* a probe that never reports back does not 
+             * keep others from trying */
+            ent->breaker  = UE_BREAKER_PROBING;
+            ent->retry_at = now + UE_BREAKER_COOLDOWN;
+        }
+    }
+    if (!wait && ue->host_timeout) {
+        t = ue->host_timeout >> (ent->failures < 3 ? ent->failures : 3);
+        c = (ent->rtt ? ent->rtt*UE_RTT_TIMEOUT : t/4);
+        if (c > t/2)
+            c = t/2;
+        if (c < UE_TIMEOUT_MIN)
+            c = (ue->host_timeout < UE_TIMEOUT_MIN ? ue->host_timeout : UE_TIMEOUT_MIN);
+        if (t < c)
+            t = c;
+        *connect_ms = c;
+        *total_ms   = t;
+    }
+    pthread_mutex_unlock(&ent->lock);
+
+#ifdef DEBUG
+    if (wait)
+        fprintf(stderr, "* urlengine:(%p) host '%s' is down for %d ms\n", ue, ent->str, wait);
+#endif
+
+    return wait;
+}
+
+/** 
+ * Give the result of a transfer let through by ue_host_check()
+ * to the host entry. 'ok' is 0 if the host could not be 
+ * reached, ttfb is the time to the first byte of the 
+ * response in ms, 0 if not known.
+ *
+ * When the breaker opens, the host is also held back in
+ * the pending queues until the probe is due, see 
+ * ue_pending_take(), so that no worker picks up the URLs of
+ * a dead host only to skip them one by one.
+ **/
+void
+ue_host_done(ue_t *ue, struct host_ent *ent, int ok, unsigned int ttfb)
+{
+    unsigned int shift;
+
+    if (!UE_HEALTH(ue))
+        return;
+
+    pthread_mutex_lock(&ent->lock);
+    if (ok) {
+        if (ttfb)
+            ent->rtt = (ent->rtt ? (ent->rtt*7+ttfb)/8 : ttfb);
+        ent->failures = 0;
+        ent->trips    = 0;
+        ent->breaker  = UE_BREAKER_CLOSED;
+    } else {
+        if (ent->failures < 0xffff)
+            ent->failures ++;
+
+        if (ent->breaker == UE_BREAKER_PROBING
+                || (ent->breaker == UE_BREAKER_CLOSED && ue->host_max_failures
+                    && ent->failures >= ue->host_max_failures)) {
+            shift = (ent->trips < UE_BREAKER_MAX_SHIFT ? ent->trips : UE_BREAKER_MAX_SHIFT);
+            ent->retry_at = ue_now_ms() + ((uint64_t)UE_BREAKER_COOLDOWN << shift);
+            ent->breaker  = UE_BREAKER_OPEN;
+            if (ent->trips < 0xff)
+                ent->trips ++;
+            if (ent->next_fetch < ent->retry_at)
+                ent->next_fetch = ent->retry_at;
+#ifdef DEBUG
+            fprintf(stderr, "* urlengine:(%p) host '%s' is down for %u ms\n", 
+                    ue, ent->str, UE_BREAKER_COOLDOWN << shift);
+#endif
+        }
+    }
+    pthread_mutex_unlock(&ent->lock);
+}
@@ -24,58 +24,220 @@
 
 #include "url.h"
 #include "mtrie.h"
+#include "fpset.h"
 #include "utable.h"
 #include "filter.h"
+#include "spill.h"
 #include <pthread.h>
 
-#define UE_SECONDARY_SIZE 64
+#define UE_HOSTS_INIT_SIZE 256 /* initial number of buckets in the host table */
+#define UE_HOSTS_MIGRATE   4   /* buckets moved per added host while growing */
+#define UE_FILTER_SIZE    (1<<18) /* default number of fingerprints in the pre-filter */
+#define UE_FILTER_WAYS    4
+#define UE_SPILL_MIN_LIST  16   /* host lists shorter than this are never spilled */
+#define UE_SPILL_MIN_LEVEL 64   /* nor are utable levels shorter than this */
+#define UE_SPILL_CHUNK     4096 /* URLs per run when spilling a utable level */
+#define UE_PACK_CHUNK      256  /* URLs per run when packing a list, see LMOPT_FRONTIER_PACK */
+#define UE_PACK_MIN_LEVEL  512  /* utable levels shorter than this are never packed */
+#define UE_URL_EST         64   /* assumed string size of URLs in the utables */
+#define UE_PENDING_SHARDS  8    /* number of queues pending hosts are spread over */
+#define UE_SHARE_KEEP      16   /* URLs of a new list a worker keeps to itself */
+#define UE_SHARE_BATCH     32   /* URLs per batch offered to other workers */
+#define UE_LINKS_BATCH     256  /* links collected by ue_add_deferred() before a flush */
+#define UE_HOSTCACHE_SIZE  16   /* host entries remembered by each handle, see ue_get_hostent() */
+#define UE_TIMEOUT_MIN     1000 /* ms, adaptive timeouts are never shorter, see ue_host_check() */
+#define UE_RTT_TIMEOUT     8    /* connect timeout in average times to the first byte */
+#define UE_BREAKER_COOLDOWN 30000 /* ms before a host that is down is tried again */
+#define UE_BREAKER_MAX_SHIFT 5  /* the cooldown doubles per failed probe, this many times at most */
+
+/* order in which pending hosts are crawled, see LMOPT_HOST_ORDER */
+enum {
+    UE_ORDER_INLINKS, /* most linked to first */
+    UE_ORDER_BACKLOG, /* most URLs waiting first */
+    UE_ORDER_FIFO,    /* first discovered first */
+    UE_ORDER_LIFO,    /* last discovered first */
+    UE_ORDER_CUSTOM,  /* scored by ue->pending.score_cb */
+};
 
 struct host_ent {
     char            *str; /* host name */
     uint16_t         len; /* length of host name */
     int              rfetched;
+
+    /* URLs seen on this host, the full URLs are kept in 'cache'
+     * unless the host entry was created by a crawler with 
+     * url_fingerprints set, then only their fingerprints 
+     * are kept in 'fp', see ue_seen() */
     mtrie_t          cache;
+    fpset_t          fp;
+    uint8_t          use_fp;
+
+    /* once nothing of the host is left to crawl, the seen-set
+     * is replaced by the sorted fingerprints of its URLs until
+     * a new URL of the host is found, see ue_retire() */
+    uint64_t        *retired;
+    uint32_t         nretired;
+    /* handles crawling or peeking from this host, and batches
+     * of its URLs shared by ue_share(), see ue_host_switch() */
+    volatile unsigned int holders;
     ulist_t          list;
-    struct host_ent *next;
+    /* URLs in 'list' and its spilled runs, kept up to date
+     * under 'lock' so that ue_pending_key() can read it 
+     * without walking the runs */
+    volatile uint32_t backlog;
+    struct host_ent * volatile next; /* in the host table */
     pthread_mutex_t  lock;
     filter_t         filter;
 
-    /* if this host name is pending to be crawled */
+    /* if this host name is pending to be crawled, pending_pos
+     * is its index in the heap of its pending queue, or 
+     * UE_PENDING_NONE once it has been popped */
     uint8_t          pending;
     unsigned int     pending_pos;
+    uint64_t         pending_key; /* see ue_pending_key() */
+    uint32_t         pending_seq; /* order of ue_push_pending() calls */
+    volatile uint32_t inlinks;    /* URLs found linking to this host */
+
+    uint32_t         hash; /* of the lower case host name */
+
+    /* politeness, see ue_host_acquire() */
+    uint64_t         next_fetch; /* monotonic time in ms */
+    unsigned int     active;     /* transfers in progress */
+
+    /* health, see ue_host_check() and ue_host_done() */
+    unsigned int     rtt;        /* average ms to the first byte, 0 if not known */
+    uint16_t         failures;   /* transfers in a row that got no answer */
+    uint8_t          breaker;    /* UE_BREAKER_* */
+    uint8_t          trips;      /* times in a row the breaker opened */
+    uint64_t         retry_at;   /* when an open breaker lets a probe through */
+};
+
+#define UE_BREAKER_CLOSED  0
+#define UE_BREAKER_OPEN    1 /* the host is skipped until retry_at */
+#define UE_BREAKER_PROBING 2 /* one transfer is trying the host again */
 
-    uint8_t          secondary_n;
+#define UE_PENDING_NONE ((unsigned int)-1)
+
+/* one shard of the pending host queue, a binary max-heap 
+ * ordered by host_ent.pending_key */
+struct ue_pqueue {
+    pthread_mutex_t    lock;
+    struct host_ent  **heap;
+    unsigned int       sz;
+    unsigned int       cap;
+    volatile uint64_t  top; /* key of heap[0], valid if sz > 0 */
 };
 
-/* stack for pending external urls */
-struct lm_pending_e_st {
-    struct host_ent **st;
-    unsigned int      sz;
-    unsigned int      cap;
+struct uehandle;
+
+/* bucket array of the host table */
+struct ue_hosttab {
+    struct ue_hosttab          *retired; /* replaced arrays, see ue_hosts_grow() */
+    uint32_t                    mask;
+    struct host_ent * volatile  buckets[];
 };
 
 typedef struct ue {
+    /**
+     * All host entries, in a hash table keyed by the lower case 
+     * host name. Lookups do not take any lock, see ue_get_hostent().
+     * Adding a host takes 'lock'. When the table grows, the 
+     * entries are moved from 'old' to 'cur' a few buckets at a 
+     * time by the following adds, see ue_hosts_add().
+     *
+     * Note that when a worker is actively crawling a specific 
+     * host, it will save a direct pointer to its cache, hence
+     * the table is not even searched when workers add to their
+     * current caches.
+     **/
     struct {
-        /**
-         * There are actually 512 linked lists with host entries, 
-         * but the thought of 512 rwlocks scares me, so we split up
-         * the locks, 8 linked lists per lock. Each rwlock will 
-         * most of the time be locked for read anyway, and only
-         * locked for write when a completely new host is found
-         *
-         * Note that when a worker is actively crawling a specific 
-         * host, it will save a direct pointer to its cache, hence
-         * this lock will not prevent workers from adding to their 
-         * current caches.
-         **/
-        pthread_rwlock_t rwlock;
-        struct host_ent *hosts[8];
-    } secondary[UE_SECONDARY_SIZE];
-
-    pthread_mutex_t        pending_lk;
-    struct lm_pending_e_st pending;
+        struct ue_hosttab * volatile cur;
+        struct ue_hosttab * volatile old;      /* being emptied into cur */
+        uint32_t                     migrated; /* buckets of old emptied */
+        uint32_t                     count;
+        volatile uint32_t            gen;      /* see uehandle_t.hostcache */
+        pthread_mutex_t              lock;
+    } hosts;
+
+    /**
+     * Hosts waiting to be crawled. A host goes to the shard
+     * given by its hash, ue_pop_pending() takes the host with
+     * the highest key among the shards' tops and only locks 
+     * that shard.
+     **/
+    struct {
+        struct ue_pqueue  shards[UE_PENDING_SHARDS];
+        volatile uint32_t seq;
+        int               order; /* UE_ORDER_*, set through LMOPT_HOST_ORDER */
+        unsigned int    (*score_cb)(void *arg, const char *host, unsigned int inlinks, unsigned int backlog);
+        void             *score_arg;
+    } pending;
+
+    /* fingerprints of URLs known to be seen, checked by ue_add() 
+     * before it locks anything, see ue_filter_check(). Buckets 
+     * of UE_FILTER_WAYS entries */
+    struct {
+        volatile uint64_t *slots;
+        uint32_t           mask; /* number of buckets - 1 */
+    } filter;
+
+    /* per-host politeness settings, set through LMOPT_MODE,
+     * LMOPT_HOST_DELAY and LMOPT_HOST_MAX_CONNECTIONS */
+    unsigned int host_delay;      /* ms between two transfers to one host */
+    unsigned int host_delay_peek; /* ms between two HEAD lookups on one host */
+    unsigned int host_max_active; /* max concurrent transfers per host, 0 = no limit */
+
+    /* host health settings, set through LMOPT_HOST_TIMEOUT and
+     * LMOPT_HOST_MAX_FAILURES, see ue_host_check() */
+    unsigned int host_timeout;      /* max ms per transfer, 0 = curl's defaults */
+    unsigned int host_max_failures; /* failures in a row before a host is skipped, 0 = never */
+
+    /* memory used by URLs waiting to be crawled. Once it is above
+     * 'budget', host lists and utable levels are moved to 'disk',
+     * see ue_move_to_secondary() and ue_spill_levels() */
+    struct {
+        spill_t         disk;
+        volatile size_t lists;  /* bytes in the host entries' lists */
+        volatile size_t levels; /* estimated bytes in the uehandles' utables */
+        size_t          budget; /* set through LMOPT_FRONTIER_MEMORY, 0 = no limit */
+        int             pack;   /* front code parked lists, LMOPT_FRONTIER_PACK */
+    } frontier;
+
+    /* handles that offer URLs to idle workers, see ue_steal() */
+    struct {
+        struct uehandle **list;
+        unsigned int      count;
+        pthread_mutex_t   lock;
+    } sharing;
+
+    /* handles of stopped workers that still had URLs to crawl,
+     * see ue_handle_park() */
+    struct {
+        struct uehandle **list;
+        unsigned int      count;
+        pthread_mutex_t   lock;
+    } parked;
 } ue_t;
 
+#define UE_POLITE(ue) ((ue)->host_delay || (ue)->host_delay_peek || (ue)->host_max_active)
+#define UE_HEALTH(ue) ((ue)->host_timeout || (ue)->host_max_failures)
+
+/* URLs of one list given away by ue_share() */
+struct ue_batch {
+    ulist_t          list;
+    unsigned int     level;         /* primary.sz of the sharing handle */
+    unsigned int     depth_counter;
+    void            *state_info;
+    struct host_ent *host_ent;
+};
+
+/* a link found by a parser, not yet resolved against
+ * the current URL, see ue_add_batch() */
+typedef struct ue_link {
+    const char *ptr;
+    uint16_t    len;
+} ue_link_t;
+
 typedef struct uehandle {
     utable_t      primary;
     ue_t         *parent;
@@ -85,14 +247,57 @@ typedef struct uehandle {
     struct host_ent *host_ent_bk;
 
     int           is_peeking;
+    int           fingerprints; /* new host entries use fpset_t */
+    const lm_canon_t *canon;    /* rules of the crawler, see lm_url_canonicalize() */
     unsigned int  depth_counter;
     unsigned int  depth_limit;
     unsigned int  depth_counter_bk; /* backup values when doing external peeking */
     unsigned int  depth_limit_bk;
+    size_t        level_mem; /* this handle's part of parent->frontier.levels */
+    uint8_t       resumed;   /* set by ue_handle_unpark() */
+    uint8_t       share;     /* offer URLs to other workers, see ue_share() */
+
+    /* batches offered to other workers, the owner takes them
+     * back from the tail and thieves steal from the head */
+    struct {
+        struct ue_batch **q;
+        unsigned int      head;
+        unsigned int      tail;
+        unsigned int      cap;
+        volatile unsigned int count;
+        volatile size_t   urls;
+        uint8_t           listed; /* in parent->sharing */
+        pthread_mutex_t   lock;
+    } shared;
+
+    /**
+     * The host entries this handle looked up last, most recent
+     * first, so that the hosts linked from every page of a site
+     * are found without walking the shared host table. Host 
+     * entries are not freed before ue_uninit(), so the pointers
+     * stay valid. Anything that frees or replaces host entries
+     * must increase parent->hosts.gen, as ue_uninit() does, a 
+     * handle empties its cache when gen differs from its own.
+     **/
+    struct {
+        uint32_t          gen;
+        uint32_t          hash[UE_HOSTCACHE_SIZE];
+        struct host_ent  *ent[UE_HOSTCACHE_SIZE];
+    } hostcache;
+
+    /* links given to ue_add_deferred(), added by ue_add_flush() */
+    struct {
+        int           sz;
+        ue_link_t     link[UE_LINKS_BATCH];
+    } links;
 } uehandle_t;
 
 M_CODE ue_init(ue_t *ue);
+M_CODE ue_set_filter_size(ue_t *ue, unsigned int size);
 M_CODE ue_add(uehandle_t *h, const char *url, uint16_t len);
+M_CODE ue_add_batch(uehandle_t *h, const ue_link_t *links, int num);
+M_CODE ue_add_deferred(uehandle_t *h, const char *url, uint16_t len);
+M_CODE ue_add_flush(uehandle_t *h);
 M_CODE ue_revert(uehandle_t *h, const char *url, uint16_t len);
 M_CODE ue_add_initial(uehandle_t *h, const char *url, uint16_t len);
 M_CODE ue_set_host(uehandle_t *h, const char *host, uint16_t host_sz);
@@ -100,11 +305,25 @@ M_CODE ue_move_to_secondary(uehandle_t *h, url_t *url);
 void  *ue_get_state_info(uehandle_t *h);
 void   ue_set_state_info(uehandle_t *h, void *info);
 void   ue_handle_free(uehandle_t *h);
+void   ue_handle_park(uehandle_t *h);
+uehandle_t *ue_handle_unpark(ue_t *ue);
 void   ue_uninit(ue_t *ue);
 const char *ue_next(uehandle_t *h);
 uehandle_t *ue_handle_obtain(ue_t *ue);
 struct host_ent* ue_pop_pending(uehandle_t *h);
 M_CODE ue_set_hostent(uehandle_t *h, struct host_ent *ent);
+M_CODE ue_push_pending(uehandle_t *h, struct host_ent *p);
+M_CODE ue_park(uehandle_t *h, struct host_ent *p, url_t *url);
+int    ue_pending_due(ue_t *ue);
+struct host_ent *ue_get_hostent(uehandle_t *h, const char *host, uint16_t host_sz, int add_pending);
+void   ue_share(uehandle_t *h);
+M_CODE ue_steal(uehandle_t *h);
+void   ue_host_hold(struct host_ent *ent);
+void   ue_host_unhold(uehandle_t *h, struct host_ent *ent, int retire);
+int    ue_host_acquire(ue_t *ue, struct host_ent *ent, int peek);
+void   ue_host_release(ue_t *ue, struct host_ent *ent);
+int    ue_host_check(ue_t *ue, struct host_ent *ent, long *connect_ms, long *total_ms);
+void   ue_host_done(ue_t *ue, struct host_ent *ent, int ok, unsigned int ttfb);
 
 #endif
 
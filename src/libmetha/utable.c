@@ -68,13 +68,14 @@ lm_utable_top(utable_t *tb)
 
 /** 
  * Decrease the size of the table by removing
- * the top list
+ * the top list, its URL strings are released
  **/
 M_CODE
 lm_utable_dec(utable_t *tb)
 {
     if (tb->sz == 0)
         return M_FAILED;
+    lm_ulist_release(&tb->row[tb->sz-1]);
     tb->row[tb->sz-1].sz = 0;
     tb->sz--;
     return M_OK;
@@ -121,6 +122,8 @@ lm_ulist_init(ulist_t *ul, unsigned int allocsz)
     ul->cap = allocsz;
     ul->sz = 0;
     ul->private = 0;
+    ul->spilled = 0;
+    ul->slab = 0;
 
     return M_OK;
 }
@@ -128,6 +131,7 @@ lm_ulist_init(ulist_t *ul, unsigned int allocsz)
 void
 lm_ulist_uninit(ulist_t *ul)
 {
+    struct ulist_slab *b, *next;
     int x;
     if (ul->cap) {
         for (x=0; x<ul->cap; x++) {
@@ -135,6 +139,11 @@ lm_ulist_uninit(ulist_t *ul)
         }
         free(ul->row);
     }
+    for (b = ul->slab; b; b = next) {
+        next = b->next;
+        free(b);
+    }
+    ul->slab = 0;
     ul->cap = 0;
     ul->sz = 0;
 }
@@ -163,21 +172,25 @@ url_t *
 lm_ulist_inc(ulist_t *ul)
 {
     int x;
+    url_t *row;
 
+    /* on failure the list is left as it was, so that the
+     * caller may try again later */
     if (!ul->cap) {
         ul->sz = 0;
-        ul->cap = ULIST_DEFAULT_PREALLOC;
         if (!(ul->row = malloc(ULIST_DEFAULT_PREALLOC*sizeof(url_t)))) {
             return 0;
         }
+        ul->cap = ULIST_DEFAULT_PREALLOC;
         for (x=0; x<ULIST_DEFAULT_PREALLOC; x++)
             lm_url_init(&ul->row[x]);
     }
     if (ul->sz >= ul->cap) {
         /* resize is necessary */
-        ul->cap <<= 1;
-        if (!(ul->row = realloc(ul->row, ul->cap*sizeof(url_t))))
+        if (!(row = realloc(ul->row, (ul->cap<<1)*sizeof(url_t))))
             return 0;
+        ul->row = row;
+        ul->cap <<= 1;
         for (x=ul->sz; x<ul->cap; x++)
             lm_url_init(&ul->row[x]);
     }
@@ -186,3 +199,67 @@ lm_ulist_inc(ulist_t *ul)
     return &ul->row[ul->sz-1];
 }
 
+
+/**
+ * Make sure url, a row of ul, can hold sz bytes. If its 
+ * buffer is too small, the string is put in the list's slab
+ * instead of a buffer of its own. A slab is a chain of 
+ * blocks that URL strings are cut from one after another, 
+ * nothing is free()'d until the whole list is released by
+ * lm_ulist_release(). This saves a malloc() and free() per 
+ * URL, but a URL that is moved to another list must first 
+ * be given a buffer of its own with lm_url_detach().
+ *
+ * Returns M_OUT_OF_MEM if the slab can not grow, the URL 
+ * is then left as it was.
+ **/
+M_CODE
+lm_ulist_reserve(ulist_t *ul, url_t *url, uint16_t sz)
+{
+    struct ulist_slab *b = ul->slab;
+    size_t bsz;
+
+    if (url->allocsz >= sz)
+        return M_OK;
+
+    if (!b || b->size - b->used < sz) {
+        bsz = (sz > ULIST_SLAB_SIZE ? sz : ULIST_SLAB_SIZE);
+        if (!(b = malloc(sizeof(struct ulist_slab)+bsz)))
+            return M_OUT_OF_MEM;
+        b->next = ul->slab;
+        b->used = 0;
+        b->size = bsz;
+        ul->slab = b;
+    }
+
+    lm_url_attach(url, b->data+b->used, sz);
+    b->used += sz;
+
+    return M_OK;
+}
+
+/**
+ * Release all URL strings in the list's slab at once. Rows 
+ * that pointed into it are left without a buffer. The first
+ * block is kept for the next time the list is filled.
+ **/
+void
+lm_ulist_release(ulist_t *ul)
+{
+    struct ulist_slab *b, *next;
+    size_t x;
+
+    if (!ul->slab)
+        return;
+
+    for (x=0; x<ul->cap; x++)
+        if (ul->row[x].slab)
+            lm_url_init(&ul->row[x]);
+
+    for (b = ul->slab->next; b; b = next) {
+        next = b->next;
+        free(b);
+    }
+    ul->slab->next = 0;
+    ul->slab->used = 0;
+}
@@ -31,12 +31,25 @@
 
 #define UTABLE_DEFAULT_PREALLOC 2
 #define ULIST_DEFAULT_PREALLOC  16
+#define ULIST_SLAB_SIZE         8192
+
+struct spillref;
+
+/* block of URL strings, see lm_ulist_reserve() */
+struct ulist_slab {
+    struct ulist_slab *next;
+    size_t used;
+    size_t size;
+    char   data[];
+};
 
 typedef struct ulist {
     void *private;
     size_t cap;
     size_t sz;
     url_t *row;
+    struct spillref *spilled; /* URLs written to disk, see spill.c */
+    struct ulist_slab *slab;
 } ulist_t;
 
 typedef struct utable {
@@ -55,6 +68,8 @@ M_CODE lm_ulist_init(ulist_t *ul, unsigned int allocsz);
 void   lm_ulist_uninit(ulist_t *ul);
 url_t *lm_ulist_pop(ulist_t *ul);
 url_t *lm_ulist_inc(ulist_t *ul);
+M_CODE lm_ulist_reserve(ulist_t *ul, url_t *url, uint16_t sz);
+void   lm_ulist_release(ulist_t *ul);
 
 #define lm_ulist_row(l, x) (&((l)->row[x]))
 #define lm_ulist_dec(l) (l)->sz--
@@ -104,9 +104,10 @@ lm_parser_utf8conv(worker_t *w, iobuf_t *buf,
 
     /* replace the pointer in buf with our new,
      * converted buffer, free the old one */
+    if (buf->cap) /* not a mapped file */
+        free(buf->ptr);
     buf->cap = outp-out;
     buf->sz = outp-out;
-    free(buf->ptr);
     /* free unused space */
     if (!(buf->ptr = realloc(out, buf->sz)))
         return M_OUT_OF_MEM;
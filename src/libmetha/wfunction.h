@@ -35,6 +35,7 @@
  * the html parser.
  **/
 
+#include <stddef.h>
 #include <stdint.h>
 #include <jsapi.h>
 
@@ -60,6 +61,7 @@ struct iohandle;
 struct url;
 struct uehandle;
 struct attr_list;
+struct iostream;
 
 /** 
  * Worker functions
@@ -82,6 +84,10 @@ typedef struct wfunction {
          * seems to work in both 1.7.0 and 1.8.0 */
         jsval javascript;
     } fn;
+
+    /* optional, set for native parsers that can also parse data 
+     * while it is being downloaded, see iostream_t in io.h */
+    size_t (*native_stream)(struct iostream *, char *, size_t, int);
 } wfunction_t;
 
 #endif
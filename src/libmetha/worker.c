@@ -22,6 +22,7 @@
 #include <string.h>
 #include <pthread.h>
 #include <ctype.h>
+#include <time.h>
 #include <jsapi.h>
 
 #include "str.h"
@@ -37,6 +38,10 @@
 
 #define inl_ static inline
 
+/* longest single sleep while waiting for a host that is down,
+ * so that a stop message is not missed for long */
+#define LM_WORKER_NAP_MAX 1000
+
 static M_CODE lm_worker_init(worker_t *w);
 static M_CODE lm_worker_init_e4x(worker_t *w);
 static M_CODE lm_worker_sort(worker_t *w);
@@ -44,8 +49,21 @@ static M_CODE lm_worker_perform(worker_t *w);
 static M_CODE lm_worker_call_crawler_init(worker_t *w);
 static M_CODE lm_worker_get_robotstxt(worker_t *w, struct host_ent *ent);
 static int    lm_worker_wait(worker_t *w);
+static void   lm_worker_prefetch(worker_t *w);
+static inline size_t lm_worker_max_body(worker_t *w, filetype_t *ft);
+static int    lm_worker_host_acquire(worker_t *w, struct host_ent *ent, int peek);
+static void   lm_worker_host_release(worker_t *w, struct host_ent *ent);
+static void   lm_worker_nap(int ms);
+static M_CODE lm_worker_putback(worker_t *w, struct host_ent *ent, url_t *url);
+static struct host_ent *lm_worker_url_hostent(worker_t *w, url_t *url);
+static M_CODE lm_worker_lookup(worker_t *w, url_t *url, int *fetched);
+static int    lm_worker_accept(iosink_t *s, const char *content_type);
+static int    lm_worker_wants_body(worker_t *w, filetype_t *ft);
+static filetype_t *lm_worker_match_mime(worker_t *w, const char *content_type);
+static int    lm_worker_redirect(worker_t *w);
 static M_CODE __lm_worker_default_crawler_init(uehandle_t *h, int argc, const char **argv);
 inl_ int lm_worker_bind_url(worker_t *w, url_t *url, filetype_t *ft, int epeek, ulist_t **peek_list);
+inl_ int lm_worker_jailed(worker_t *w, url_t *url);
 
 #ifdef DEBUG
 static const char *worker_state_str[] = {
@@ -86,6 +104,7 @@ lm_worker_run_once(worker_t *w)
     ue_next(w->ue_h);
     lm_worker_perform(w);
     lm_worker_sort(w);
+    lm_io_done(w->io_h);
 
     return M_OK;
 }
@@ -117,6 +136,11 @@ lm_worker_call_crawler_init(worker_t *w)
     jsval func;
     jsval ret;
 
+    /* the init function was called by the worker that
+     * was stopped, see ue_handle_unpark() */
+    if (w->ue_h->resumed)
+        return M_OK;
+
     if (w->crawler->init) {
         const char *init_name = w->crawler->init;
 #ifdef DEBUG
@@ -217,6 +241,7 @@ lm_worker_main(void *in)
     worker_t      *w      = (worker_t*)in;
     const char    *url;
     crawler_t *new;
+    int        ms;
 
     volatile int *num_waiting = &w->m->w_num_waiting;
 
@@ -235,16 +260,27 @@ lm_worker_main(void *in)
         return 0;
     }
 
-    /* sort initial URLs to determine types if initial_filetype is not set */
-    if (w->crawler->initial_filetype.ptr) {
-        ulist_t *t = lm_utable_top(&w->ue_h->primary);
-        int x;
-        for (x=0; x<t->sz; x++)
-            t->row[x].bind = w->crawler->initial_filetype.ptr->id;
-    } else 
-        lm_worker_sort(w);
+    /* with spread_workers, idle workers are given hosts 
+     * instead of URLs */
+    w->ue_h->share = (w->m->num_threads > 1 
+                      && !lm_crawler_flag_isset(w->crawler, LM_CRFLAG_SPREAD_WORKERS));
+
+    if (w->ue_h->resumed) {
+        /* continuing with the URLs of a stopped worker, these
+         * are already sorted and bound to their crawlers */
+        w->ue_h->resumed = 0;
+    } else {
+        /* sort initial URLs to determine types if initial_filetype is not set */
+        if (w->crawler->initial_filetype.ptr) {
+            ulist_t *t = lm_utable_top(&w->ue_h->primary);
+            int x;
+            for (x=0; x<t->sz; x++)
+                t->row[x].bind = w->crawler->initial_filetype.ptr->id;
+        } else 
+            lm_worker_sort(w);
 
-    ue_set_state_info(w->ue_h, w->crawler);
+        ue_set_state_info(w->ue_h, w->crawler);
+    }
 
     do {
         if (!(url = ue_next(w->ue_h))) {
@@ -260,6 +296,22 @@ lm_worker_main(void *in)
                     continue;
                 }
             }
+            /* take URLs from a busy worker */
+            if (ue_steal(h) == M_OK) {
+                if ((new = ue_get_state_info(h)))
+                    lm_worker_set_crawler(w, new);
+                continue;
+            }
+            /* hosts that are down still have URLs parked, wait
+             * for their breakers rather than going idle */
+            if (lm_crawler_flag_isset(w->crawler, LM_CRFLAG_EXTERNAL)
+                    && (ms = ue_pending_due(h->parent)) > 0) {
+                lm_worker_nap(ms);
+                if (w->message != LM_WORKER_MSG_STOP)
+                    continue;
+                w->state = LM_WORKER_STATE_STOPPED;
+                break;
+            }
             if (lm_worker_wait(w) == LM_WORKER_MSG_CONTINUE)
                 continue;
             break;
@@ -276,7 +328,8 @@ lm_worker_main(void *in)
              * would have to do locking on the host ent to determine if a
              * robots.txt file has been downloaded already in order to modify
              * it safely. */
-            if (w->m->robotstxt) {
+            if (w->m->robotstxt
+                    && w->ue_h->current->protocol != LM_PROTOCOL_FILE) {
                 if (!w->ue_h->host_ent->rfetched) {
                     lm_worker_get_robotstxt(w, w->ue_h->host_ent);
                 }
@@ -291,9 +344,15 @@ lm_worker_main(void *in)
         else
             ue_set_state_info(w->ue_h, w->crawler);
 
+        /* prefetching would bypass the per-host politeness delay */
+        if (w->io_h->pipeline.count && !UE_POLITE(w->ue_h->parent))
+            lm_worker_prefetch(w);
+
         /*if (lm_worker_perform(w) == M_OK)*/
         lm_worker_perform(w);
         lm_worker_sort(w);
+        lm_io_done(w->io_h);
+        ue_share(w->ue_h);
 
         /* Check for a message */
         /*
@@ -320,7 +379,9 @@ lm_worker_main(void *in)
                 /* we have workers waiting for URLs, but before we can give them 
                  * anything we must verify that we really have any spare URLs to 
                  * provide */
-                && lm_utable_top(&w->ue_h->primary)->sz
+                && (lm_crawler_flag_isset(w->crawler, LM_CRFLAG_SPREAD_WORKERS)
+                    ? lm_utable_top(&w->ue_h->primary)->sz
+                    : w->ue_h->shared.count)
                 /* Attempt to lock the reply-lock, only one worker 
                  * will be able to reply. */
                 && pthread_mutex_trylock(lk_reply) == 0) {
@@ -328,42 +389,24 @@ lm_worker_main(void *in)
             pthread_rwlock_unlock(lk_num_waiting);
             pthread_rwlock_wrlock(lk_num_waiting);
 
-            int x,y,n;
-            int per_worker;
+            int x,n;
             n   = *num_waiting;
-            ulist_t *source = lm_utable_top(&w->ue_h->primary);
             if (!lm_crawler_flag_isset(w->crawler, LM_CRFLAG_SPREAD_WORKERS)) {
-                if (n < source->sz) {
-                    per_worker = source->sz/((*num_waiting)+1);
-
-                    for (x=0; x<n; x++) {
-                        worker_t *curr = w->m->waiting_queue[x];
-                        pthread_mutex_lock(&curr->lock);
-                        if (curr->state == LM_WORKER_STATE_WAITING) {
-                            lm_worker_set_crawler(curr, w->crawler);
-                            curr->ue_h->depth_counter = w->ue_h->depth_counter;
-                            curr->message = LM_WORKER_MSG_CONTINUE;
-                            curr->ue_h->host_ent = w->ue_h->host_ent;
-                            
-                            ulist_t *target = lm_utable_top(&curr->ue_h->primary);
-                            if (!target) {
-                                lm_utable_inc(&curr->ue_h->primary);
-                                target = lm_utable_top(&curr->ue_h->primary);
-                            }
-
-                            for (y=(x*per_worker); y<x*(per_worker+1); y++) {
-                                url_t *s = lm_ulist_pop(source);
-                                if (s) {
-                                    url_t *d = lm_ulist_inc(target);
-                                    lm_url_swap(s, d);
-                                }
-                            }
-                            pthread_mutex_unlock(&curr->lock);
-                            (*num_waiting) --;
-                            pthread_cond_signal(&curr->wakeup_cond);
-                        } else
-                            pthread_mutex_unlock(&curr->lock);
-                    }
+                /* wake up one waiting worker per shared batch, they
+                 * will take the URLs themselves with ue_steal() */
+                unsigned int batches = w->ue_h->shared.count;
+
+                for (x=n-1; x>=0 && batches; x--) {
+                    worker_t *curr = w->m->waiting_queue[x];
+                    pthread_mutex_lock(&curr->lock);
+                    if (curr->state == LM_WORKER_STATE_WAITING) {
+                        curr->message = LM_WORKER_MSG_CONTINUE;
+                        pthread_mutex_unlock(&curr->lock);
+                        (*num_waiting) --;
+                        batches --;
+                        pthread_cond_signal(&curr->wakeup_cond);
+                    } else
+                        pthread_mutex_unlock(&curr->lock);
                 }
             } else {
                 /* worker spreading is enabled, we will give the pending workers 
@@ -399,7 +442,7 @@ lm_worker_main(void *in)
 
 done:
     lm_notify(w->m, LM_EV_THREAD_DESTROY);
-    ue_handle_free(w->ue_h);
+    ue_handle_park(w->ue_h);
     pthread_mutex_destroy(&w->lock);
     pthread_cond_destroy(&w->wakeup_cond);
     lm_worker_free(w);
@@ -471,6 +514,8 @@ lm_worker_free(worker_t *w)
 
     JS_DestroyContext(w->e4x_cx);
     lm_iohandle_destroy(w->io_h);
+    if (w->prefetch)
+        free(w->prefetch);
     lm_attrlist_cleanup(&w->attributes);
 }
 
@@ -490,6 +535,8 @@ lm_worker_set_crawler(worker_t *w, crawler_t *c)
     w->crawler = c;
     /*w->ue_h->depth_counter = 0;*/
     w->ue_h->depth_limit = c->depth_limit;
+    w->ue_h->fingerprints = lm_crawler_flag_isset(c, LM_CRFLAG_FINGERPRINTS);
+    w->ue_h->canon = &c->canon;
 
     return M_OK;
 }
@@ -555,7 +602,9 @@ lm_worker_sort(worker_t *w)
     cr     = w->crawler;
     epeek  = (lm_crawler_flag_isset(cr, LM_CRFLAG_EPEEK) && !ue_h->is_peeking)
               ? 1 : 0;
-    syn    = w->io_h->io->synchronous;
+    /* HEAD lookups must go through the per-host scheduler one
+     * by one if politeness is enabled */
+    syn    = w->io_h->io->synchronous || UE_POLITE(ue_h->parent);
     lookup = 0;
 
     for (x=0; x<list->sz; ) {
@@ -565,14 +614,36 @@ lm_worker_sort(worker_t *w)
         /* first we try to match the URL by looking at the string */
         if ((ft = lm_ftindex_match_by_url(&cr->ftindex, url))) {
             if (ft == LM_FTINDEX_POSSIBLE_MATCH) {
-                if (!syn) {
+                if (lm_crawler_flag_isset(cr, LM_CRFLAG_GET_LOOKUP)
+                        && LM_PROTOCOL_IS_HTTP(url->protocol)
+                        && !LM_URL_ISSET(url, LM_URL_EXTERNAL)) {
+                    /* skip the HEAD request, lm_worker_perform() 
+                     * binds the URL when it is downloaded */
+                    url->flags |= LM_URL_LOOKUP;
+                    match = 1;
+                } else if (!syn) {
                     if (lm_multipeek_add(w->io_h, url, x) == M_OK) {
                         match = 1;
                         lookup ++;
                     }
                 } else {
-                    lm_io_head(w->io_h, url);
-                    char *mime = w->io_h->transfer.headers.content_type;
+                    struct host_ent *ent = lm_worker_url_hostent(w, url);
+                    char *mime = 0;
+                    if (lm_worker_host_acquire(w, ent, 1)) {
+                        lm_io_head(w->io_h, url);
+                        lm_worker_host_release(w, ent);
+                        mime = w->io_h->transfer.headers.content_type;
+                    } else {
+                        /* look the URL up by GET when it is crawled,
+                         * see lm_worker_lookup(). A stopping worker
+                         * keeps it in this list, otherwise the host 
+                         * is down and the URL is parked with it */
+                        url->flags |= LM_URL_LOOKUP;
+                        if (w->message == LM_WORKER_MSG_STOP)
+                            match = 1;
+                        else
+                            ue_park(ue_h, ent, url);
+                    }
                     if (mime) {
                         if ((c = strchr(mime, ';')))
                             *c = '\0';
@@ -624,7 +695,7 @@ lm_worker_sort(worker_t *w)
                 match = 1;
         }
 
-        curl_easy_cleanup(h);
+        lm_multipeek_release(w->io_h, info);
 
         if (!match)
             lm_url_nullify(url);
@@ -693,13 +764,17 @@ lm_worker_bind_url(worker_t *w, url_t *url,
                     ue_h->depth_counter_bk = ue_h->depth_counter;
                     ue_h->depth_limit_bk = ue_h->depth_limit;
                     ue_h->host_ent_bk = ue_h->host_ent;
+                    ue_host_hold(ue_h->host_ent_bk);
 
                     ue_h->depth_counter = 0;
                     ue_h->depth_limit = cr->peek_limit;
                     ue_h->is_peeking = 1;
                 }
                 url_t *tmp = lm_ulist_inc(*peek_list);
-                /* swap this URL with an empty URL from the new list */
+                /* swap this URL with an empty URL from the new list,
+                 * neither string may stay in the other list's slab */
+                lm_url_detach(url);
+                lm_url_detach(tmp);
                 lm_url_swap(url, tmp);
             } else {
                 if (lm_crawler_flag_isset(cr, LM_CRFLAG_EXTERNAL))
@@ -714,88 +789,357 @@ lm_worker_bind_url(worker_t *w, url_t *url,
 }
 
 /** 
- * Perform a transfer on one URL
+ * Returns 1 if the jail is enabled for the current crawler
+ * and the given URL is outside of it
  **/
-static M_CODE
-lm_worker_perform(worker_t *w)
+inl_ int
+lm_worker_jailed(worker_t *w, url_t *url)
 {
-    M_CODE r;
-    int x;
-    jsval ret;
-    filetype_t *ft = w->m->filetypes[w->ue_h->current->bind-1];
+    url_t *jail_url = &w->crawler->jail_url;
+
+    if (!lm_crawler_flag_isset(w->crawler, LM_CRFLAG_JAIL))
+        return 0;
 
-    if (lm_crawler_flag_isset(w->crawler, LM_CRFLAG_JAIL)) {
-        url_t *url = w->ue_h->current;
-        url_t *jail_url = &w->crawler->jail_url;
-        if (url->file_o-url->host_o-url->host_l
+    return (url->file_o-url->host_o-url->host_l
                 < jail_url->file_o-jail_url->host_o-jail_url->host_l
-                || strncasecmp(jail_url->str+jail_url->host_o+jail_url->host_l,
-                               url->str+url->host_o+url->host_l,
-                               jail_url->file_o-jail_url->host_o-jail_url->host_l) != 0) {
-            return M_OK;
-        }
+            || strncasecmp(jail_url->str+jail_url->host_o+jail_url->host_l,
+                           url->str+url->host_o+url->host_l,
+                           jail_url->file_o-jail_url->host_o-jail_url->host_l) != 0);
+}
+
+/** 
+ * Fill the GET pipeline with the URLs that follow the current
+ * one in the list it was taken from, so that the IO-thread
+ * can download them while this worker is busy parsing. The
+ * downloaded data is picked up by lm_io_get() once 
+ * lm_worker_perform() reaches each URL.
+ *
+ * URLs on other hosts, URLs that will be handled by a 
+ * handler instead of lm_io_get(), and URLs that will be 
+ * rejected by the filter or the jail are skipped.
+ **/
+static void
+lm_worker_prefetch(worker_t *w)
+{
+    uehandle_t *ue_h = w->ue_h;
+    ulist_t    *list;
+    url_t      *url;
+    filetype_t *ft;
+    crawler_t  *cr;
+    int         x, n;
+    int         max = w->io_h->pipeline.count;
+
+    if (!w->prefetch && !(w->prefetch = malloc(max*sizeof(url_t*))))
+        return;
+
+    /* ue_next() moved a new, empty list on top of the one 
+     * the current URL was popped from */
+    if (ue_h->primary.sz < 2)
+        return;
+    /* the transfers of the IO-threads do not go through 
+     * ue_host_check(), so a host that is down is left to
+     * lm_worker_perform() to park */
+    if (ue_h->host_ent->breaker != UE_BREAKER_CLOSED)
+        return;
+    list = &ue_h->primary.row[ue_h->primary.sz-2];
+
+    w->prefetch[0] = ue_h->current;
+    n = 1;
+
+    /* ue_next() pops from the end of the list */
+    for (x=list->sz-1; x>=0 && n<max; x--) {
+        url = lm_ulist_row(list, x);
+        if (!url->sz || !url->bind)
+            continue;
+
+        ft = w->m->filetypes[url->bind-1];
+        cr = (ft->switch_to.ptr ? ft->switch_to.ptr : w->crawler);
+        if (ft->handler.wf || cr->default_handler.wf)
+            continue;
+        /* robots.txt of other hosts might not be known yet */
+        if (lm_url_hostcmp(url, ue_h->current) != 0)
+            continue;
+        if (lm_worker_jailed(w, url)
+                || lm_filter_eval_url(&ue_h->host_ent->filter, url) != LM_FILTER_ALLOW)
+            continue;
+
+        w->prefetch[n++] = url;
     }
 
-    if (lm_filter_eval_url(&w->ue_h->host_ent->filter, w->ue_h->current) != LM_FILTER_ALLOW)
-        return M_OK;
+    lm_multiget_retain(w->io_h, w->prefetch, n);
+
+    for (x=1; x<n; x++) {
+        ft = w->m->filetypes[w->prefetch[x]->bind-1];
+        if (lm_multiget_add(w->io_h, w->prefetch[x], lm_worker_max_body(w, ft)) != M_OK)
+            break;
+    }
+}
+
+/** 
+ * Body size limit for a transfer of the given filetype, the 
+ * filetype's max_body_size overrides the crawler's. The 
+ * crawler is the one the filetype switches to, if any, the 
+ * same that lm_worker_perform() continues with. 0 means 
+ * no limit.
+ **/
+static inline size_t
+lm_worker_max_body(worker_t *w, filetype_t *ft)
+{
+    crawler_t *cr = (ft->switch_to.ptr ? ft->switch_to.ptr : w->crawler);
+
+    return ft->max_body_size ? ft->max_body_size : cr->max_body_size;
+}
+
+/** 
+ * Get the host entry that the given URL belongs to
+ **/
+static struct host_ent *
+lm_worker_url_hostent(worker_t *w, url_t *url)
+{
+    uint16_t o, l;
+
+    if (!LM_URL_ISSET(url, LM_URL_EXTERNAL))
+        return w->ue_h->host_ent;
 
+    o = url->host_o+(LM_URL_ISSET(url, LM_URL_WWW_PREFIX)?4:0);
+    l = url->host_l-(LM_URL_ISSET(url, LM_URL_WWW_PREFIX)?4:0);
+
+    return ue_get_hostent(w->ue_h, url->str+o, l, 1);
+}
+
+/** 
+ * Wait until the per-host scheduler allows a new transfer
+ * to the given host, and set the timeouts of the transfer
+ * from the health of the host. Must be followed by 
+ * lm_worker_host_release() when the transfer is done.
+ *
+ * If the host is down, see ue_host_check(), and the crawler
+ * crawls external URLs, 0 is returned at once, the worker 
+ * has other hosts to go on with and the URL should be put
+ * back with ue_park(). Otherwise, this host is all the 
+ * worker has, so it waits until the host may be tried 
+ * again. 0 is also returned if the worker is told to stop
+ * while waiting.
+ **/
+static int
+lm_worker_host_acquire(worker_t *w, struct host_ent *ent, int peek)
+{
+    struct timespec ts;
+    int ms;
+
+    while ((ms = ue_host_check(w->ue_h->parent, ent, 
+                               &w->io_h->connect_timeout, &w->io_h->timeout)) > 0) {
+        if (lm_crawler_flag_isset(w->crawler, LM_CRFLAG_EXTERNAL)
+                || w->message == LM_WORKER_MSG_STOP)
+            return 0;
+        lm_worker_nap(ms);
+    }
+
+    while ((ms = ue_host_acquire(w->ue_h->parent, ent, peek)) > 0) {
 #ifdef DEBUG
-    fprintf(stderr, "* worker:(%p) URL: %s\n", w, w->ue_h->current->str);
+        fprintf(stderr, "* worker:(%p) waiting %d ms for host '%s'\n", w, ms, ent->str);
 #endif
-    w->m->status_cb(w->m, w, w->ue_h->current);
+        ts.tv_sec  = ms/1000;
+        ts.tv_nsec = (ms%1000)*1000000L;
+        nanosleep(&ts, 0);
+    }
 
-    if (ft->switch_to.ptr)
-        lm_worker_set_crawler(w, ft->switch_to.ptr);
-    
-    /* prepare the attributes list for this filetype, so
-     * that our parsers can fill in values specifically for this
-     * url */
-    lm_attrlist_prepare(&w->attributes, (const char**)ft->attributes, ft->attr_count);
+    return 1;
+}
+
+/** 
+ * Sleep for the given number of ms, at most 
+ * LM_WORKER_NAP_MAX
+ **/
+static void
+lm_worker_nap(int ms)
+{
+    struct timespec ts;
+
+    if (ms > LM_WORKER_NAP_MAX)
+        ms = LM_WORKER_NAP_MAX;
+
+    ts.tv_sec  = ms/1000;
+    ts.tv_nsec = (ms%1000)*1000000L;
+    nanosleep(&ts, 0);
+}
+
+/** 
+ * Put back the current URL when lm_worker_host_acquire() did
+ * not let its transfer through. If the worker is stopping, 
+ * the URL goes back to the list ue_next() took it from, so 
+ * that it stays with the handle and is written to the 
+ * checkpoint, see ue_handle_park(). Otherwise its host is 
+ * down, and the URL is parked with the host, see ue_park().
+ **/
+static M_CODE
+lm_worker_putback(worker_t *w, struct host_ent *ent, url_t *url)
+{
+    uehandle_t *ue_h = w->ue_h;
+    url_t      *t;
+
+    if (w->message != LM_WORKER_MSG_STOP || ue_h->primary.sz < 2)
+        return ue_park(ue_h, ent, url);
+
+    /* url is usually the row just above the end of the list,
+     * which is what lm_ulist_inc() returns */
+    if (!(t = lm_ulist_inc(&ue_h->primary.row[ue_h->primary.sz-2])))
+        return ue_park(ue_h, ent, url);
+    if (t != url) {
+        lm_url_detach(url);
+        lm_url_swap(t, url);
+        ue_h->current = t;
+    }
 
-    /** 
-     * call the handler for this filetype, the handler should download
-     * the data before we go to the parser chain. If this filetype does
-     * not have a handler set, then the default handler for the active
-     * crawler is used.
-     *
-     * TODO: clear all values in 'this' before a javascript handler is
-     *       called?
-     **/
-    wfunction_t *wf = 
-        (ft->handler.wf?ft->handler.wf:
-            (w->crawler->default_handler.wf?w->crawler->default_handler.wf:0));
-    if (wf) {
 #ifdef DEBUG
-        fprintf(stderr, "* worker:(%p) calling handler '%s'\n", w, wf->name);
+    fprintf(stderr, "* worker:(%p) stopping, put back '%s'\n", w, t->str);
 #endif
-        switch (wf->type) {
-            case LM_WFUNCTION_TYPE_NATIVE:
-                r = wf->fn.native_handler(w, w->io_h, w->ue_h->current);
-                break;
-            case LM_WFUNCTION_TYPE_JAVASCRIPT:
-                JS_BeginRequest(w->e4x_cx);
-                jsval url = STRING_TO_JSVAL(
-                        JS_NewStringCopyN(w->e4x_cx, w->ue_h->current->str,
-                            w->ue_h->current->sz)
-                        );
-                r = ((JS_CallFunctionValue(w->e4x_cx, w->e4x_this,
-                                           wf->fn.javascript, 1,
-                                           &url, &ret)
-                        == JS_TRUE) ? M_OK : M_FAILED);
-                JS_EndRequest(w->e4x_cx);
-            default:
-                return M_ERROR;
-        }
-    } else
-        r = lm_io_get(w->io_h, w->ue_h->current);
 
-    if (r != M_OK)
+    return M_OK;
+}
+
+/** 
+ * Mark a transfer started by lm_worker_host_acquire() as 
+ * done, and give its result to the host entry. Transfers 
+ * that never reached the network, such as pipelined ones 
+ * or provided buffers, say nothing about the host.
+ **/
+static void
+lm_worker_host_release(worker_t *w, struct host_ent *ent)
+{
+    iostat_t *t = &w->io_h->transfer;
+
+    ue_host_release(w->ue_h->parent, ent);
+
+    if (t->unreachable)
+        ue_host_done(w->ue_h->parent, ent, 0, 0);
+    else if (t->ttfb)
+        ue_host_done(w->ue_h->parent, ent, 1, t->ttfb);
+
+    w->io_h->connect_timeout = 0;
+    w->io_h->timeout         = 0;
+}
+
+/** 
+ * Look up a filetype by the given Content-Type, ignoring
+ * parameters such as charset.
+ **/
+static filetype_t *
+lm_worker_match_mime(worker_t *w, const char *content_type)
+{
+    char   mime[128];
+    size_t len;
+
+    if (!content_type)
+        return 0;
+
+    len = strcspn(content_type, ";");
+    if (len >= sizeof(mime))
+        return 0;
+
+    memcpy(mime, content_type, len);
+    mime[len] = '\0';
+
+    return lm_ftindex_match_by_mime(&w->crawler->ftindex, mime);
+}
+
+/** 
+ * Returns 1 if URLs of the given filetype are downloaded 
+ * with lm_io_get() and parsed, that is if the filetype 
+ * has parsers but no handler.
+ **/
+static int
+lm_worker_wants_body(worker_t *w, filetype_t *ft)
+{
+    crawler_t *cr = (ft->switch_to.ptr ? ft->switch_to.ptr : w->crawler);
+
+    return (FT_FLAG_ISSET(ft, FT_FLAG_HAS_PARSER)
+            && !ft->handler.wf && !cr->default_handler.wf);
+}
+
+/** 
+ * Content-Type check for lm_worker_lookup(), called by the 
+ * IO layer once the headers of the response are received. 
+ * Returns 0 to abort the transfer if the body is not needed.
+ **/
+static int
+lm_worker_accept(iosink_t *s, const char *content_type)
+{
+    worker_t   *w = s->accept_data;
+    filetype_t *ft;
+
+    if (!(ft = lm_worker_match_mime(w, content_type))
+            || !lm_worker_wants_body(w, ft))
+        return 0;
+
+    s->max = lm_worker_max_body(w, ft);
+
+    return 1;
+}
+
+/** 
+ * Download a URL whose filetype could not be determined by
+ * looking at the URL, and bind it by the Content-Type of the
+ * response. Used instead of a HEAD request in lm_worker_sort()
+ * when get_lookup is enabled, so that each such URL costs one
+ * request instead of two.
+ *
+ * The transfer is aborted as soon as the headers show that
+ * the body is not needed. Otherwise the body is kept in 
+ * w->io_h->buf and 'fetched' is set. On return, url->bind is 
+ * 0 if there is nothing more to do with the URL.
+ **/
+static M_CODE
+lm_worker_lookup(worker_t *w, url_t *url, int *fetched)
+{
+    struct host_ent *ent = lm_worker_url_hostent(w, url);
+    filetype_t *ft;
+    M_CODE r;
+
+    url->flags &= ~LM_URL_LOOKUP;
+    *fetched = 0;
+
+    w->io_h->sink.accept      = &lm_worker_accept;
+    w->io_h->sink.accept_data = w;
+    w->io_h->max_body         = w->crawler->max_body_size;
+
+    if (!lm_worker_host_acquire(w, ent, 0)) {
+        w->io_h->sink.accept = 0;
+        w->io_h->max_body    = 0;
+        /* look the URL up when it is taken again, url->bind 
+         * is left 0 so that lm_worker_perform() stops here */
+        url->flags |= LM_URL_LOOKUP;
+        return lm_worker_putback(w, ent, url);
+    }
+
+    r = lm_io_get(w->io_h, url);
+    lm_worker_host_release(w, ent);
+
+    w->io_h->sink.accept = 0;
+    w->io_h->max_body    = 0;
+
+    if (r != M_OK || lm_worker_redirect(w))
         return r;
 
-    /** 
-     * Handler is done, time to do our own logic. If the transfer was over HTTP and we got a 
-     * redirect, we will add the URL given by the "Location" header to the URL engine.
-     **/
+    if (!(ft = lm_worker_match_mime(w, w->io_h->transfer.headers.content_type))
+            || lm_worker_bind_url(w, url, ft, 0, 0) != 0)
+        return M_OK;
+
+#ifdef DEBUG
+    fprintf(stderr, "* worker:(%p) bound '%s' by GET to '%s'\n", w, url->str, ft->name);
+#endif
+    *fetched = (!w->io_h->sink.rejected && lm_worker_wants_body(w, ft));
+    return M_OK;
+}
+
+/** 
+ * If the last transfer over HTTP got a redirect, add the URL
+ * given by the "Location" header to the URL engine. Returns 1
+ * if the transfer was a redirect.
+ **/
+static int
+lm_worker_redirect(worker_t *w)
+{
     if (w->io_h->transfer.status_code >= 300
             && w->io_h->transfer.status_code < 400) {
         if (w->io_h->transfer.headers.location) {
@@ -809,7 +1153,7 @@ lm_worker_perform(worker_t *w)
             if (w->redirects >= 20) {
                 LM_WARNING(w->m, "breaking out of possible redirect loop");
                 w->redirects = 0;
-                return M_OK;
+                return 1;
             }
             /* add the value of the location header to a 
              * temporary new URL structure, we'll compare it 
@@ -827,11 +1171,123 @@ lm_worker_perform(worker_t *w)
                     ue_move_to_secondary(w->ue_h, &tmp);
             }
             lm_url_uninit(&tmp);
-            return M_OK;
+            return 1;
         }
     }
 
     w->redirects = 0;
+    return 0;
+}
+
+/** 
+ * Perform a transfer on one URL
+ **/
+static M_CODE
+lm_worker_perform(worker_t *w)
+{
+    M_CODE r;
+    int x;
+    int streamed = 0;
+    int fetched  = 0;
+    jsval ret;
+    url_t      *url = w->ue_h->current;
+    filetype_t *ft;
+
+    if (lm_worker_jailed(w, url))
+        return M_OK;
+
+    if (lm_filter_eval_url(&w->ue_h->host_ent->filter, url) != LM_FILTER_ALLOW)
+        return M_OK;
+
+#ifdef DEBUG
+    fprintf(stderr, "* worker:(%p) URL: %s\n", w, url->str);
+#endif
+    w->m->status_cb(w->m, w, url);
+
+    /* the filetype of this URL is not known until it is downloaded */
+    if (LM_URL_ISSET(url, LM_URL_LOOKUP)
+            && ((r = lm_worker_lookup(w, url, &fetched)) != M_OK || !url->bind))
+        return r;
+
+    ft = w->m->filetypes[url->bind-1];
+
+    if (ft->switch_to.ptr)
+        lm_worker_set_crawler(w, ft->switch_to.ptr);
+    
+    /* prepare the attributes list for this filetype, so
+     * that our parsers can fill in values specifically for this
+     * url */
+    lm_attrlist_prepare(&w->attributes, (const char**)ft->attributes, ft->attr_count);
+
+    /** 
+     * call the handler for this filetype, the handler should download
+     * the data before we go to the parser chain. If this filetype does
+     * not have a handler set, then the default handler for the active
+     * crawler is used.
+     *
+     * TODO: clear all values in 'this' before a javascript handler is
+     *       called?
+     **/
+    wfunction_t *wf = 
+        (ft->handler.wf?ft->handler.wf:
+            (w->crawler->default_handler.wf?w->crawler->default_handler.wf:0));
+
+    if (!fetched) {
+        struct host_ent *ent = lm_worker_url_hostent(w, url);
+        if (!lm_worker_host_acquire(w, ent, 0))
+            return lm_worker_putback(w, ent, url);
+        w->io_h->max_body = lm_worker_max_body(w, ft);
+
+        if (wf) {
+#ifdef DEBUG
+            fprintf(stderr, "* worker:(%p) calling handler '%s'\n", w, wf->name);
+#endif
+            switch (wf->type) {
+                case LM_WFUNCTION_TYPE_NATIVE:
+                    r = wf->fn.native_handler(w, w->io_h, url);
+                    break;
+                case LM_WFUNCTION_TYPE_JAVASCRIPT:
+                    JS_BeginRequest(w->e4x_cx);
+                    jsval jurl = STRING_TO_JSVAL(
+                            JS_NewStringCopyN(w->e4x_cx, url->str, url->sz)
+                            );
+                    r = ((JS_CallFunctionValue(w->e4x_cx, w->e4x_this,
+                                               wf->fn.javascript, 1,
+                                               &jurl, &ret)
+                            == JS_TRUE) ? M_OK : M_FAILED);
+                    JS_EndRequest(w->e4x_cx);
+                default:
+                    lm_worker_host_release(w, ent);
+                    w->io_h->max_body = 0;
+                    return M_ERROR;
+            }
+        } else if (FT_FLAG_ISSET(ft, FT_FLAG_STREAMING)
+                && ft->parser_chain.num_parsers == 1
+                && ft->parser_chain.parsers[0]->native_stream
+                && !ft->attr_count) {
+            /* the only parser can work on the data while it is 
+             * downloaded, and nothing needs the full body afterwards */
+            iostream_t st;
+            st.cb    = ft->parser_chain.parsers[0]->native_stream;
+            st.data  = w;
+            st.state = 0;
+            r = lm_io_get_stream(w->io_h, url, &st);
+            streamed = 1;
+        } else
+            r = lm_io_get(w->io_h, url);
+
+        lm_worker_host_release(w, ent);
+        w->io_h->max_body = 0;
+
+        if (r != M_OK)
+            return r;
+    }
+
+    if (lm_worker_redirect(w))
+        return M_OK;
+
+    if (streamed)
+        return M_OK;
 
     /**
      * Call each parser in the parser chain, giving the first the
@@ -858,7 +1314,10 @@ lm_worker_perform(worker_t *w)
                     char *from = JS_GetStringBytes(JSVAL_TO_STRING(d));
                     long len  = JS_GetStringLength(JSVAL_TO_STRING(d));
                     if (w->io_h->buf.cap < len) {
-                        w->io_h->buf.ptr = realloc(w->io_h->buf.ptr, len);
+                        /* a cap of 0 means a mapped file, which is not ours to realloc() */
+                        w->io_h->buf.ptr = (w->io_h->buf.cap
+                                            ? realloc(w->io_h->buf.ptr, len)
+                                            : malloc(len));
                         w->io_h->buf.cap = len;
                     }
                     memcpy(w->io_h->buf.ptr, from, len);
@@ -996,19 +1455,31 @@ lm_worker_get_robotstxt(worker_t *w, struct host_ent *ent)
 
     char *opt_s, *opt_e, *val_s, *val_e;
 
-    if (!(url = malloc(ent->len+19))) 
+    if (!(url = malloc(ent->len+20))) 
         return M_OUT_OF_MEM;
 
+    /* ask over the same protocol as the first URL on this host */
     url_t u;
-    u.sz=sprintf(url, "http://%s/robots.txt", ent->str);
-    u.protocol = LM_PROTOCOL_HTTP;
+    u.protocol = (w->ue_h->current->protocol == LM_PROTOCOL_HTTPS
+                  ? LM_PROTOCOL_HTTPS : LM_PROTOCOL_HTTP);
+    u.sz=sprintf(url, "%s://%s/robots.txt",
+                 (u.protocol == LM_PROTOCOL_HTTPS ? "https" : "http"), ent->str);
     u.str=url;
     
 #ifdef DEBUG
     fprintf(stderr, "* worker:(%p) updating filters (%s)\n", w, url);
 #endif
 
-    if ((status = lm_io_get(w->io_h, &u)) == M_OK) {
+    if (!lm_worker_host_acquire(w, ent, 0)) {
+        /* asked again the next time a worker enters the host */
+        free(url);
+        return M_FAILED;
+    }
+
+    status = lm_io_get(w->io_h, &u);
+    lm_worker_host_release(w, ent);
+
+    if (status == M_OK) {
         for (s=w->io_h->buf.ptr, e=w->io_h->buf.ptr+w->io_h->buf.sz;s<e;s++) {
             while (isspace(*s) && s<e)
                 s++; 
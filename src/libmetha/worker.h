@@ -72,6 +72,10 @@ typedef struct worker {
     int          message;
     int          redirects;
 
+    /* URLs currently allowed to occupy the GET pipeline,
+     * see lm_worker_prefetch() */
+    url_t      **prefetch;
+
     /* attribute list used for all urls matching a filetype */
     attr_list_t attributes;
 
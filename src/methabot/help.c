@@ -69,9 +69,9 @@ static struct opt_help {
     }, {
         1, 'N', "num-pipelines",
         "Set this option to an  integer  value to specify how many concurrent\n"
-        "HTTP HEAD requests  Methabot  is  allowed  to  do. HEAD requests are\n"
-        "sometimes necessary for Methabot  to be able to determine the actual\n"
-        "type of a file.\n\n"
+        "HTTP GET requests each worker is allowed to have in flight. While a\n"
+        "worker parses one page, the following pages in its queue are fetched\n"
+        "in the background. A value of 1 disables this.\n\n"
         "It is recommended not to set this value too high, as web admins will\n"
         "most likely ban your IP if you crawl their websites too fast.\n\n"
         "Default is 8.\n"
@@ -104,6 +104,23 @@ static struct opt_help {
         "If this option is set, Methabot will  automatically receive and send\n"
         "cookie information for each  website.  Cookies  are set when an HTTP\n"
         "server send the header Set-Cookie.\n"
+    }, {
+        1, 0, "checkpoint",
+        "Set this option to a file name to make the crawl resumable. When\n"
+        "Methabot exits, it saves the URLs it has not yet crawled and the\n"
+        "URLs it has seen to the file. If the file exists when Methabot is\n"
+        "started, the saved session is continued.\n\n"
+        "Hitting Ctrl+C once stops the session and saves the checkpoint,\n"
+        "hitting it again quits immediately.\n"
+    }, {
+        1, 0, "host-order",
+        "Set the order in which Methabot crawls the hosts it finds when the\n"
+        "'external' option is enabled.\n\n"
+        "Value can be any of:\n"
+        "  inlinks      Hosts that more URLs link to first (default).\n"
+        "  backlog      Hosts with more URLs waiting to be crawled first.\n"
+        "  fifo         Hosts in the order they were found.\n"
+        "  lifo         The most recently found host first.\n"
     }
 };
 
@@ -240,7 +257,7 @@ mb_help(void)
        "Other options: \n"
 /*       " -E, --global-expr      <expr> Global URL expression\n"*/
        " -s, --silent                  Don't display as much output\n"
-       " -N, --num-pipelines     <int> Max concurrent HEAD requests (default: 8)\n"
+       " -N, --num-pipelines     <int> Max concurrent GET requests per worker (default: 8)\n"
        " -n, --num-workers       <int> Max concurrent worker threads (default: 1)\n"
        " -a, --user-agent        <str> Set user agent\n"
        " -b, --base-url          <url> Build initial links using given URL\n"
@@ -248,6 +265,8 @@ mb_help(void)
        " -c, --enable-cookies          Enable automatic cookie handling\n"
        " -T, --type           <string> Filetype of first URL(s)/stdin\n"
        "     --config          <files> Relative or absolute path to a config file\n"
+       "     --checkpoint       <file> Save the session to file on exit, resume from it\n"
+       "     --host-order        <str> Order to crawl external hosts in (default: inlinks)\n"
        "     --examples                Example usage\n"
        "     --info                    Output install/build/config/run information\n"
        "     --proxy   <user:pwd@host> Set proxy server\n"
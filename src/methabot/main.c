@@ -68,6 +68,8 @@ static int          spread_workers      = 0;
 static char        *config              = 0;
 static char        *handler             = 0;
 static char        *def_handler         = 0;
+static char        *checkpoint          = 0;
+static char        *host_order          = 0;
 
 /* methabot-specific data */
 char        *home_conf           = 0; /* user-specific configuration directory */
@@ -113,6 +115,8 @@ static struct option opts[] =
     {"jail",            no_argument,        0,      'j'},
     {"handler",         required_argument,  0,      10},
     {"default-handler", required_argument,  0,      11},
+    {"checkpoint",      required_argument,  0,      12},
+    {"host-order",      required_argument,  0,      13},
     {0, 0, 0, 0}
 };
 
@@ -209,6 +213,8 @@ main(int argc, char **argv)
             case 9:   config         = optarg; break;
             case 10:  handler        = optarg; break;
             case 11:  def_handler    = optarg; break;
+            case 12:  checkpoint     = optarg; break;
+            case 13:  host_order     = optarg; break;
             case 'a': user_agent     = optarg; break;
             case 'b': base_url       = optarg; break;
             case 'm': mimetypes      = optarg; break;
@@ -343,6 +349,13 @@ main(int argc, char **argv)
             goto error;
     }
 
+    if (host_order) {
+        if ((status = lmetha_setopt(m, LMOPT_HOST_ORDER, host_order)) != M_OK) {
+            fprintf(stderr, "mb: error: invalid host order '%s'\n", host_order);
+            goto error;
+        }
+    }
+
     if ((status = lmetha_setopt(m, LMOPT_ENABLE_COOKIES, cookies)) != M_OK)
         goto error;
     if ((status = lmetha_setopt(m, LMOPT_ENABLE_BUILTIN_PARSERS, 1)) != M_OK)
@@ -351,6 +364,8 @@ main(int argc, char **argv)
         goto error;
     if ((status = lmetha_setopt(m, LMOPT_NUM_THREADS, num_threads)) != M_OK)
         goto error;
+    if ((status = lmetha_setopt(m, LMOPT_NUM_PIPELINES, num_pipelines)) != M_OK)
+        goto error;
     if ((status = lmetha_setopt(m, LMOPT_INITIAL_CRAWLER, "default")) != M_OK)
         goto error;
     if ((status = lmetha_setopt(m, LMOPT_USERAGENT, user_agent)) != M_OK)
@@ -374,6 +389,14 @@ main(int argc, char **argv)
         mb_dump_crawlers(m);
     }
 
+    if (checkpoint && access(checkpoint, F_OK) == 0) {
+        /* continue the session saved in the checkpoint */
+        if ((status = lmetha_resume(m, checkpoint)) != M_OK) {
+            fprintf(stderr, "mb: error: unable to resume from %s\n", checkpoint);
+            goto error;
+        }
+    }
+
     if (download_dir)
         chdir(download_dir);
 
@@ -405,9 +428,20 @@ main(int argc, char **argv)
         free(stdin_buf);
     }
 
+    if (checkpoint)
+        sig_set_session(m);
+
     if ((status = lmetha_exec(m, argc, (const char **)argv)) != M_OK)
         goto error;
 
+    if (checkpoint) {
+        sig_set_session(0);
+        if ((status = lmetha_checkpoint(m, checkpoint)) != M_OK) {
+            fprintf(stderr, "mb: error: unable to write %s\n", checkpoint);
+            goto error;
+        }
+    }
+
     lmetha_destroy(m);
     lmetha_global_cleanup();
     mb_uninit();
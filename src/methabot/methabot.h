@@ -27,6 +27,7 @@
 extern metha_t mb;
 
 void sig_register_all(void);
+void sig_set_session(metha_t *m);
 
 #endif
 
@@ -28,6 +28,9 @@
 VOID sig_int(int s);
 VOID sig_seg(int s);
 
+/* session to stop on SIGINT, see --checkpoint */
+static metha_t * volatile session = 0;
+
 void
 sig_register_all(void)
 {
@@ -35,9 +38,29 @@ sig_register_all(void)
     signal(SIGSEGV, &sig_seg);
 }
 
+/** 
+ * While a session is set, the first SIGINT stops it instead 
+ * of exiting, so that a checkpoint can be written
+ **/
+void
+sig_set_session(metha_t *m)
+{
+    session = m;
+}
+
 VOID
 sig_int(int s)
 {
+    metha_t *m;
+
+    if ((m = session)) {
+        session = 0;
+        printf("\r-- SIGINT, stopping and saving checkpoint\n");
+        printf("-- hit Ctrl+C again to force quit\n");
+        lmetha_signal(m, LM_SIGNAL_EXIT);
+        return;
+    }
+
     printf("\r-- SIGINT, exiting\n");
     exit(0);
     /*static int force = 0;